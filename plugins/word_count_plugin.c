@@ -72,15 +72,10 @@ static int count_chars(const char* text) {
     return strlen(text);
 }
 
-static void word_count_on_render(EditorState* state) {
-    (void)state;
-}
-
 static PluginInterface plugin_interface = {
     .name = "Word Count Plugin",
     .version = "1.0",
     .description = "Provides word count functionality",
-    .on_render = word_count_on_render,
 };
 
 
@@ -0,0 +1,727 @@
+#include "editor.h"
+#include <string.h>
+
+/*
+ * Line-indexed piece table.
+ *
+ * Every entry of state->lines is one piece. A piece either borrows its text
+ * from the original file buffer (doc.base, cap == 0) or owns a right-sized
+ * heap buffer holding edited text (cap > 0). Borrowed pieces are never
+ * written to: the first edit copies the line, so text memory grows with the
+ * number of edited lines instead of with the size of the file.
+ *
+ * The line index does not shrink that way. Loading finds every line break
+ * in one pass, and each line costs a pointer plus a DocLineInfo (64 bytes
+ * together) whether or not it is ever edited or shown. Data only some lines
+ * need is kept elsewhere: highlight spans are allocated for drawn lines and
+ * bracket summaries live in the bracket tree, built on the first match.
+ *
+ * The base buffer holds the file as read in one pass, and lines are
+ * terminated by overwriting their '\n' in place, so loading allocates
+ * nothing per line. Lines inserted in bulk (a paste) borrow the same way
+ * from one block per insertion. A block
+ * counts the lines borrowing from it and is freed with the last of them,
+ * unless the saved snapshot was taken while it was in use.
+ *
+ * Dirty tracking keeps a hash per owned line and a document hash that is the
+ * wrapping sum of all mixed line hashes, relative to the loaded text. Each
+ * edit subtracts the old line's contribution and adds the new one, so
+ * comparing against the saved state costs O(1). Borrowed lines are unedited
+ * and hash their text only when they are first changed or removed.
+ *
+ * The saved baseline (state->original_lines) is a copy-on-write snapshot.
+ * Taking it only bumps the epoch and aliases the line array; the array is
+ * copied on the first edit afterwards. An owned buffer from an older epoch
+ * belongs to the snapshot as well, so it is copied before being written and
+ * handed to the snapshot's retired list instead of being freed.
+ *
+ * Every primitive edit is reported to the undo journal (undo.c) before the
+ * text changes; the composite operations (split, join) are built from the
+ * primitives and need no recording of their own.
+ */
+
+#define DOC_MIN_LINE_CAP 16
+#define DOC_MIN_LINES    64
+
+static int doc_reserve(EditorState* state, int extra)
+{
+    Document* doc = &state->doc;
+    int needed = state->line_count + extra;
+    if (needed <= doc->capacity) return 0;
+
+    int new_cap = doc->capacity > 0 ? doc->capacity : DOC_MIN_LINES;
+    while (new_cap < needed) {
+        new_cap += new_cap / 2;
+    }
+
+    char** lines = (char**)realloc(state->lines, (size_t)new_cap * sizeof(char*));
+    if (!lines) return -1;
+    state->lines = lines;
+
+    DocLineInfo* info = (DocLineInfo*)realloc(doc->info, (size_t)new_cap * sizeof(DocLineInfo));
+    if (!info) return -1;
+    doc->info = info;
+
+    doc->capacity = new_cap;
+    return 0;
+}
+
+static char* doc_alloc_text(const char* text, int len, int* cap_out)
+{
+    int cap = DOC_MIN_LINE_CAP;
+    while (cap <= len) cap += cap / 2;
+    char* buf = (char*)malloc(cap);
+    if (!buf) return NULL;
+    if (len > 0) memcpy(buf, text, len);
+    buf[len] = '\0';
+    *cap_out = cap;
+    return buf;
+}
+
+static int doc_line_shared(EditorState* state, int y)
+{
+    return state->original_lines && state->doc.info[y].cap > 0 &&
+           state->doc.info[y].epoch != state->doc.epoch;
+}
+
+static void doc_retire(Document* doc, char* buf)
+{
+    if (doc->retired_count == doc->retired_cap) {
+        int cap = doc->retired_cap > 0 ? doc->retired_cap * 2 : DOC_MIN_LINES;
+        char** retired = (char**)realloc(doc->retired, (size_t)cap * sizeof(char*));
+        if (!retired) return;
+        doc->retired = retired;
+        doc->retired_cap = cap;
+    }
+    doc->retired[doc->retired_count++] = buf;
+}
+
+static int doc_keep_block(Document* doc, char* text, size_t size, int lines)
+{
+    if (doc->block_count == doc->block_cap) {
+        int cap = doc->block_cap > 0 ? doc->block_cap * 2 : 8;
+        DocBlock* blocks = (DocBlock*)realloc(doc->blocks, (size_t)cap * sizeof(DocBlock));
+        if (!blocks) return -1;
+        doc->blocks = blocks;
+        doc->block_cap = cap;
+    }
+    int at = doc->block_count;
+    while (at > 0 && (uintptr_t)doc->blocks[at - 1].text > (uintptr_t)text) at--;
+    memmove(&doc->blocks[at + 1], &doc->blocks[at], (size_t)(doc->block_count - at) * sizeof(DocBlock));
+    doc->blocks[at] = (DocBlock){ text, size, lines, 0 };
+    doc->block_count++;
+    return 0;
+}
+
+static void doc_drop_block(Document* doc, int i)
+{
+    free(doc->blocks[i].text);
+    doc->block_count--;
+    memmove(&doc->blocks[i], &doc->blocks[i + 1], (size_t)(doc->block_count - i) * sizeof(DocBlock));
+}
+
+/* Called when a line stops borrowing text; frees the block it came from once unused. */
+static void doc_unborrow(Document* doc, const char* text)
+{
+    uintptr_t p = (uintptr_t)text;
+    if (doc->base && p >= (uintptr_t)doc->base && p < (uintptr_t)doc->base + doc->base_size) return;
+
+    int lo = 0, hi = doc->block_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((uintptr_t)doc->blocks[mid].text <= p) lo = mid + 1; else hi = mid;
+    }
+    if (lo == 0) return;
+    DocBlock* block = &doc->blocks[lo - 1];
+    if (p >= (uintptr_t)block->text + block->size) return;
+    if (--block->lines == 0 && !block->pinned) doc_drop_block(doc, lo - 1);
+}
+
+/* Gives the snapshot its own line array before the document's changes. */
+static int doc_detach_snapshot(EditorState* state)
+{
+    if (!state->doc.snapshot_shared) return 0;
+    size_t size = (size_t)state->original_line_count * sizeof(char*);
+    char** copy = (char**)malloc(size > 0 ? size : 1);
+    if (!copy) return -1;
+    memcpy(copy, state->original_lines, size);
+    state->original_lines = copy;
+    state->doc.snapshot_shared = 0;
+    return 0;
+}
+
+static void doc_release_line(EditorState* state, int y)
+{
+    if (doc_line_shared(state, y)) {
+        doc_retire(&state->doc, state->lines[y]);
+    } else if (state->doc.info[y].cap > 0) {
+        free(state->lines[y]);
+    } else if (state->lines[y]) {
+        doc_unborrow(&state->doc, state->lines[y]);
+    }
+    state->lines[y] = NULL;
+    state->doc.info[y].cap = 0;
+    state->doc.info[y].len = 0;
+}
+
+static uint64_t doc_hash_text(const char* text, int len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t doc_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int doc_count_words(const char* text, int len)
+{
+    int words = 0;
+    int in_word = 0;
+    for (int i = 0; i < len; i++) {
+        if (isspace((unsigned char)text[i])) {
+            in_word = 0;
+        } else if (!in_word) {
+            in_word = 1;
+            words++;
+        }
+    }
+    return words;
+}
+
+/*
+ * Hashes the bracket, comment and quote characters of a line, and which of
+ * them touch. Highlighting of other lines only depends on these, so an edit
+ * that keeps the shape only needs its own line redrawn.
+ */
+static const unsigned char doc_shape_chars[256] = {
+    ['('] = 1, [')'] = 1, ['['] = 1, [']'] = 1, ['{'] = 1, ['}'] = 1,
+    ['/'] = 1, ['*'] = 1, ['"'] = 1, ['\''] = 1, ['`'] = 1, ['\\'] = 1,
+};
+
+static uint64_t doc_shape_text(const char* text, int len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    int last = -2;
+    for (int i = 0; i < len; i++) {
+        if (!doc_shape_chars[(unsigned char)text[i]]) continue;
+        h ^= (unsigned char)text[i] | (last == i - 1 ? 0x100 : 0);
+        h *= 1099511628211ULL;
+        last = i;
+    }
+    return h;
+}
+
+static void doc_drop_spans(DocLineInfo* info)
+{
+    free(info->spans);
+    info->spans = NULL;
+    info->span_count = -1;
+}
+
+/* Removes line y from the document hash; call before the line changes. */
+static void doc_unhash_line(EditorState* state, int y)
+{
+    DocLineInfo* info = &state->doc.info[y];
+    doc_drop_spans(info);
+    uint64_t h = info->cap > 0 ? info->hash : doc_hash_text(state->lines[y], info->len);
+    state->doc.hash -= doc_mix(h);
+    state->doc.pending_shape = doc_shape_text(state->lines[y], info->len);
+    if (info->words >= 0) {
+        state->doc.word_count -= info->words;
+    } else {
+        state->doc.uncounted--;
+    }
+    state->doc.char_count -= info->len;
+}
+
+/* Adds line y back into the document hash; call after the line changed. */
+static void doc_rehash_line(EditorState* state, int y)
+{
+    DocLineInfo* info = &state->doc.info[y];
+    info->hash = doc_hash_text(state->lines[y], info->len);
+    state->doc.hash += doc_mix(info->hash);
+    state->doc.generation++;
+    info->version = state->doc.generation;
+    info->lex |= LEX_STALE;
+    if (y < state->doc.lex_valid) state->doc.lex_valid = y;
+    bracket_index_touch(&state->doc.brackets, y);
+    info->words = doc_count_words(state->lines[y], info->len);
+    state->doc.word_count += info->words;
+    state->doc.char_count += info->len;
+    if (doc_shape_text(state->lines[y], info->len) != state->doc.pending_shape) {
+        state->doc.context_version++;
+    }
+}
+
+static void doc_release_base(Document* doc)
+{
+    free(doc->base);
+    doc->base = NULL;
+}
+
+/* Returns a buffer for line y that may be written to and holds need + 1 bytes. */
+static char* doc_writable_line(EditorState* state, int y, int need)
+{
+    DocLineInfo* info = &state->doc.info[y];
+    int shared = doc_line_shared(state, y);
+    if (info->cap > need && !shared) return state->lines[y];
+
+    if (info->cap == 0 || shared) {
+        int cap;
+        char* buf = doc_alloc_text(state->lines[y], info->len, &cap);
+        if (!buf) return NULL;
+        if (cap <= need) {
+            while (cap <= need) cap += cap / 2;
+            char* grown = (char*)realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+        if (shared) {
+            doc_retire(&state->doc, state->lines[y]);
+        } else {
+            doc_unborrow(&state->doc, state->lines[y]);
+        }
+        state->lines[y] = buf;
+        info->cap = cap;
+        info->epoch = state->doc.epoch;
+        return buf;
+    }
+
+    int cap = info->cap;
+    while (cap <= need) cap += cap / 2;
+    char* grown = (char*)realloc(state->lines[y], cap);
+    if (!grown) return NULL;
+    state->lines[y] = grown;
+    info->cap = cap;
+    return grown;
+}
+
+int doc_init(EditorState* state)
+{
+    if (!state) return -1;
+    state->lines = NULL;
+    state->line_count = 0;
+    memset(&state->doc, 0, sizeof(state->doc));
+    int result = doc_insert_line(state, 0, "", 0);
+    undo_clear(state);
+    return result;
+}
+
+void doc_free(EditorState* state)
+{
+    if (!state) return;
+    doc_snapshot_free(state);
+    for (int i = 0; i < state->line_count; i++) {
+        doc_release_line(state, i);
+        doc_drop_spans(&state->doc.info[i]);
+    }
+    free(state->lines);
+    free(state->doc.info);
+    doc_release_base(&state->doc);
+    for (int i = 0; i < state->doc.block_count; i++) {
+        free(state->doc.blocks[i].text);
+    }
+    free(state->doc.blocks);
+    bracket_index_free(&state->doc.brackets);
+    highlight_reset(state);
+    unsigned long context_version = state->doc.context_version;
+    state->lines = NULL;
+    state->line_count = 0;
+    memset(&state->doc, 0, sizeof(state->doc));
+    state->doc.context_version = context_version + 1;
+}
+
+/* Splits size bytes of base text, which has room for a terminator, into borrowed lines. */
+static int doc_split_base(EditorState* state, char* data, size_t size)
+{
+    char* line_start = data;
+    char* end = data + size;
+    int i = 0;
+    for (;; i++) {
+        state->line_count = i;
+        if (doc_reserve(state, 1) != 0) return -1;
+        char* nl = memchr(line_start, '\n', end - line_start);
+        int len = (int)((nl ? nl : end) - line_start);
+        line_start[len] = '\0';
+        state->lines[i] = line_start;
+        state->doc.info[i].cap = 0;
+        state->doc.info[i].len = len;
+        state->doc.info[i].version = 0;
+        state->doc.info[i].words = -1;
+        state->doc.info[i].lex = LEX_UNKNOWN;
+        state->doc.info[i].spans = NULL;
+        state->doc.info[i].span_count = -1;
+        if (!nl) break;
+        line_start += len + 1;
+    }
+    int count = i + 1;
+    state->line_count = count;
+    state->doc.uncounted = count;
+    state->doc.char_count = (long)size - (count - 1);
+    return 0;
+}
+
+/*
+ * Takes ownership of data, which must have room for size + 1 bytes. Lines are
+ * split in place and keep pointing into the buffer until they are edited.
+ */
+int doc_load_buffer(EditorState* state, char* data, size_t size)
+{
+    if (!state || !data) return -1;
+
+    doc_free(state);
+    undo_clear(state);
+    state->doc.base = data;
+    state->doc.base_size = size + 1;
+    if (doc_split_base(state, data, size) != 0) {
+        doc_free(state);
+        return -1;
+    }
+    return 0;
+}
+
+int doc_line_length(EditorState* state, int y)
+{
+    if (!state || y < 0 || y >= state->line_count) return 0;
+    return state->doc.info[y].len;
+}
+
+/*
+ * Counts the words of loaded lines that have not been counted yet, stopping
+ * after about budget bytes. Edited lines are counted as they change, so the
+ * totals are complete once this has seen every loaded line. Returns 1 while
+ * lines remain uncounted.
+ */
+int doc_count_step(EditorState* state, long budget)
+{
+    if (!state) return 0;
+    Document* doc = &state->doc;
+    while (doc->uncounted > 0 && budget > 0) {
+        if (doc->count_next >= state->line_count) doc->count_next = 0;
+        DocLineInfo* info = &doc->info[doc->count_next];
+        if (info->words < 0) {
+            info->words = doc_count_words(state->lines[doc->count_next], info->len);
+            doc->word_count += info->words;
+            doc->uncounted--;
+            budget -= info->len + 1;
+        }
+        doc->count_next++;
+    }
+    return doc->uncounted > 0;
+}
+
+/* Returns the word total, or -1 while doc_count_step has lines left. */
+long doc_word_count(EditorState* state)
+{
+    if (!state || state->doc.uncounted > 0) return -1;
+    return state->doc.word_count;
+}
+
+long doc_char_count(EditorState* state)
+{
+    if (!state) return 0;
+    return state->doc.char_count;
+}
+
+/* Inserts text at column x of line y, padding with spaces when x is past the end. */
+int doc_insert_text(EditorState* state, int y, int x, const char* text, int len)
+{
+    if (!state || y < 0 || y >= state->line_count || len < 0) return -1;
+    if (doc_detach_snapshot(state) != 0) return -1;
+    if (x < 0) x = 0;
+
+    int line_len = state->doc.info[y].len;
+    int pad = x > line_len ? x - line_len : 0;
+    doc_unhash_line(state, y);
+    char* line = doc_writable_line(state, y, line_len + pad + len);
+    if (!line) {
+        doc_rehash_line(state, y);
+        return -1;
+    }
+
+    if (pad > 0) {
+        memset(line + line_len, ' ', pad);
+        undo_record(state, UNDO_INSERT, y, line_len, line + line_len, pad);
+        line_len += pad;
+        line[line_len] = '\0';
+    }
+    if (len > 0) undo_record(state, UNDO_INSERT, y, x, text, len);
+    memmove(line + x + len, line + x, line_len - x + 1);
+    if (len > 0) memcpy(line + x, text, len);
+    state->doc.info[y].len = line_len + len;
+    doc_rehash_line(state, y);
+    return 0;
+}
+
+int doc_delete_text(EditorState* state, int y, int x, int len)
+{
+    if (!state || y < 0 || y >= state->line_count) return -1;
+    int line_len = state->doc.info[y].len;
+    if (x < 0) x = 0;
+    if (x >= line_len || len <= 0) return 0;
+    if (len > line_len - x) len = line_len - x;
+    if (doc_detach_snapshot(state) != 0) return -1;
+
+    doc_unhash_line(state, y);
+    char* line = doc_writable_line(state, y, line_len);
+    if (!line) {
+        doc_rehash_line(state, y);
+        return -1;
+    }
+    undo_record(state, UNDO_DELETE, y, x, line + x, len);
+    memmove(line + x, line + x + len, line_len - x - len + 1);
+    state->doc.info[y].len = line_len - len;
+    doc_rehash_line(state, y);
+    return 0;
+}
+
+/* Replaces old_len bytes at column x of line y with text, moving the tail once. */
+int doc_replace_text(EditorState* state, int y, int x, int old_len, const char* text, int len)
+{
+    if (!state || y < 0 || y >= state->line_count || len < 0) return -1;
+    int line_len = state->doc.info[y].len;
+    if (x < 0 || x > line_len || old_len < 0 || old_len > line_len - x) return -1;
+    if (doc_detach_snapshot(state) != 0) return -1;
+
+    doc_unhash_line(state, y);
+    char* line = doc_writable_line(state, y, line_len - old_len + len);
+    if (!line) {
+        doc_rehash_line(state, y);
+        return -1;
+    }
+    if (old_len > 0) undo_record(state, UNDO_DELETE, y, x, line + x, old_len);
+    if (len > 0) undo_record(state, UNDO_INSERT, y, x, text, len);
+    memmove(line + x + len, line + x + old_len, line_len - x - old_len + 1);
+    if (len > 0) memcpy(line + x, text, len);
+    state->doc.info[y].len = line_len - old_len + len;
+    doc_rehash_line(state, y);
+    return 0;
+}
+
+/* Moves the text from column x onward to a new line inserted below y. */
+int doc_split_line(EditorState* state, int y, int x)
+{
+    if (!state || y < 0 || y >= state->line_count) return -1;
+    int line_len = state->doc.info[y].len;
+    if (x < 0) x = 0;
+    if (x > line_len) x = line_len;
+
+    if (doc_insert_line(state, y + 1, state->lines[y] + x, line_len - x) != 0) return -1;
+    return doc_delete_text(state, y, x, line_len - x);
+}
+
+/* Appends line y + 1 to line y and removes it. */
+int doc_join_lines(EditorState* state, int y)
+{
+    if (!state || y < 0 || y + 1 >= state->line_count) return -1;
+    if (doc_insert_text(state, y, state->doc.info[y].len,
+                        state->lines[y + 1], state->doc.info[y + 1].len) != 0) {
+        return -1;
+    }
+    return doc_remove_lines(state, y + 1, 1);
+}
+
+int doc_insert_line(EditorState* state, int at, const char* text, int len)
+{
+    if (!state || at < 0 || at > state->line_count || len < 0) return -1;
+    if (doc_detach_snapshot(state) != 0) return -1;
+    if (doc_reserve(state, 1) != 0) return -1;
+
+    int cap;
+    char* buf = doc_alloc_text(text, len, &cap);
+    if (!buf) return -1;
+
+    undo_record(state, UNDO_INSERT_LINES, at, 1, buf, len);
+    int tail = state->line_count - at;
+    memmove(&state->lines[at + 1], &state->lines[at], (size_t)tail * sizeof(char*));
+    memmove(&state->doc.info[at + 1], &state->doc.info[at], (size_t)tail * sizeof(DocLineInfo));
+    state->lines[at] = buf;
+    state->doc.info[at].len = len;
+    state->doc.info[at].cap = cap;
+    state->doc.info[at].epoch = state->doc.epoch;
+    state->doc.info[at].lex = LEX_UNKNOWN;
+    state->doc.info[at].spans = NULL;
+    state->doc.info[at].span_count = -1;
+    bracket_index_insert(&state->doc.brackets, at, 1);
+    state->line_count++;
+    doc_rehash_line(state, at);
+    state->doc.context_version++;
+    return 0;
+}
+
+int doc_remove_lines(EditorState* state, int at, int count)
+{
+    if (!state || at < 0 || count <= 0 || at + count > state->line_count) return -1;
+    if (doc_detach_snapshot(state) != 0) return -1;
+    undo_record_lines(state, UNDO_REMOVE_LINES, at, count);
+    for (int i = at; i < at + count; i++) {
+        doc_unhash_line(state, i);
+        doc_release_line(state, i);
+    }
+    state->doc.generation++;
+    state->doc.context_version++;
+    int tail = state->line_count - at - count;
+    memmove(&state->lines[at], &state->lines[at + count], (size_t)tail * sizeof(char*));
+    memmove(&state->doc.info[at], &state->doc.info[at + count], (size_t)tail * sizeof(DocLineInfo));
+    state->line_count -= count;
+    if (at < state->line_count) state->doc.info[at].lex |= LEX_STALE;
+    if (at < state->doc.lex_valid) state->doc.lex_valid = at;
+    bracket_index_remove(&state->doc.brackets, at, count);
+    return 0;
+}
+
+int doc_set_line(EditorState* state, int y, const char* text, int len)
+{
+    if (!state || y < 0 || y >= state->line_count || len < 0) return -1;
+    if (doc_detach_snapshot(state) != 0) return -1;
+    DocLineInfo* info = &state->doc.info[y];
+    doc_unhash_line(state, y);
+    if (info->cap > len && !doc_line_shared(state, y)) {
+        undo_record_set(state, y, state->lines[y], info->len, text, len);
+        memmove(state->lines[y], text, len);
+        state->lines[y][len] = '\0';
+        info->len = len;
+        doc_rehash_line(state, y);
+        return 0;
+    }
+
+    int cap;
+    char* buf = doc_alloc_text(text, len, &cap);
+    if (!buf) {
+        doc_rehash_line(state, y);
+        return -1;
+    }
+    undo_record_set(state, y, state->lines[y], info->len, buf, len);
+    doc_release_line(state, y);
+    state->lines[y] = buf;
+    info->len = len;
+    info->cap = cap;
+    info->epoch = state->doc.epoch;
+    doc_rehash_line(state, y);
+    return 0;
+}
+
+/*
+ * Inserts the '\n'-separated lines of text before line at with one array
+ * move. The lines borrow from a single copy of text.
+ */
+int doc_insert_lines(EditorState* state, int at, const char* text, int len)
+{
+    if (!state || !text || at < 0 || at > state->line_count || len < 0) return -1;
+    if (doc_detach_snapshot(state) != 0) return -1;
+
+    int count = 1;
+    for (const char* p = text; (p = memchr(p, '\n', text + len - p)) != NULL; p++) {
+        count++;
+    }
+    if (doc_reserve(state, count) != 0) return -1;
+
+    char* block = (char*)malloc((size_t)len + 1);
+    if (!block || doc_keep_block(&state->doc, block, (size_t)len + 1, count) != 0) {
+        free(block);
+        return -1;
+    }
+    memcpy(block, text, len);
+    block[len] = '\0';
+
+    undo_record(state, UNDO_INSERT_LINES, at, count, text, len);
+    int tail = state->line_count - at;
+    memmove(&state->lines[at + count], &state->lines[at], (size_t)tail * sizeof(char*));
+    memmove(&state->doc.info[at + count], &state->doc.info[at], (size_t)tail * sizeof(DocLineInfo));
+
+    char* line_start = block;
+    char* end = block + len;
+    for (int i = at; i < at + count; i++) {
+        char* nl = memchr(line_start, '\n', end - line_start);
+        int line_len = (int)((nl ? nl : end) - line_start);
+        line_start[line_len] = '\0';
+        state->lines[i] = line_start;
+        DocLineInfo* info = &state->doc.info[i];
+        info->len = line_len;
+        info->cap = 0;
+        info->epoch = state->doc.epoch;
+        info->lex = LEX_UNKNOWN;
+        info->spans = NULL;
+        info->span_count = -1;
+        line_start += line_len + 1;
+    }
+    bracket_index_insert(&state->doc.brackets, at, count);
+    state->line_count += count;
+    for (int i = at; i < at + count; i++) {
+        doc_rehash_line(state, i);
+    }
+    state->doc.context_version++;
+    return 0;
+}
+
+void doc_mark_saved(EditorState* state)
+{
+    if (!state) return;
+    state->doc.saved_hash = state->doc.hash;
+    state->doc.saved_line_count = state->line_count;
+    state->doc.saved_generation = state->doc.generation;
+}
+
+/* Makes the current text the snapshot in O(1); see the note at the top. */
+void doc_snapshot(EditorState* state)
+{
+    if (!state) return;
+    doc_snapshot_free(state);
+    state->original_lines = state->lines;
+    state->original_line_count = state->line_count;
+    state->doc.snapshot_shared = 1;
+    state->doc.epoch++;
+    for (int i = 0; i < state->doc.block_count; i++) {
+        state->doc.blocks[i].pinned = 1;
+    }
+}
+
+void doc_snapshot_free(EditorState* state)
+{
+    if (!state) return;
+    Document* doc = &state->doc;
+    for (int i = 0; i < doc->retired_count; i++) {
+        free(doc->retired[i]);
+    }
+    free(doc->retired);
+    doc->retired = NULL;
+    doc->retired_count = 0;
+    doc->retired_cap = 0;
+    for (int i = doc->block_count - 1; i >= 0; i--) {
+        doc->blocks[i].pinned = 0;
+        if (doc->blocks[i].lines == 0) doc_drop_block(doc, i);
+    }
+    if (!doc->snapshot_shared) {
+        free(state->original_lines);
+    }
+    doc->snapshot_shared = 0;
+    state->original_lines = NULL;
+    state->original_line_count = 0;
+}
+
+int doc_write(EditorState* state, FILE* fp)
+{
+    if (!state || !fp) return -1;
+    for (int i = 0; i < state->line_count; i++) {
+        size_t len = (size_t)state->doc.info[i].len;
+        if (len > 0 && fwrite(state->lines[i], 1, len, fp) != len) return -1;
+        if (i < state->line_count - 1 || state->has_trailing_newline) {
+            if (fputc('\n', fp) == EOF) return -1;
+        }
+    }
+    return 0;
+}
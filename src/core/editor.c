@@ -1,5 +1,6 @@
 #include "editor.h"
 #include <string.h>
+#include <limits.h>
 
 #define FILE_TYPE_PLAIN   0
 
@@ -9,17 +10,10 @@ void init_editor(EditorState* state)
 
     memset(state, 0, sizeof(EditorState));
 
-    state -> lines = (char ** ) malloc(MAX_LINES * sizeof(char * ));
-    if (!state->lines) {
+    undo_init(state);
+    if (doc_init(state) != 0) {
         exit(1);
     }
-    memset(state->lines, 0, MAX_LINES * sizeof(char*));
-    state -> lines[0] = (char * ) malloc(MAX_LINE_LENGTH);
-    if (!state->lines[0]) {
-        exit(1);
-    }
-    state -> lines[0][0] = '\0';
-    state -> line_count = 1;
     state -> cursor_x = 0;
     state -> cursor_y = 0;
     state -> scroll_offset = 0;
@@ -46,8 +40,7 @@ void init_editor(EditorState* state)
     state -> theme_name[sizeof(state -> theme_name) - 1] = '\0';
     state -> auto_complete_enabled = 1;
     state -> sticky_cursor_enabled = 1;
-    state -> json_rules_count = 0;
-    state -> json_loaded = 0;
+    state -> theme = NULL;
     state -> original_lines = NULL;
     state -> original_line_count = 0;
     state -> last_input_time = time(NULL);
@@ -57,11 +50,12 @@ void init_editor(EditorState* state)
     state -> plugin_count = 0;
     state -> has_trailing_newline = 1;
     state -> find_mode = 0;
-    state -> find_match_lines = NULL;
-    state -> find_match_positions = NULL;
+    state -> find_flags = 0;
+    state -> find_matches = NULL;
     state -> find_match_count = 0;
     state -> find_current_match = 0;
     state -> find_escape_pressed = 0;
+    state -> render_invalid = 1;
 
     load_syntax_json(state);
     init_syntax_highlighting(state);
@@ -77,218 +71,37 @@ void insert_char(EditorState* state, char c)
         return;
     }
     char * line = state -> lines[state -> cursor_y];
-    int len = strlen(line);
+    int len = doc_line_length(state, state -> cursor_y);
     if (state -> cursor_x < 0) state -> cursor_x = 0;
 
-    
-
-    
-
-    
-    
     if (state->auto_complete_enabled) {
-        if (c == '(' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '(';
-                line[state -> cursor_x + 1] = ')';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '(';
-                line[state -> cursor_x + 1] = ')';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-            return;
-        } else if (c == '{' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '{';
-                line[state -> cursor_x + 1] = '}';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '{';
-                line[state -> cursor_x + 1] = '}';
+        char closing = 0;
+        switch (c) {
+        case '(': closing = ')'; break;
+        case '{': closing = '}'; break;
+        case '[': closing = ']'; break;
+        case '"': closing = '"'; break;
+        case '\'': closing = '\''; break;
+        }
+        if (closing) {
+            char pair[2] = { c, closing };
+            if (doc_insert_text(state, state -> cursor_y, state -> cursor_x, pair, 2) == 0) {
+                state -> cursor_x++;
+                update_dirty_status(state);
             }
-            state -> cursor_x++;
-            update_dirty_status(state);
-            return;
-        } else if (c == '[' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '[';
-                line[state -> cursor_x + 1] = ']';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '[';
-                line[state -> cursor_x + 1] = ']';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-            return;
-        } else if (c == '"' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '"';
-                line[state -> cursor_x + 1] = '"';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '"';
-                line[state -> cursor_x + 1] = '"';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-            return;
-        } else if (c == '\'' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '\'';
-                line[state -> cursor_x + 1] = '\'';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '\'';
-                line[state -> cursor_x + 1] = '\'';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-            return;
-        } else if (c == ')' && state -> cursor_x < len && line[state -> cursor_x] == ')') {
-            state -> cursor_x++;
-            return;
-        } else if (c == '}' && state -> cursor_x < len && line[state -> cursor_x] == '}') {
-            state -> cursor_x++;
             return;
-        } else if (c == ']' && state -> cursor_x < len && line[state -> cursor_x] == ']') {
-            state -> cursor_x++;
-            return;
-        } else if (c == '"' && state -> cursor_x < len && line[state -> cursor_x] == '"') {
-            state -> cursor_x++;
-            return;
-        } else if (c == '\'' && state -> cursor_x < len && line[state -> cursor_x] == '\'') {
+        }
+        if ((c == ')' || c == '}' || c == ']') &&
+            state -> cursor_x < len && line[state -> cursor_x] == c) {
             state -> cursor_x++;
             return;
         }
     }
 
-    if (len < MAX_LINE_LENGTH - 1) {
-        if (state -> cursor_x > len) {
-            for (int i = len; i < state -> cursor_x; i++) {
-                line[i] = ' ';
-            }
-            line[state -> cursor_x] = c;
-            line[state -> cursor_x + 1] = '\0';
-        } else {
-            memmove( & line[state -> cursor_x + 1], & line[state -> cursor_x], len - state -> cursor_x + 1);
-            line[state -> cursor_x] = c;
-        }
+    if (doc_insert_text(state, state -> cursor_y, state -> cursor_x, &c, 1) == 0) {
         state -> cursor_x++;
         update_dirty_status(state);
     }
-
-    
-    if (state->auto_complete_enabled) {
-        if (c == '(' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '(';
-                line[state -> cursor_x + 1] = ')';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '(';
-                line[state -> cursor_x + 1] = ')';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-        } else if (c == '{' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '{';
-                line[state -> cursor_x + 1] = '}';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '{';
-                line[state -> cursor_x + 1] = '}';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-        } else if (c == '[' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '[';
-                line[state -> cursor_x + 1] = ']';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '[';
-                line[state -> cursor_x + 1] = ']';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-        } else if (c == '"' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '"';
-                line[state -> cursor_x + 1] = '"';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '"';
-                line[state -> cursor_x + 1] = '"';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-        } else if (c == '\'' && len < MAX_LINE_LENGTH - 1) {
-            if (state -> cursor_x > len) {
-                for (int i = len; i < state -> cursor_x; i++) {
-                    line[i] = ' ';
-                }
-                line[state -> cursor_x] = '\'';
-                line[state -> cursor_x + 1] = '\'';
-                line[state -> cursor_x + 2] = '\0';
-            } else {
-                memmove( & line[state -> cursor_x + 2], & line[state -> cursor_x], len - state -> cursor_x + 1);
-                line[state -> cursor_x] = '\'';
-                line[state -> cursor_x + 1] = '\'';
-            }
-            state -> cursor_x++;
-            update_dirty_status(state);
-        } else if (c == ')' && state -> cursor_x < len && line[state -> cursor_x] == ')') {
-            state -> cursor_x++;
-        } else if (c == '}' && state -> cursor_x < len && line[state -> cursor_x] == '}') {
-            state -> cursor_x++;
-        } else if (c == ']' && state -> cursor_x < len && line[state -> cursor_x] == ']') {
-            state -> cursor_x++;
-        } else if (c == '"' && state -> cursor_x < len && line[state -> cursor_x] == '"') {
-            state -> cursor_x++;
-        } else if (c == '\'' && state -> cursor_x < len && line[state -> cursor_x] == '\'') {
-            state -> cursor_x++;
-        }
-    }
 }
 void delete_char(EditorState* state)
 {
@@ -298,33 +111,31 @@ void delete_char(EditorState* state)
     }
 
     char * line = state -> lines[state -> cursor_y];
-    int len = strlen(line);
+    int len = doc_line_length(state, state -> cursor_y);
 
     
     
     if (state -> cursor_x > 0) {
         
-        int is_deleting_indentation = 1;
-        for (int i = 0; i < state->cursor_x; i++) {
+        int is_deleting_indentation = state->cursor_x <= len;
+        for (int i = 0; i < state->cursor_x && is_deleting_indentation; i++) {
             if (line[i] != ' ') {
                 is_deleting_indentation = 0;
-                break;
             }
         }
 
         if (is_deleting_indentation && state->cursor_x >= state->tab_size) {
             
             int spaces_to_delete = state->tab_size;
-            if (state->cursor_x < spaces_to_delete) {
-                spaces_to_delete = state->cursor_x;
-            }
-            memmove(&line[state->cursor_x - spaces_to_delete], &line[state->cursor_x], len - state->cursor_x + 1);
+            doc_delete_text(state, state->cursor_y, state->cursor_x - spaces_to_delete, spaces_to_delete);
             state->cursor_x -= spaces_to_delete;
         } else {
             
             if (state -> cursor_x > len) state -> cursor_x = len;
-            memmove(&line[state -> cursor_x - 1], &line[state -> cursor_x], len - state -> cursor_x + 1);
-            state -> cursor_x--;
+            if (state -> cursor_x > 0) {
+                doc_delete_text(state, state -> cursor_y, state -> cursor_x - 1, 1);
+                state -> cursor_x--;
+            }
         }
         update_dirty_status(state);
         return;
@@ -334,51 +145,24 @@ void delete_char(EditorState* state)
     if (state -> cursor_x == 0 && state -> cursor_y > 0) {
         
         int is_empty_or_whitespace = 1;
-        for (int i = 0; line[i] != '\0'; i++) {
+        for (int i = 0; i < len; i++) {
             if (line[i] != ' ' && line[i] != '\t') {
                 is_empty_or_whitespace = 0;
                 break;
             }
         }
 
-        char * prev = state -> lines[state -> cursor_y - 1];
-        int prev_len = strlen(prev);
+        int prev_len = doc_line_length(state, state -> cursor_y - 1);
 
         
         if (is_empty_or_whitespace) {
-            
-            free(state -> lines[state -> cursor_y]);
-            for (int i = state -> cursor_y; i < state -> line_count - 1; i++) {
-                state -> lines[i] = state -> lines[i + 1];
-            }
-            state -> line_count--;
-
-            
-            state -> cursor_y--;
-            state -> cursor_x = prev_len;
-
-            move_cursor(state, 0, 0);
-            update_dirty_status(state);
-            return;
-        }
-
-        
-        if (prev_len + len >= MAX_LINE_LENGTH) {
-            show_status(state, "Join aborted: maximum line length exceeded");
+            doc_remove_lines(state, state -> cursor_y, 1);
+        } else if (doc_join_lines(state, state -> cursor_y - 1) != 0) {
+            show_status(state, "Memory allocation failed");
             return;
         }
 
         
-        memcpy(&prev[prev_len], line, len + 1); 
-
-        
-        free(state -> lines[state -> cursor_y]);
-        for (int i = state -> cursor_y; i < state -> line_count - 1; i++) {
-            state -> lines[i] = state -> lines[i + 1];
-        }
-        state -> line_count--;
-
-        
         state -> cursor_y--;
         state -> cursor_x = prev_len;
 
@@ -388,30 +172,27 @@ void delete_char(EditorState* state)
 }
 void new_line(EditorState* state)
 {
-    if (state -> line_count >= MAX_LINES) {
-        show_status(state, "Error: Maximum line count reached (1,000,000 lines)");
-        return;
-    }
     char * line = state -> lines[state -> cursor_y];
+    int len = doc_line_length(state, state -> cursor_y);
 
     
     int split_pair = 0;
     char closing_char = 0;
     int after_pos = 0;
-    if (state->cursor_x > 0 && state->cursor_x < (int)strlen(line)) {
+    if (state->cursor_x > 0 && state->cursor_x < len) {
         char before = line[state->cursor_x - 1];
         after_pos = state->cursor_x;
-        while (after_pos < (int)strlen(line) && (line[after_pos] == ' ' || line[after_pos] == '\t')) after_pos++;
-        char after = (after_pos < (int)strlen(line)) ? line[after_pos] : 0;
+        while (after_pos < len && (line[after_pos] == ' ' || line[after_pos] == '\t')) after_pos++;
+        char after = (after_pos < len) ? line[after_pos] : 0;
         if ((before == '{' && after == '}') ||
             (before == '(' && after == ')') ||
             (before == '[' && after == ']')) {
             split_pair = 1;
             closing_char = after;
             
-            int remove_start = state->cursor_x;
-            int remove_end = after_pos + 1;
-            memmove(&line[remove_start], &line[remove_end], strlen(line) - remove_end + 1);
+            doc_delete_text(state, state->cursor_y, state->cursor_x, after_pos + 1 - state->cursor_x);
+            line = state -> lines[state -> cursor_y];
+            len = doc_line_length(state, state -> cursor_y);
         }
     }
 
@@ -419,13 +200,13 @@ void new_line(EditorState* state)
 
     if (state->auto_tabbing_enabled) {
 
-        while (base_indent < strlen(line) && (line[base_indent] == ' ' || line[base_indent] == '\t')) {
+        while (base_indent < len && (line[base_indent] == ' ' || line[base_indent] == '\t')) {
             base_indent++;
         }
     }
 
 
-    int extra_indent = 0;
+    if (state->cursor_x > len) state->cursor_x = len;
     if (state->cursor_x > 0) {
         char before = line[state->cursor_x - 1];
         if (before == '}' && base_indent >= state->tab_size) {
@@ -433,141 +214,27 @@ void new_line(EditorState* state)
         }
     }
 
-    
-    int brace_level = 0;
-    int inside_function_braces = 0;
-
-    
-    int line_has_closing_brace = 0;
-    for (int i = 0; i < state->cursor_x && line[i] != '\0'; i++) {
-        if (line[i] == '}') {
-            line_has_closing_brace = 1;
-            break;
-        }
-    }
-
-    
-    for (int l = 0; l < state->cursor_y; l++) {
-        const char* check_line = state->lines[l];
-        if (!check_line) continue;
-
-        for (int i = 0; check_line[i] != '\0'; i++) {
-            if (check_line[i] == '{') {
-                brace_level++;
-                inside_function_braces = 1;
-            } else if (check_line[i] == '}') {
-                brace_level--;
-                if (brace_level <= 0) {
-                    inside_function_braces = 0;
-                }
-            }
-        }
-    }
-
-    
-    for (int i = 0; i < state->cursor_x && line[i] != '\0'; i++) {
-        if (line[i] == '{') {
-            brace_level++;
-            inside_function_braces = 1;
-        } else if (line[i] == '}') {
-            brace_level--;
-            if (brace_level <= 0) {
-                inside_function_braces = 0;
-            }
-        }
+    int y = state -> cursor_y;
+    if (doc_split_line(state, y, state -> cursor_x) != 0 ||
+        doc_insert_text(state, y + 1, 0, state -> lines[y], base_indent) != 0) {
+        show_status(state, "Memory allocation failed");
+        return;
     }
 
-    
-    
-    
-    
-
     if (split_pair) {
         
-        char * empty_line = (char * ) malloc(MAX_LINE_LENGTH);
-        if (!empty_line) {
-            show_status(state, "Memory allocation failed");
-            return;
-        }
-        char * closing_line = (char * ) malloc(MAX_LINE_LENGTH);
-        if (!closing_line) {
-            free(empty_line);
-            show_status(state, "Memory allocation failed");
-            return;
-        }
-
-        
-        int indent_len = 0;
-        for (int i = 0; i < base_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-            empty_line[indent_len++] = line[i];
-        }
-        for (int i = 0; i < extra_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-            empty_line[indent_len++] = ' ';
-        }
-        empty_line[indent_len] = '\0';
-
-        
-        indent_len = 0;
-        for (int i = 0; i < base_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-            closing_line[indent_len++] = line[i];
-        }
-        for (int i = 0; i < extra_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-            closing_line[indent_len++] = ' ';
-        }
-        closing_line[indent_len++] = closing_char;
-        closing_line[indent_len] = '\0';
-
-        line[state -> cursor_x] = '\0';
-
-        
-        for (int i = state -> line_count + 1; i > state -> cursor_y + 2; i--) {
-            state -> lines[i] = state -> lines[i - 2];
-        }
-        state -> lines[state -> cursor_y + 1] = empty_line;
-        state -> lines[state -> cursor_y + 2] = closing_line;
-        state -> line_count += 2;
-        state -> cursor_y++;
-        state -> cursor_x = indent_len - 1; 
-        move_cursor(state, 0, 0);
-        napms(10);
-        update_dirty_status(state);
-    } else {
-        
-        char * new_line = (char * ) malloc(MAX_LINE_LENGTH);
-        if (!new_line) {
+        if (doc_insert_text(state, y + 1, base_indent, &closing_char, 1) != 0 ||
+            doc_insert_line(state, y + 1, state -> lines[y], base_indent) != 0) {
             show_status(state, "Memory allocation failed");
             return;
         }
-
-        int indent_len = 0;
-        for (int i = 0; i < base_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-            new_line[indent_len++] = line[i];
-        }
-        for (int i = 0; i < extra_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-            new_line[indent_len++] = ' ';
-        }
-
-        const char *tail = &line[state->cursor_x];
-        int tail_len = strlen(tail);
-        if (indent_len + tail_len >= MAX_LINE_LENGTH) {
-            tail_len = MAX_LINE_LENGTH - 1 - indent_len;
-        }
-        memcpy(new_line + indent_len, tail, tail_len);
-        new_line[indent_len + tail_len] = '\0';
-
-        line[state -> cursor_x] = '\0';
-
-        for (int i = state -> line_count; i > state -> cursor_y + 1; i--) {
-            state -> lines[i] = state -> lines[i - 1];
-        }
-        state -> lines[state -> cursor_y + 1] = new_line;
-        state -> line_count++;
-        state -> cursor_y++;
-        state -> cursor_x = indent_len;
-        move_cursor(state, 0, 0);
-        napms(10);
-        update_dirty_status(state);
     }
+
+    state -> cursor_y++;
+    state -> cursor_x = base_indent;
+    move_cursor(state, 0, 0);
+    napms(10);
+    update_dirty_status(state);
 }
 void move_cursor(EditorState* state, int dx, int dy)
 {
@@ -710,68 +377,11 @@ void show_status_left(EditorState* state,
 }
 void count_stats(EditorState* state)
 {
-    int words = 0;
-    int characters = 0;
-    for (int i = 0; i < state -> line_count; i++) {
-        characters += strlen(state -> lines[i]);
-        char * line = state -> lines[i];
-        int in_word = 0;
-        for (int j = 0; line[j] != '\0'; j++) {
-            if (isspace(line[j])) {
-                in_word = 0;
-            } else if (!in_word) {
-                in_word = 1;
-                words++;
-            }
-        }
-    }
     char msg[256];
-    snprintf(msg, sizeof(msg), "Words: %d, Characters: %d", words, characters);
+    while (doc_count_step(state, LONG_MAX)) {}
+    snprintf(msg, sizeof(msg), "Words: %ld, Characters: %ld", doc_word_count(state), doc_char_count(state));
 }
 
-static char* internal_clipboard = NULL;
-static char* my_strdup(const char* s)
-{
-    if (!s) return NULL;
-    size_t len = strlen(s) + 1;
-    char* dup = (char*)malloc(len);
-    if (dup) memcpy(dup, s, len);
-    return dup;
-}
-void set_internal_clipboard(const char* text)
-{
-    if (internal_clipboard) {
-        free(internal_clipboard);
-    }
-    internal_clipboard = text ? my_strdup(text) : NULL;
-}
-
-void copy_to_system_clipboard(const char* text)
-{
-    if (!text || strlen(text) == 0) return;
-
-    
-    set_internal_clipboard(text);
-
-    
-    char temp_file[] = "/tmp/kilo_editor_clipboard_temp.txt";
-    FILE * fp = fopen(temp_file, "w");
-    if (!fp) return;
-    fprintf(fp, "%s", text);
-    fclose(fp);
-
-    
-    int is_wayland = getenv("WAYLAND_DISPLAY") != NULL;
-    if (is_wayland) {
-        system("cat '/tmp/root_editor_clipboard_temp.txt' | wl-copy 2>/dev/null &");
-    } else {
-        system("cat '/tmp/root_editor_clipboard_temp.txt' | xclip -selection clipboard 2>/dev/null &");
-        system("cat '/tmp/root_editor_clipboard_temp.txt' | xclip -selection primary 2>/dev/null &");
-    }
-
-    
-    system("rm -f '/tmp/root_editor_clipboard_temp.txt' 2>/dev/null &");
-}
 void toggle_help(EditorState* state)
 {
     state -> show_help = !state -> show_help;
@@ -867,6 +477,27 @@ void jump_to_line(EditorState* state)
         show_status(state, "Line not found or not created");
     }
 }
+void jump_to_matching_bracket(EditorState* state)
+{
+    int match_y, match_x;
+    int x = state->cursor_x;
+    int result = bracket_match(state, state->cursor_y, x, &match_y, &match_x);
+    if (result < 0 && x > 0) {
+        result = bracket_match(state, state->cursor_y, x - 1, &match_y, &match_x);
+    }
+    if (result < 0) {
+        show_status(state, "No bracket at cursor");
+        return;
+    }
+    if (result == 0) {
+        show_status(state, "No matching bracket");
+        return;
+    }
+    state->cursor_y = match_y;
+    state->cursor_x = match_x;
+    move_cursor(state, 0, 0);
+}
+
 void render_help_screen(EditorState* state)
 {
     int max_y, max_x;
@@ -882,6 +513,7 @@ void render_help_screen(EditorState* state)
     if (popup_x < 0) popup_x = 0;
     if (popup_y + popup_height > max_y) popup_height = max_y - popup_y - 1;
     if (popup_width > max_x) popup_width = max_x - 2;
+    state->render_invalid = 1;
 
     
     for (int y = popup_y; y < popup_y + popup_height; y++) {
@@ -921,6 +553,7 @@ void render_help_screen(EditorState* state)
     mvprintw(line++, col1, "Ctrl+F  Find");
     mvprintw(line++, col1, "Ctrl+R  Replace");
     mvprintw(line++, col1, "Ctrl+L  Jump to line");
+    mvprintw(line++, col1, "Ctrl+B  Matching bracket");
     mvprintw(line++, col1, "Ctrl+T  Auto Tab");
     mvprintw(line++, col1, "Ctrl+K  Auto Complete");
     mvprintw(line++, col1, "Ctrl+H  Help");
@@ -928,6 +561,8 @@ void render_help_screen(EditorState* state)
     mvprintw(line++, col1, "Ctrl+A  Select all");
     mvprintw(line++, col1, "Ctrl+X  Cut");
     mvprintw(line++, col1, "Ctrl+C  Copy");
+    mvprintw(line++, col1, "Ctrl+Z  Undo");
+    mvprintw(line++, col1, "Ctrl+Y  Redo");
     mvprintw(line++, col1, "Esc then Enter Exit select mode");
 
     line = popup_y + 3;
@@ -1039,39 +674,13 @@ void save_original_content(EditorState* state)
 {
     if (!state || !state->lines || state->line_count <= 0) return;
 
-    free_original_content(state);
-
-    state->original_lines = (char**)malloc(state->line_count * sizeof(char*));
-    if (!state->original_lines) return;
-
-    state->original_line_count = state->line_count;
-
-    for (int i = 0; i < state->line_count; i++) {
-        state->original_lines[i] = (char*)malloc(MAX_LINE_LENGTH);
-        if (!state->original_lines[i]) {
-            free_original_content(state);
-            return;
-        }
-        if (!state->lines[i]) {
-            state->original_lines[i][0] = '\0';
-        } else {
-            strcpy(state->original_lines[i], state->lines[i]);
-        }
-    }
+    doc_snapshot(state);
+    doc_mark_saved(state);
 }
 void free_original_content(EditorState* state)
 {
     if (!state) return;
-    if (state->original_lines) {
-        for (int i = 0; i < state->original_line_count; i++) {
-            if (state->original_lines[i]) {
-                free(state->original_lines[i]);
-            }
-        }
-        free(state->original_lines);
-        state->original_lines = NULL;
-    }
-    state->original_line_count = 0;
+    doc_snapshot_free(state);
 }
 int content_matches_original(EditorState* state)
 {
@@ -1084,6 +693,9 @@ int content_matches_original(EditorState* state)
     }
 
     for (int i = 0; i < state->line_count; i++) {
+        if (state->lines[i] == state->original_lines[i]) {
+            continue;
+        }
         if (!state->lines[i] || !state->original_lines[i]) {
             return 0;
         }
@@ -1101,7 +713,7 @@ void update_dirty_status(EditorState* state)
     if (state->filename[0] == '\0') {
         int has_content = 0;
         for (int i = 0; i < state->line_count; i++) {
-            if (state->lines[i] && strlen(state->lines[i]) > 0) {
+            if (doc_line_length(state, i) > 0) {
                 has_content = 1;
                 break;
             }
@@ -1110,5 +722,19 @@ void update_dirty_status(EditorState* state)
         return;
     }
 
+    Document* doc = &state->doc;
+    if (doc->generation == doc->saved_generation) {
+        state->dirty = 0;
+        return;
+    }
+    if (doc->hash != doc->saved_hash || state->line_count != doc->saved_line_count) {
+        state->dirty = 1;
+        return;
+    }
+
+    // The hash is order-insensitive, so confirm before reporting clean.
     state->dirty = !content_matches_original(state);
+    if (!state->dirty) {
+        doc->saved_generation = doc->generation;
+    }
 }
\ No newline at end of file
@@ -14,17 +14,14 @@
 #include <regex.h>
 #include <signal.h>
 #include <setjmp.h>
+#include <stdint.h>
 
-#define MAX_LINES 1000000
-#define MAX_LINE_LENGTH 1024
 #define TAB_SIZE 4
-#define MAX_JSON_RULES 1000
-#define MAX_SCOPE_LENGTH 256
-#define MAX_COLOR_LENGTH 16
 #define MAX_PLUGINS 32
 
 
 typedef struct EditorState EditorState;
+typedef struct Highlighter Highlighter;
 typedef void (*PluginOnLoad)(EditorState* state);
 typedef void (*PluginOnUnload)(EditorState* state);
 typedef int (*PluginOnKeypress)(EditorState* state, int ch);
@@ -59,9 +56,383 @@ typedef struct Plugin {
     int loaded;
 } Plugin;
 
+typedef struct BracketSummary {
+    int sum[3];
+    int min_open[3];
+    int min_close[3];
+} BracketSummary;
+
+/* One line in the bracket treap (brackets.c), with the summary of its subtree. */
+typedef struct BracketNode {
+    int left, right;
+    int size;
+    unsigned int prio;
+    int line_valid;
+    int valid;
+    BracketSummary line;
+    BracketSummary all;
+} BracketNode;
+
+typedef struct BracketIndex {
+    BracketNode* nodes;     /* node 0 is the empty tree */
+    int cap;
+    int used;
+    int free_list;
+    int root;               /* 0 until the first query builds the tree */
+    unsigned int seed;
+} BracketIndex;
+
+#define LEX_STALE   0x80000000u
+#define LEX_UNKNOWN 0xffffffffu
+
+/* A colored run of a line; text between spans is drawn without attributes. */
+typedef struct HighlightSpan {
+    int start;
+    int len;
+    short pair;
+    short flags;
+} HighlightSpan;
+
+#define HL_BRACKET 0x1  /* recolored at draw time if the bracket is unmatched */
+
+typedef struct DocLineInfo {
+    int len;
+    int cap;
+    int epoch;
+    uint64_t hash;
+    unsigned long version;
+    int words;
+    unsigned int lex;
+    HighlightSpan* spans;
+    int span_count;         /* -1 until the highlight worker has delivered spans */
+    unsigned int span_lex;  /* lexer state at line start the spans were made for */
+} DocLineInfo;
+
+/* Text of one bulk line insertion, freed when no line or snapshot uses it. */
+typedef struct DocBlock {
+    char* text;
+    size_t size;
+    int lines;      /* lines of the document borrowing from it */
+    int pinned;     /* the saved snapshot may still borrow from it */
+} DocBlock;
+
+typedef struct Document {
+    DocLineInfo* info;
+    int capacity;
+    char* base;
+    size_t base_size;
+    uint64_t hash;
+    unsigned long generation;
+    uint64_t saved_hash;
+    int saved_line_count;
+    unsigned long saved_generation;
+    unsigned long context_version;
+    uint64_t pending_shape;
+    long word_count;
+    long char_count;
+    int uncounted;          /* loaded lines whose words are not counted yet */
+    int count_next;
+    int lex_valid;
+    int lex_file_type;
+    BracketIndex brackets;
+    int epoch;
+    int snapshot_shared;
+    char** retired;
+    int retired_count;
+    int retired_cap;
+    DocBlock* blocks;       /* sorted by address */
+    int block_count;
+    int block_cap;
+} Document;
+
+#define UNDO_INSERT       1
+#define UNDO_DELETE       2
+#define UNDO_INSERT_LINES 3
+#define UNDO_REMOVE_LINES 4
+#define UNDO_SET_LINE     5
+
+typedef struct UndoOp {
+    int type;
+    int y;
+    int x;
+    int len;
+    size_t text;
+} UndoOp;
+
+typedef struct UndoTxn {
+    int first_op;
+    int op_count;
+    int before_x, before_y;
+    int after_x, after_y;
+    int typing;
+    char first_char;
+    char last_char;
+} UndoTxn;
+
+typedef struct UndoJournal {
+    char* arena;
+    size_t arena_used;
+    size_t arena_cap;
+    UndoOp* ops;
+    int op_count;
+    int op_cap;
+    UndoTxn* txns;
+    int txn_count;
+    int txn_cap;
+    int current;
+    int depth;
+    int open;
+    int applying;
+    int merge_blocked;
+    int isolated;       /* set by undo_break until the outermost undo_end */
+    int discard;        /* history was dropped mid-transaction; record nothing until it ends */
+    int before_x, before_y;
+    size_t budget;
+} UndoJournal;
+
+/* What one text row showed last frame; render_screen skips rows that still match. */
+typedef struct RenderRow {
+    const char* text;
+    unsigned long version;
+    int line;
+    int offset;
+    int sel_start, sel_end;
+    int find_first, find_count;  /* matches on the line, as a range of state->find_matches */
+    int find_current;
+    int highlighted;
+} RenderRow;
+
+/* Inputs that affect every text row at once. */
+typedef struct RenderView {
+    int max_x, max_y;
+    int syntax;
+    int select_mode;
+    int find_mode;
+    int file_type;
+    int theme_id;
+    unsigned long context_version;
+    unsigned long find_version;
+} RenderView;
+
+/* A line snapshot tokenized by the highlight worker. */
+typedef struct HighlightJob {
+    int line;
+    unsigned long version;
+    const char* key;        /* state->lines[line] when queued; compared, never read */
+    unsigned long serial;
+    int file_type;
+    unsigned int lex;
+    char term[64];          /* closing delimiter of a comment or string open at line start */
+    char* text;
+    int len;
+    HighlightSpan* spans;
+    int span_count;
+} HighlightJob;
+
+/* Scope string -> color pair and font style, resolved once per theme load. */
+typedef struct ScopeEntry {
+    char* scope;
+    unsigned int hash;
+    short color;
+    short resolved;
+    short font;
+} ScopeEntry;
+
+typedef struct ScopeCache {
+    ScopeEntry* slots;
+    int cap;
+    int count;
+} ScopeCache;
+
+/* One tokenColors rule; fields are offsets into Theme.pool. */
+typedef struct ThemeRule {
+    int scope;
+    int color;
+    int font_style;
+} ThemeRule;
+
+/* Parsed syntax.json, shared by every buffer that loads it. */
+typedef struct Theme {
+    int refs;
+    char* pool;
+    int pool_len, pool_cap;
+    ThemeRule* rules;
+    int rule_count, rule_cap;
+    ScopeCache cache;
+} Theme;
+
+/*
+ * Two-level perfect hash (hash and displace): a key picks a bucket, and the
+ * bucket's displacement picks a slot no other key uses.
+ */
+typedef struct PerfectSlot {
+    const char* key;
+    int len;
+    int value;
+} PerfectSlot;
+
+typedef struct PerfectHash {
+    PerfectSlot* slots;
+    unsigned short* disp;
+    unsigned int slot_mask;
+    unsigned int bucket_mask;
+} PerfectHash;
+
+#define LANG_OPERATOR       1
+#define LANG_LINE_COMMENT   2
+#define LANG_BLOCK_COMMENT  3
+#define LANG_STRING         4
+#define LANG_RAW_STRING     5
+#define LANG_HEREDOC        6
+
+/* Byte classes a token can start with; LC_DELIM bytes go through the DFA first. */
+#define LC_GAP      0
+#define LC_WORD     1
+#define LC_DIGIT    2
+#define LC_BRACKET  3
+#define LC_DELIM    4
+
+#define LB_WORD       0x1   /* continues an identifier */
+#define LB_SUFFIX     0x2   /* may trail a number */
+#define LB_EXPONENT   0x4
+#define LB_SEPARATOR  0x8   /* digit separator */
+
+/* Keyword classes, in the order they win when a word is in several. */
+#define LK_TYPE             0x001
+#define LK_CONTROL          0x002
+#define LK_CONSTANT         0x004
+#define LK_LIBRARY_TYPE     0x008
+#define LK_MODIFIER         0x010
+#define LK_STORAGE          0x020
+#define LK_PREPROCESSOR     0x040
+#define LK_LIBRARY_FUNCTION 0x080
+#define LK_COMMAND          0x100
+
+#define LF_CPP_RAW_STRINGS    0x1
+#define LF_RUST_RAW_STRINGS   0x2
+#define LF_COMMENT_NEEDS_SPACE 0x4
+
+#define LANG_MAX_NAMES  16
+#define LANG_TOKEN_SIZE 16
+
+/* An operator or a comment/string opener, with its closing delimiter. */
+typedef struct LanguageToken {
+    char open[LANG_TOKEN_SIZE];
+    char close[LANG_TOKEN_SIZE];
+    unsigned char kind;
+    unsigned char multiline;    /* strings that stay open at the end of a line */
+} LanguageToken;
+
+/* A config/languages/<name>.lang definition compiled into lexer tables. */
+typedef struct Language {
+    char name[32];
+    char extensions[LANG_MAX_NAMES][16];
+    int extension_count;
+    char filenames[LANG_MAX_NAMES][32];
+    int filename_count;
+    char comment_lines[4][LANG_TOKEN_SIZE];
+    int comment_line_count;
+    char number_prefixes[8][4];
+    int number_prefix_count;
+    int features;
+    LanguageToken* tokens;
+    int token_count, token_cap;
+    unsigned char byte_class[256];
+    unsigned char base_class[256];  /* byte_class without LC_DELIM */
+    unsigned char byte_flags[256];
+    unsigned char dfa_column[256];  /* 0 for bytes no delimiter contains */
+    int dfa_width;
+    short* dfa;                     /* dfa[state * dfa_width + column]; 0 is dead, 1 the start */
+    short* dfa_accept;              /* token index + 1 for accepting states */
+    PerfectHash keywords;
+    char** words;
+    int word_count;
+} Language;
+
+#define SEARCH_IGNORE_CASE 0x1
+#define SEARCH_WHOLE_WORD  0x2
+#define SEARCH_REGEX       0x4
+
+#define WORKERS_MAX 64
+
+/* A literal prepared for scanning; its first and last bytes drive the filter. */
+typedef struct SearchLiteral {
+    char text[256];
+    char folded[256];
+    int len;
+    int flags;
+    unsigned char first, last;
+    unsigned char first_mask, last_mask;  /* 0x20 where a letter is matched in either case */
+} SearchLiteral;
+
+typedef struct RegexEntry RegexEntry;
+
+typedef struct SearchPattern {
+    SearchLiteral literal;  /* the term; for a regex, text every match contains (len 0 if none) */
+    int flags;
+    const char* source;     /* regex source and compiled program, kept alive by entry */
+    regex_t* re;
+    RegexEntry* entry;      /* reference into the regex cache; see search_pattern_free */
+} SearchPattern;
+
+typedef struct SearchMatch {
+    int line;
+    int col;
+    int len;
+} SearchMatch;
+
+typedef struct MatchList {
+    SearchMatch* items;
+    int count;
+    int cap;
+} MatchList;
+
+/*
+ * Search-as-you-type state kept across the keystrokes of the Find prompt.
+ * lines collects every line holding the term (whole-word or not), so when
+ * the next term extends this one only those lines are searched again.
+ */
+typedef struct IncrementalSearch {
+    SearchPattern pattern;
+    SearchPattern substring;  /* pattern without SEARCH_WHOLE_WORD */
+    char term[256];
+    int flags;
+    int valid;                /* term compiled; 0 for an empty or broken one */
+    int* lines;
+    int line_count, line_cap;
+    int* candidates;          /* lines still to search, or NULL for the whole document */
+    int candidate_count;
+    int next;
+    int done;
+    MatchList matches;
+} IncrementalSearch;
+
+/* Keys handled per frame by the main loop, and what drawing the frames cost. */
+typedef struct InputStats {
+    int last_batch;        /* keys handled since the previous frame */
+    int max_batch;
+    long batches;
+    long keys;
+    double last_frame_ms;  /* render_screen and plugin render hooks */
+    double max_frame_ms;
+} InputStats;
+
+typedef struct ReplaceStats {
+    long replaced;  /* occurrences replaced */
+    long lines;     /* lines changed */
+    long skipped;   /* occurrences on lines that would grow past the longest possible line */
+    long failed;    /* occurrences left in place because memory ran out */
+} ReplaceStats;
+
+typedef void (*SearchProgress)(EditorState* state, long matches);
+typedef void (*WorkFn)(void* arg, int index, int worker);
+typedef void (*WorkTick)(void* arg);
+
 typedef struct EditorState {
     char** lines;
     int line_count;
+    Document doc;
+    UndoJournal undo;
     int cursor_x, cursor_y;
     int scroll_offset;
     int horizontal_scroll_offset;
@@ -92,11 +463,8 @@ typedef struct EditorState {
     int auto_complete_enabled;
     int sticky_cursor_enabled;
 
-    int json_rules_count;
-    char json_scopes[MAX_JSON_RULES][MAX_SCOPE_LENGTH];
-    char json_colors[MAX_JSON_RULES][MAX_COLOR_LENGTH];
-    char json_font_styles[MAX_JSON_RULES][32];
-    int json_loaded;
+    Theme* theme;
+    Highlighter* highlighter;
 
     char** original_lines;
     int original_line_count;
@@ -111,12 +479,20 @@ typedef struct EditorState {
     // Find mode state
     int find_mode;
     char find_search_term[256];
-    int* find_match_lines;
-    int* find_match_positions;
+    int find_flags;
+    unsigned long find_version;
+    SearchMatch* find_matches;
     int find_match_count;
     int find_current_match;
     int find_escape_pressed;
 
+    // Damage tracking for render_screen
+    RenderRow* render_rows;
+    int render_row_count;
+    RenderView render_view;
+    int render_invalid;
+    InputStats input_stats;
+
 } EditorState;
 
 void init_editor(EditorState* state);
@@ -154,6 +530,8 @@ void move_cursor(EditorState* state, int dx, int dy);
 void find_text(EditorState* state);
 void replace_text(EditorState* state);
 void render_screen(EditorState* state);
+chtype* render_capture_rows(EditorState* state);
+void render_damage_rows(EditorState* state, chtype* before);
 void show_status(EditorState* state, const char* message);
 void show_status_left(EditorState* state, const char* message);
 void count_stats(EditorState* state);
@@ -172,17 +550,44 @@ void extend_selection(EditorState* state);
 int has_selection(EditorState* state);
 char* get_selected_text(EditorState* state);
 void delete_selected_text(EditorState* state);
+void clipboard_init(void);
 void copy_to_system_clipboard(const char* text);
+char* get_system_clipboard(void);
+void clipboard_free(void);
 void toggle_help(EditorState* state);
 void render_help_screen(EditorState* state);
 void jump_to_line(EditorState* state);
+void jump_to_matching_bracket(EditorState* state);
 
 void init_syntax_highlighting(EditorState* state);
 void update_syntax_highlighting(EditorState* state);
+int syntax_update_states(EditorState* state, int line_num);
+unsigned int syntax_line_state(EditorState* state, int line_num);
+void syntax_prepare_job(EditorState* state, int line_num, HighlightJob* job);
+int syntax_tokenize(const HighlightJob* job, HighlightSpan** spans_out);
+void syntax_draw_spans(EditorState* state, int line_num, const HighlightSpan* spans, int count,
+                       int screen_row, int screen_col, int offset, int width);
+int highlight_spans(EditorState* state, int line_num, const HighlightSpan** spans);
+void highlight_request(EditorState* state, int line_num);
+void highlight_wait(EditorState* state, int timeout_ms);
+int highlight_pending(EditorState* state);
+void highlight_sync(EditorState* state);
+void highlight_reset(EditorState* state);
+void highlight_free(EditorState* state);
+int bracket_match(EditorState* state, int y, int x, int* match_y, int* match_x);
+void bracket_index_touch(BracketIndex* index, int y);
+void bracket_index_insert(BracketIndex* index, int at, int count);
+void bracket_index_remove(BracketIndex* index, int at, int count);
+void bracket_index_free(BracketIndex* index);
 void detect_file_type(EditorState* state);
+int language_detect(const char* filename);
+const Language* language_get(int id);
+void languages_free(void);
+unsigned int perfect_hash(const char* key, int len, unsigned int seed);
+int perfect_build(PerfectHash* table, const char** keys, const int* values, int n);
+int perfect_lookup(const PerfectHash* table, const char* key, int len);
+void perfect_free(PerfectHash* table);
 void load_c_keywords(EditorState* state);
-void highlight_line(EditorState* state, int line_num, int screen_row, int line_num_width, int horizontal_scroll_offset);
-void highlight_line_segment(EditorState* state, int line_num, int screen_row, int line_num_width, int start_col, int max_len);
 int is_keyword(const char* word, EditorState* state);
 int is_number(const char* token);
 void free_syntax_data(EditorState* state);
@@ -191,12 +596,69 @@ int parse_json_token_colors(const char* json_content, EditorState* state);
 int hex_to_color_pair(const char* hex_color);
 int match_scope(const char* token_scope, const char* rule_scope);
 int get_dynamic_color(EditorState* state, const char* scope);
+int get_hierarchical_color(EditorState* state, const char* scope);
 const char* get_dynamic_font_style(EditorState* state, const char* scope);
+void scope_cache_free(ScopeCache* cache);
+Theme* theme_shared(void);
+Theme* theme_retain(Theme* theme);
+void theme_release(Theme* theme);
 void save_original_content(EditorState* state);
 void free_original_content(EditorState* state);
 int content_matches_original(EditorState* state);
 void update_dirty_status(EditorState* state);
 
+int doc_init(EditorState* state);
+void doc_free(EditorState* state);
+int doc_load_buffer(EditorState* state, char* data, size_t size);
+void doc_mark_saved(EditorState* state);
+void doc_snapshot(EditorState* state);
+void doc_snapshot_free(EditorState* state);
+int doc_line_length(EditorState* state, int y);
+int doc_count_step(EditorState* state, long budget);
+long doc_word_count(EditorState* state);
+long doc_char_count(EditorState* state);
+int doc_insert_text(EditorState* state, int y, int x, const char* text, int len);
+int doc_delete_text(EditorState* state, int y, int x, int len);
+int doc_replace_text(EditorState* state, int y, int x, int old_len, const char* text, int len);
+int doc_split_line(EditorState* state, int y, int x);
+int doc_join_lines(EditorState* state, int y);
+int doc_insert_line(EditorState* state, int at, const char* text, int len);
+int doc_remove_lines(EditorState* state, int at, int count);
+int doc_set_line(EditorState* state, int y, const char* text, int len);
+int doc_insert_lines(EditorState* state, int at, const char* text, int len);
+int doc_write(EditorState* state, FILE* fp);
+
+int search_compile(SearchPattern* p, const char* text, int flags);
+void search_pattern_free(SearchPattern* p);
+int search_exec(const SearchPattern* p, const char* s, int n, int from, regmatch_t* groups, int group_count);
+int search_line(const SearchPattern* p, const char* s, int n, int from, int* len);
+int search_range(EditorState* state, const SearchPattern* p, int first, int last, MatchList* out);
+int search_document(EditorState* state, const SearchPattern* p, MatchList* out, SearchProgress progress);
+void match_list_free(MatchList* list);
+int search_replace_all(EditorState* state, const SearchPattern* p, const char* replacement,
+                       SearchProgress progress, ReplaceStats* stats);
+void search_free(void);
+void incsearch_update(IncrementalSearch* inc, const char* term, int flags);
+int incsearch_step(IncrementalSearch* inc, EditorState* state, int budget_ms);
+void incsearch_free(IncrementalSearch* inc);
+
+void workers_run(int tasks, WorkFn fn, WorkTick tick, void* arg);
+void workers_free(void);
+
+void undo_init(EditorState* state);
+void undo_free(EditorState* state);
+void undo_clear(EditorState* state);
+void undo_set_budget(EditorState* state, size_t bytes);
+void undo_begin(EditorState* state);
+void undo_end(EditorState* state);
+void undo_break(EditorState* state);
+void undo_record(EditorState* state, int type, int y, int x, const char* text, int len);
+void undo_record_lines(EditorState* state, int type, int at, int count);
+void undo_record_set(EditorState* state, int y, const char* old_text, int old_len,
+                     const char* new_text, int new_len);
+void undo(EditorState* state);
+void redo(EditorState* state);
+
 
 int load_plugin(EditorState* state, const char* plugin_path);
 void unload_plugin(EditorState* state, int plugin_index);
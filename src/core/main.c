@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include "../core/editor.h"
 #include "../core/plugin.h"
 #include <unistd.h>
@@ -6,6 +7,13 @@
 #include <dirent.h>
 #include <signal.h>
 
+// getch timeout while highlight results are still on their way
+#define HIGHLIGHT_POLL_MS 10
+// Bytes of loaded text whose words are counted per idle poll
+#define COUNT_STEP_BYTES (1L << 20)
+// Keys already queued are handled for up to this long before the next frame
+#define INPUT_BATCH_MS 16
+
 volatile sig_atomic_t resized = 0;
 
 static void enable_bracketed_paste(void)
@@ -19,6 +27,13 @@ static void disable_bracketed_paste(void)
         fflush(stdout);
 }
 
+static double now_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
 static void handle_resize(int sig)
 {
         resized = 1;
@@ -107,6 +122,7 @@ int main(int argc, char * argv[])
 
 
          load_config(&state);
+         clipboard_init();
 
          
          initscr();
@@ -132,10 +148,7 @@ int main(int argc, char * argv[])
          } else {
                  show_welcome_screen();
                  
-                 for (int i = 0; i < state.line_count; i++) {
-                         free(state.lines[i]);
-                 }
-                 free(state.lines);
+                 doc_free(&state);
                  free_original_content(&state);
                  
                  unload_all_plugins(&state);
@@ -151,12 +164,24 @@ enable_bracketed_paste();
                  
                  curs_set(1);
 
+                 if (resized) {
+                         resized = 0;
+                         endwin();
+                         refresh();
+                         clear();
+                         state.render_invalid = 1;
+                 }
+
                  if (state.show_help) {
                          render_help_screen( & state);
                  } else {
+                         double frame_start = now_ms();
                          render_screen( & state);
                          
                          call_plugin_render_hooks(&state);
+                         InputStats* stats = &state.input_stats;
+                         stats->last_frame_ms = now_ms() - frame_start;
+                         if (stats->last_frame_ms > stats->max_frame_ms) stats->max_frame_ms = stats->last_frame_ms;
                  }
 
                  
@@ -170,26 +195,47 @@ enable_bracketed_paste();
                          last_syntax_update = now;
                  }
 
-                 if (resized) {
-                         resized = 0;
-                         endwin();
-                         refresh();
-                         clear();
-                 }
-
+                 // Poll while the highlight worker still owes visible lines or
+                 // the word count still has loaded lines to go
+                 int counting = state.doc.uncounted > 0;
+                 timeout(highlight_pending(&state) || counting ? HIGHLIGHT_POLL_MS : -1);
                  ch = getch();
+                 timeout(-1);
+                 if (ch == ERR) {
+                         if (counting) doc_count_step(&state, COUNT_STEP_BYTES);
+                         continue;
+                 }
 
-
-                 call_plugin_keypress_hooks(&state, ch);
-
-                 handle_input( & state, ch);
+                 // Keys that queued up while the last frame was drawn share the next one.
+                 // Prompts opened by a key still read the keys after it with a blocking getch.
+                 double batch_start = now_ms();
+                 int batch = 0;
+                 do {
+                         call_plugin_keypress_hooks(&state, ch);
+
+                         undo_begin(&state);
+                         handle_input( & state, ch);
+                         undo_end(&state);
+                         batch++;
+
+                         if (now_ms() - batch_start >= INPUT_BATCH_MS) break;
+                         timeout(0);
+                         ch = getch();
+                         timeout(-1);
+                 } while (ch != ERR);
+
+                 InputStats* stats = &state.input_stats;
+                 stats->last_batch = batch;
+                 if (batch > stats->max_batch) stats->max_batch = batch;
+                 stats->batches++;
+                 stats->keys += batch;
 
                  
                  time_t current_time = time(NULL);
                  double time_since_last_input = difftime(current_time, state.last_input_time);
 
                  
-                 if (time_since_last_input < 0.1) {
+                 if (time_since_last_input < 0.1 || batch > 1) {
                      state.rapid_input_mode = 1;
                  } else {
                      state.rapid_input_mode = 0;
@@ -202,16 +248,6 @@ enable_bracketed_paste();
                      update_syntax_highlighting(&state);
                  }
 
-                 
-                 if (state.show_help) {
-                         render_help_screen( & state);
-                 } else {
-                         render_screen( & state);
-                 }
-
-                 
-                 curs_set(1);
-                 refresh();
          }
          
          
@@ -219,10 +255,15 @@ enable_bracketed_paste();
 
          disable_bracketed_paste();
          endwin();
-         for (int i = 0; i < state.line_count; i++) {
-                 free(state.lines[i]);
-         }
-         free(state.lines);
+         doc_free(&state);
+         undo_free(&state);
+         free(state.render_rows);
+         highlight_free(&state);
+         theme_release(state.theme);
+         languages_free();
+         workers_free();
+         search_free();
+         clipboard_free();
          
          free_original_content(&state);
          return 0;
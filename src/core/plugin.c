@@ -149,13 +149,21 @@ void call_plugin_keypress_hooks(EditorState* state, int ch)
 void call_plugin_render_hooks(EditorState* state)
 {
     if (!state) return;
+    int hooked = 0;
+    chtype* before = NULL;
     for (int i = 0; i < state->plugin_count; i++) {
         if (state->plugins[i].loaded &&
             state->plugins[i].interface &&
             state->plugins[i].interface->on_render) {
+            if (!hooked) {
+                before = render_capture_rows(state);
+                hooked = 1;
+            }
             state->plugins[i].interface->on_render(state);
         }
     }
+    // render_screen skips unchanged rows; repaint the ones the hooks drew over
+    if (hooked) render_damage_rows(state, before);
 }
 
 void call_plugin_file_load_hooks(EditorState* state, const char* filename)
@@ -0,0 +1,887 @@
+#define _POSIX_C_SOURCE 200809L
+#include "editor.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+#define SEARCH_SHARD_LINES 16384
+// Lines an incremental slice searches between looks at the clock
+#define INCSEARCH_CLOCK_LINES 64
+
+/*
+ * Literal and regex search.
+ *
+ * Candidates are found by comparing a block of the line against the first
+ * byte of the pattern and the block len - 1 bytes further on against the last
+ * byte; only positions where both agree are compared in full. For ignored
+ * case a letter is compared with 0x20 or'ed in, which folds ASCII case; the
+ * few non-letters that fold onto a letter are weeded out by the full check.
+ *
+ * The widest filter the CPU supports (AVX2, SSE2 or a memchr loop) is picked
+ * once on first use.
+ */
+
+typedef int (*SearchScan)(const SearchLiteral* p, const char* s, int n, int from);
+
+static SearchScan search_scan;
+
+static unsigned char search_fold(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+static int search_word_byte(unsigned char c)
+{
+    return isalnum(c) || c == '_';
+}
+
+// Whether s[at, end) is neither preceded nor followed by a word character
+static int search_bounded(const char* s, int n, int at, int end)
+{
+    if (at > 0 && search_word_byte((unsigned char)s[at - 1])) return 0;
+    return end >= n || !search_word_byte((unsigned char)s[end]);
+}
+
+static int search_verify(const SearchLiteral* p, const char* s, int n, int at)
+{
+    if (p->flags & SEARCH_IGNORE_CASE) {
+        for (int k = 0; k < p->len; k++) {
+            if (search_fold((unsigned char)s[at + k]) != (unsigned char)p->folded[k]) return 0;
+        }
+    } else if (memcmp(s + at, p->text, p->len) != 0) {
+        return 0;
+    }
+    return !(p->flags & SEARCH_WHOLE_WORD) || search_bounded(s, n, at, at + p->len);
+}
+
+static int scan_scalar(const SearchLiteral* p, const char* s, int n, int i)
+{
+    int last = p->len - 1;
+    if (!(p->flags & SEARCH_IGNORE_CASE)) {
+        while (i + last < n) {
+            const char* hit = memchr(s + i, p->text[0], n - last - i);
+            if (!hit) return -1;
+            i = hit - s;
+            if (s[i + last] == p->text[last] && search_verify(p, s, n, i)) return i;
+            i++;
+        }
+        return -1;
+    }
+    for (; i + last < n; i++) {
+        if ((unsigned char)(s[i] | p->first_mask) == p->first &&
+            (unsigned char)(s[i + last] | p->last_mask) == p->last &&
+            search_verify(p, s, n, i)) return i;
+    }
+    return -1;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("sse2")))
+static int scan_sse2(const SearchLiteral* p, const char* s, int n, int i)
+{
+    int last = p->len - 1;
+    __m128i first = _mm_set1_epi8((char)p->first);
+    __m128i first_mask = _mm_set1_epi8((char)p->first_mask);
+    __m128i tail = _mm_set1_epi8((char)p->last);
+    __m128i tail_mask = _mm_set1_epi8((char)p->last_mask);
+
+    // The last block is moved back to end at the line end, overlapping the
+    // previous one; positions it shares with that block are masked off.
+    int end = n - last;
+    if (end - i < 16) return scan_scalar(p, s, n, i);
+    for (; i < end; i += 16) {
+        int j = i, covered = 0;
+        if (j + 16 > end) {
+            j = end - 16;
+            covered = i - j;
+        }
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(s + j)), first_mask);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(s + j + last)), tail_mask);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                            _mm_cmpeq_epi8(b, tail)));
+        mask &= ~0u << covered;
+        while (mask) {
+            int at = j + __builtin_ctz(mask);
+            if (search_verify(p, s, n, at)) return at;
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const SearchLiteral* p, const char* s, int n, int i)
+{
+    int last = p->len - 1;
+    __m256i first = _mm256_set1_epi8((char)p->first);
+    __m256i first_mask = _mm256_set1_epi8((char)p->first_mask);
+    __m256i tail = _mm256_set1_epi8((char)p->last);
+    __m256i tail_mask = _mm256_set1_epi8((char)p->last_mask);
+
+    // The last block is moved back to end at the line end, overlapping the
+    // previous one; positions it shares with that block are masked off.
+    int end = n - last;
+    if (end - i < 32) return scan_sse2(p, s, n, i);
+    for (; i < end; i += 32) {
+        int j = i, covered = 0;
+        if (j + 32 > end) {
+            j = end - 32;
+            covered = i - j;
+        }
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(s + j)), first_mask);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(s + j + last)), tail_mask);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                  _mm256_cmpeq_epi8(b, tail)));
+        mask &= ~0u << covered;
+        while (mask) {
+            int at = j + __builtin_ctz(mask);
+            if (search_verify(p, s, n, at)) return at;
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+}
+#endif
+
+static void search_dispatch(void)
+{
+    search_scan = scan_scalar;
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) search_scan = scan_avx2;
+    else if (__builtin_cpu_supports("sse2")) search_scan = scan_sse2;
+#endif
+}
+
+static void literal_compile(SearchLiteral* p, const char* text, int len, int flags)
+{
+    memcpy(p->text, text, len);
+    p->text[len] = '\0';
+    for (int k = 0; k <= len; k++) p->folded[k] = search_fold((unsigned char)p->text[k]);
+    p->len = len;
+    p->flags = flags;
+    if (len == 0) return;
+
+    const char* key = flags & SEARCH_IGNORE_CASE ? p->folded : p->text;
+    p->first = (unsigned char)key[0];
+    p->last = (unsigned char)key[len - 1];
+    p->first_mask = p->last_mask = 0;
+    if (flags & SEARCH_IGNORE_CASE) {
+        if (isalpha(p->first)) p->first_mask = 0x20;
+        if (isalpha(p->last)) p->last_mask = 0x20;
+    }
+}
+
+/*
+ * Regex mode uses POSIX extended syntax. Compiled programs are kept in a
+ * small cache keyed by source and flags, so searching again, or the find and
+ * the replace of the same term, compile once. Every SearchPattern holds a
+ * reference to its entry; an entry evicted while patterns still use it
+ * leaves the cache and is freed with the last of them.
+ */
+
+#define REGEX_CACHE_SIZE 16
+
+struct RegexEntry {
+    char* source;
+    int cflags;
+    regex_t re;
+    unsigned long used;
+    int refs;
+    int cached;
+};
+
+static RegexEntry* regex_cache[REGEX_CACHE_SIZE];
+static unsigned long regex_clock;
+
+static int regex_cflags(int flags)
+{
+    return REG_EXTENDED | (flags & SEARCH_IGNORE_CASE ? REG_ICASE : 0);
+}
+
+static void regex_release(RegexEntry* e)
+{
+    if (!e || --e->refs > 0 || e->cached) return;
+    regfree(&e->re);
+    free(e->source);
+    free(e);
+}
+
+/* Returns the cached program for source, with a reference taken for the caller. */
+static RegexEntry* regex_cache_get(const char* source, int cflags)
+{
+    int victim = 0;
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++) {
+        RegexEntry* e = regex_cache[i];
+        if (e && e->cflags == cflags && strcmp(e->source, source) == 0) {
+            e->used = ++regex_clock;
+            e->refs++;
+            return e;
+        }
+        if (regex_cache[victim] && (!e || e->used < regex_cache[victim]->used)) victim = i;
+    }
+
+    RegexEntry* e = calloc(1, sizeof(RegexEntry));
+    if (!e) return NULL;
+    size_t len = strlen(source);
+    e->source = malloc(len + 1);
+    if (!e->source || regcomp(&e->re, source, cflags) != 0) {
+        free(e->source);
+        free(e);
+        return NULL;
+    }
+    memcpy(e->source, source, len + 1);
+    e->cflags = cflags;
+    e->used = ++regex_clock;
+    e->refs = 1;
+    e->cached = 1;
+
+    RegexEntry* old = regex_cache[victim];
+    if (old) {
+        old->cached = 0;
+        old->refs++;
+        regex_release(old);
+    }
+    regex_cache[victim] = e;
+    return e;
+}
+
+/*
+ * Finds the longest run of plain characters that every match of an extended
+ * regex contains, for the literal filter to skip lines before regexec runs.
+ * Any top-level alternation gives up. Groups, bracket expressions, wildcards
+ * and anchors end a run, and a character made optional by ?, * or {} is
+ * dropped from it.
+ */
+static int regex_literal(const char* re, char* out)
+{
+    char run[256];
+    int run_len = 0, best = 0;
+    for (int i = 0; re[i]; i++) {
+        char c = re[i];
+        if (c == '\\' && re[i + 1] && !isalnum((unsigned char)re[i + 1])) {
+            run[run_len++] = re[++i];
+            continue;
+        }
+        if (c == '\\' || c == '(' || c == '[' || c == '.' || c == '^' || c == '$' ||
+            c == '*' || c == '?' || c == '{' || c == '+' || c == '|') {
+            if ((c == '*' || c == '?' || c == '{') && run_len > 0) run_len--;
+            if (run_len > best) {
+                memcpy(out, run, run_len);
+                best = run_len;
+            }
+            run_len = 0;
+        }
+        switch (c) {
+        case '|':
+            return 0;
+        case '\\':
+            if (re[i + 1]) i++;
+            break;
+        case '(':
+            for (int depth = 1; depth > 0 && re[i + 1]; ) {
+                i++;
+                if (re[i] == '\\' && re[i + 1]) i++;
+                else if (re[i] == '(') depth++;
+                else if (re[i] == ')') depth--;
+            }
+            break;
+        case '[':
+            i++;
+            if (re[i] == '^') i++;
+            if (re[i] == ']') i++;
+            while (re[i] && re[i] != ']') {
+                if (re[i] == '[' && (re[i + 1] == ':' || re[i + 1] == '=' || re[i + 1] == '.')) {
+                    const char* close = strchr(re + i + 2, ']');
+                    i = close ? close - re : i + 1;
+                }
+                i++;
+            }
+            if (!re[i]) return 0;
+            break;
+        case '{':
+            while (re[i + 1] && re[i] != '}') i++;
+            break;
+        case '.': case '^': case '$': case '*': case '?': case '+':
+            break;
+        default:
+            run[run_len++] = c;
+        }
+    }
+    if (run_len > best) {
+        memcpy(out, run, run_len);
+        best = run_len;
+    }
+    return best;
+}
+
+/* Returns -1 for an empty or overlong term or a regex that does not compile. */
+int search_compile(SearchPattern* p, const char* text, int flags)
+{
+    int len = strlen(text);
+    if (len == 0 || len >= (int)sizeof(p->literal.text)) return -1;
+    if (!search_scan) search_dispatch();
+
+    p->flags = flags;
+    p->source = NULL;
+    p->re = NULL;
+    p->entry = NULL;
+    if (!(flags & SEARCH_REGEX)) {
+        literal_compile(&p->literal, text, len, flags);
+        return 0;
+    }
+
+    RegexEntry* e = regex_cache_get(text, regex_cflags(flags));
+    if (!e) return -1;
+    p->entry = e;
+    p->source = e->source;
+    p->re = &e->re;
+    char required[256];
+    literal_compile(&p->literal, required, regex_literal(text, required), flags & SEARCH_IGNORE_CASE);
+    return 0;
+}
+
+/* Drops the pattern's hold on its compiled program; p can be compiled again. */
+void search_pattern_free(SearchPattern* p)
+{
+    regex_release(p->entry);
+    p->entry = NULL;
+    p->source = NULL;
+    p->re = NULL;
+}
+
+static int exec_with(const SearchPattern* p, const regex_t* re, const char* s, int n, int from,
+                     regmatch_t* groups, int group_count)
+{
+    if (from < 0) from = 0;
+    if (!re) {
+        int at = n - from < p->literal.len ? -1 : search_scan(&p->literal, s, n, from);
+        if (at < 0) return -1;
+        groups[0].rm_so = at;
+        groups[0].rm_eo = at + p->literal.len;
+        for (int g = 1; g < group_count; g++) groups[g].rm_so = groups[g].rm_eo = -1;
+        return at;
+    }
+
+    // The line is NUL-terminated at n, as regexec needs
+    while (from <= n) {
+        if (p->literal.len > 0 &&
+            (n - from < p->literal.len || search_scan(&p->literal, s, n, from) < 0)) return -1;
+        if (regexec(re, s + from, group_count, groups, from > 0 ? REG_NOTBOL : 0) != 0) return -1;
+        for (int g = 0; g < group_count; g++) {
+            if (groups[g].rm_so < 0) continue;
+            groups[g].rm_so += from;
+            groups[g].rm_eo += from;
+        }
+        if (!(p->flags & SEARCH_WHOLE_WORD) || search_bounded(s, n, groups[0].rm_so, groups[0].rm_eo)) {
+            return groups[0].rm_so;
+        }
+        from = groups[0].rm_so + 1;
+    }
+    return -1;
+}
+
+/*
+ * Finds the first match at or after from. groups[0] receives the match and,
+ * for a regex, the following entries its subexpressions, all as offsets into s.
+ */
+int search_exec(const SearchPattern* p, const char* s, int n, int from, regmatch_t* groups, int group_count)
+{
+    return exec_with(p, p->re, s, n, from, groups, group_count);
+}
+
+int search_line(const SearchPattern* p, const char* s, int n, int from, int* len)
+{
+    regmatch_t match;
+    int at = exec_with(p, p->re, s, n, from, &match, 1);
+    if (at >= 0 && len) *len = match.rm_eo - match.rm_so;
+    return at;
+}
+
+/*
+ * Writes the replacement for one match, where \0 to \9 stand for its groups
+ * and \\ for a backslash. With out NULL it only returns the length.
+ */
+static int expand_into(const char* s, const regmatch_t* groups, int group_count,
+                       const char* replacement, char* out)
+{
+    int k = 0;
+    for (const char* r = replacement; *r; r++) {
+        if (r[0] == '\\' && r[1] >= '0' && r[1] <= '9') {
+            int g = *++r - '0';
+            if (g < group_count && groups[g].rm_so >= 0) {
+                int len = groups[g].rm_eo - groups[g].rm_so;
+                if (out) memcpy(out + k, s + groups[g].rm_so, len);
+                k += len;
+            }
+            continue;
+        }
+        if (r[0] == '\\' && r[1] == '\\') r++;
+        if (out) out[k] = *r;
+        k++;
+    }
+    return k;
+}
+
+static int match_push(MatchList* out, int line, int col, int len)
+{
+    if (out->count == out->cap) {
+        int cap = out->cap ? out->cap * 2 : 64;
+        SearchMatch* items = realloc(out->items, cap * sizeof(SearchMatch));
+        if (!items) return -1;
+        out->items = items;
+        out->cap = cap;
+    }
+    out->items[out->count].line = line;
+    out->items[out->count].col = col;
+    out->items[out->count].len = len;
+    out->count++;
+    return 0;
+}
+
+static int range_with(EditorState* state, const SearchPattern* p, const regex_t* re,
+                      int first, int last, MatchList* out)
+{
+    for (int y = first; y < last; y++) {
+        const char* s = state->lines[y];
+        int n = state->doc.info[y].len;
+        regmatch_t match;
+        int at = 0;
+        while ((at = exec_with(p, re, s, n, at, &match, 1)) >= 0) {
+            int len = match.rm_eo - match.rm_so;
+            if (match_push(out, y, at, len) != 0) return -1;
+            at += len > 0 ? len : 1;
+        }
+    }
+    return 0;
+}
+
+/* Appends the non-overlapping matches on lines [first, last) to out. */
+int search_range(EditorState* state, const SearchPattern* p, int first, int last, MatchList* out)
+{
+    return range_with(state, p, p->re, first, last, out);
+}
+
+/*
+ * Large documents are cut into shards of SEARCH_SHARD_LINES lines that the
+ * worker pool searches into lists of their own; the lists are concatenated in
+ * shard order, so the result is the same as a single pass.
+ */
+/* Per-worker regex programs: regexec serializes callers sharing one. */
+typedef struct WorkerPrograms {
+    regex_t copies[WORKERS_MAX];
+    unsigned char compiled[WORKERS_MAX];  /* 1 when copies[worker] holds a program, 2 if it failed */
+} WorkerPrograms;
+
+static const regex_t* worker_program(WorkerPrograms* programs, const SearchPattern* p, int worker)
+{
+    if (!p->re || worker == 0) return p->re;
+    if (!programs->compiled[worker]) {
+        programs->compiled[worker] = regcomp(&programs->copies[worker], p->source, regex_cflags(p->flags)) == 0 ? 1 : 2;
+    }
+    return programs->compiled[worker] == 1 ? &programs->copies[worker] : p->re;
+}
+
+static void worker_programs_free(WorkerPrograms* programs)
+{
+    for (int w = 0; w < WORKERS_MAX; w++) {
+        if (programs->compiled[w] == 1) regfree(&programs->copies[w]);
+    }
+}
+
+typedef struct SearchJob {
+    EditorState* state;
+    const SearchPattern* pattern;
+    MatchList* shards;
+    long found;
+    int failed;
+    SearchProgress progress;
+    WorkerPrograms programs;
+} SearchJob;
+
+static void search_shard(void* arg, int index, int worker)
+{
+    SearchJob* job = arg;
+    const SearchPattern* p = job->pattern;
+    const regex_t* re = worker_program(&job->programs, p, worker);
+
+    int first = index * SEARCH_SHARD_LINES;
+    int last = first + SEARCH_SHARD_LINES;
+    if (last > job->state->line_count) last = job->state->line_count;
+
+    MatchList* out = &job->shards[index];
+    if (range_with(job->state, p, re, first, last, out) != 0) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&job->found, out->count, __ATOMIC_RELAXED);
+}
+
+static void search_tick(void* arg)
+{
+    SearchJob* job = arg;
+    if (job->progress) job->progress(job->state, __atomic_load_n(&job->found, __ATOMIC_RELAXED));
+}
+
+int search_document(EditorState* state, const SearchPattern* p, MatchList* out, SearchProgress progress)
+{
+    out->count = 0;
+    int shard_count = (state->line_count + SEARCH_SHARD_LINES - 1) / SEARCH_SHARD_LINES;
+    if (shard_count < 2) {
+        return search_range(state, p, 0, state->line_count, out);
+    }
+
+    SearchJob job;
+    memset(&job, 0, sizeof(job));
+    job.state = state;
+    job.pattern = p;
+    job.shards = calloc(shard_count, sizeof(MatchList));
+    job.progress = progress;
+    if (!job.shards) return -1;
+    workers_run(shard_count, search_shard, search_tick, &job);
+    worker_programs_free(&job.programs);
+
+    long total = out->count;
+    for (int i = 0; i < shard_count; i++) total += job.shards[i].count;
+    if (!job.failed && total > out->cap) {
+        SearchMatch* items = realloc(out->items, total * sizeof(SearchMatch));
+        if (items) {
+            out->items = items;
+            out->cap = total;
+        } else {
+            job.failed = 1;
+        }
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (!job.failed && job.shards[i].count > 0) {
+            memcpy(out->items + out->count, job.shards[i].items,
+                   job.shards[i].count * sizeof(SearchMatch));
+            out->count += job.shards[i].count;
+        }
+        match_list_free(&job.shards[i]);
+    }
+    free(job.shards);
+    return job.failed ? -1 : 0;
+}
+
+void match_list_free(MatchList* list)
+{
+    free(list->items);
+    list->items = NULL;
+    list->count = list->cap = 0;
+}
+
+/*
+ * Replace all rewrites each changed line once. The matches of the original
+ * line are collected first, and the text from the first match to the end of
+ * the last is built into a buffer of exactly the summed size. Shards of lines
+ * are built on the worker pool; the spans are then spliced in line order on
+ * the calling thread, so undo keeps only the changed span of each line.
+ */
+typedef struct LineEdit {
+    int line;
+    int x;        /* start of the first match */
+    int old_len;  /* up to the end of the last match */
+    int len;
+    int count;
+    char* text;
+} LineEdit;
+
+typedef struct EditList {
+    LineEdit* items;
+    int count, cap;
+    long skipped;
+    long failed;
+} EditList;
+
+typedef struct ReplaceJob {
+    EditorState* state;
+    const SearchPattern* pattern;
+    const char* replacement;
+    int replacement_len;
+    int expand;
+    EditList* shards;
+    long found;
+    SearchProgress progress;
+    WorkerPrograms programs;
+} ReplaceJob;
+
+// Matches of one line; each takes group_count entries
+typedef struct ReplaceScratch {
+    regmatch_t* groups;
+    int count, cap;
+} ReplaceScratch;
+
+static int edit_push(EditList* list, const LineEdit* edit)
+{
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 64;
+        LineEdit* items = realloc(list->items, cap * sizeof(LineEdit));
+        if (!items) return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = *edit;
+    return 0;
+}
+
+static int count_matches(const SearchPattern* p, const regex_t* re, const char* s, int n)
+{
+    regmatch_t match;
+    int count = 0, at = 0;
+    while ((at = exec_with(p, re, s, n, at, &match, 1)) >= 0) {
+        count++;
+        at = match.rm_eo > at ? match.rm_eo : at + 1;
+    }
+    return count;
+}
+
+static void replace_line(ReplaceJob* job, const regex_t* re, ReplaceScratch* scratch, EditList* out, int y)
+{
+    const SearchPattern* p = job->pattern;
+    const char* s = job->state->lines[y];
+    int n = job->state->doc.info[y].len;
+    int group_count = job->expand ? 10 : 1;
+
+    scratch->count = 0;
+    int at = 0;
+    for (;;) {
+        if (scratch->count == scratch->cap) {
+            int cap = scratch->cap ? scratch->cap * 2 : 64;
+            regmatch_t* groups = realloc(scratch->groups, (size_t)cap * group_count * sizeof(regmatch_t));
+            if (!groups) {
+                out->failed += count_matches(p, re, s, n);
+                return;
+            }
+            scratch->groups = groups;
+            scratch->cap = cap;
+        }
+        regmatch_t* m = scratch->groups + (size_t)scratch->count * group_count;
+        if ((at = exec_with(p, re, s, n, at, m, group_count)) < 0) break;
+        scratch->count++;
+        // After an empty match the next one may not start at the same place
+        at = m[0].rm_eo > at ? m[0].rm_eo : at + 1;
+    }
+    if (scratch->count == 0) return;
+
+    int x = scratch->groups[0].rm_so;
+    int end = scratch->groups[(size_t)(scratch->count - 1) * group_count].rm_eo;
+    long len = end - x;
+    for (int i = 0; i < scratch->count; i++) {
+        regmatch_t* m = scratch->groups + (size_t)i * group_count;
+        len -= m[0].rm_eo - m[0].rm_so;
+        len += job->expand ? expand_into(s, m, group_count, job->replacement, NULL) : job->replacement_len;
+    }
+    __atomic_fetch_add(&job->found, scratch->count, __ATOMIC_RELAXED);
+    if (n - (end - x) + len >= INT_MAX) {
+        out->skipped += scratch->count;
+        return;
+    }
+
+    LineEdit edit = { y, x, end - x, (int)len, scratch->count, malloc(len + 1) };
+    if (!edit.text) {
+        out->failed += scratch->count;
+        return;
+    }
+    char* dst = edit.text;
+    int copied = x;
+    for (int i = 0; i < scratch->count; i++) {
+        regmatch_t* m = scratch->groups + (size_t)i * group_count;
+        memcpy(dst, s + copied, m[0].rm_so - copied);
+        dst += m[0].rm_so - copied;
+        if (job->expand) {
+            dst += expand_into(s, m, group_count, job->replacement, dst);
+        } else {
+            memcpy(dst, job->replacement, job->replacement_len);
+            dst += job->replacement_len;
+        }
+        copied = m[0].rm_eo;
+    }
+    if (edit_push(out, &edit) != 0) {
+        free(edit.text);
+        out->failed += scratch->count;
+    }
+}
+
+static void replace_shard(void* arg, int index, int worker)
+{
+    ReplaceJob* job = arg;
+    const regex_t* re = worker_program(&job->programs, job->pattern, worker);
+    int first = index * SEARCH_SHARD_LINES;
+    int last = first + SEARCH_SHARD_LINES;
+    if (last > job->state->line_count) last = job->state->line_count;
+
+    ReplaceScratch scratch = { NULL, 0, 0 };
+    for (int y = first; y < last; y++) replace_line(job, re, &scratch, &job->shards[index], y);
+    free(scratch.groups);
+}
+
+static void replace_tick(void* arg)
+{
+    ReplaceJob* job = arg;
+    if (job->progress) job->progress(job->state, __atomic_load_n(&job->found, __ATOMIC_RELAXED));
+}
+
+/*
+ * Replaces every match of p. In regex mode \0 to \9 in replacement stand
+ * for the groups of each match. Returns -1 only if nothing could be tried.
+ */
+int search_replace_all(EditorState* state, const SearchPattern* p, const char* replacement,
+                       SearchProgress progress, ReplaceStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    int shard_count = (state->line_count + SEARCH_SHARD_LINES - 1) / SEARCH_SHARD_LINES;
+    if (shard_count == 0) return 0;
+
+    ReplaceJob* job = calloc(1, sizeof(ReplaceJob));
+    if (!job) return -1;
+    job->state = state;
+    job->pattern = p;
+    job->replacement = replacement;
+    job->replacement_len = strlen(replacement);
+    job->expand = (p->flags & SEARCH_REGEX) != 0;
+    job->progress = progress;
+    job->shards = calloc(shard_count, sizeof(EditList));
+    if (!job->shards) {
+        free(job);
+        return -1;
+    }
+    if (shard_count < 2) replace_shard(job, 0, 0);
+    else workers_run(shard_count, replace_shard, replace_tick, job);
+    worker_programs_free(&job->programs);
+
+    // One undo step even when every edit is a short insert that looks like typing
+    undo_begin(state);
+    undo_break(state);
+    for (int i = 0; i < shard_count; i++) {
+        EditList* list = &job->shards[i];
+        for (int k = 0; k < list->count; k++) {
+            LineEdit* edit = &list->items[k];
+            if (doc_replace_text(state, edit->line, edit->x, edit->old_len, edit->text, edit->len) == 0) {
+                stats->replaced += edit->count;
+                stats->lines++;
+            } else {
+                stats->failed += edit->count;
+            }
+            free(edit->text);
+        }
+        stats->skipped += list->skipped;
+        stats->failed += list->failed;
+        free(list->items);
+    }
+    undo_end(state);
+
+    free(job->shards);
+    free(job);
+    return 0;
+}
+
+/*
+ * Incremental search works in slices of budget_ms so the prompt can keep
+ * reading keys; a new term restarts the pass. Lines without the old term
+ * cannot hold an extension of it, so an extended literal term only searches
+ * the lines the finished previous pass found. Regex terms do not extend that
+ * way and always search the whole document.
+ */
+void incsearch_update(IncrementalSearch* inc, const char* term, int flags)
+{
+    int reuse = inc->valid && inc->done && flags == inc->flags && !(flags & SEARCH_REGEX) &&
+                strncmp(term, inc->term, strlen(inc->term)) == 0;
+    free(inc->candidates);
+    inc->candidates = NULL;
+    inc->candidate_count = 0;
+    if (reuse) {
+        inc->candidates = inc->lines;
+        inc->candidate_count = inc->line_count;
+        inc->lines = NULL;
+        inc->line_cap = 0;
+    }
+    inc->line_count = 0;
+    inc->matches.count = 0;
+    inc->next = 0;
+    inc->flags = flags;
+    snprintf(inc->term, sizeof(inc->term), "%s", term);
+
+    search_pattern_free(&inc->pattern);
+    search_pattern_free(&inc->substring);
+    inc->valid = search_compile(&inc->pattern, term, flags) == 0;
+    int substring_flags = flags & SEARCH_REGEX ? flags : flags & ~SEARCH_WHOLE_WORD;
+    if (inc->valid && search_compile(&inc->substring, term, substring_flags) != 0) inc->valid = 0;
+    inc->done = !inc->valid;
+}
+
+static int incsearch_keep_line(IncrementalSearch* inc, int y)
+{
+    if (inc->line_count == inc->line_cap) {
+        int cap = inc->line_cap ? inc->line_cap * 2 : 256;
+        int* lines = realloc(inc->lines, cap * sizeof(int));
+        if (!lines) return -1;
+        inc->lines = lines;
+        inc->line_cap = cap;
+    }
+    inc->lines[inc->line_count++] = y;
+    return 0;
+}
+
+/* Searches on for about budget_ms; returns 1 once the pass is complete. */
+int incsearch_step(IncrementalSearch* inc, EditorState* state, int budget_ms)
+{
+    if (inc->done) return 1;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int total = inc->candidates ? inc->candidate_count : state->line_count;
+    while (inc->next < total) {
+        int y = inc->candidates ? inc->candidates[inc->next] : inc->next;
+        inc->next++;
+
+        int before = inc->matches.count;
+        int failed = range_with(state, &inc->pattern, inc->pattern.re, y, y + 1, &inc->matches) != 0;
+        int holds = inc->matches.count > before;
+        if (!holds && inc->substring.flags != inc->pattern.flags) {
+            holds = search_line(&inc->substring, state->lines[y], state->doc.info[y].len, 0, NULL) >= 0;
+        }
+        if (!failed && holds && !(inc->flags & SEARCH_REGEX)) failed = incsearch_keep_line(inc, y) != 0;
+        if (failed) {
+            // Out of memory: keep what was found but never reuse it
+            inc->valid = 0;
+            break;
+        }
+
+        if (inc->next % INCSEARCH_CLOCK_LINES == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L;
+            if (elapsed >= budget_ms) return 0;
+        }
+    }
+    inc->done = 1;
+    free(inc->candidates);
+    inc->candidates = NULL;
+    return 1;
+}
+
+void incsearch_free(IncrementalSearch* inc)
+{
+    free(inc->lines);
+    free(inc->candidates);
+    match_list_free(&inc->matches);
+    search_pattern_free(&inc->pattern);
+    search_pattern_free(&inc->substring);
+    memset(inc, 0, sizeof(*inc));
+}
+
+void search_free(void)
+{
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++) {
+        if (!regex_cache[i]) continue;
+        regex_cache[i]->cached = 0;
+        regex_cache[i]->refs++;
+        regex_release(regex_cache[i]);
+        regex_cache[i] = NULL;
+    }
+}
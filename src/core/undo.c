@@ -0,0 +1,415 @@
+#include "editor.h"
+#include <string.h>
+
+/*
+ * Undo journal.
+ *
+ * The document layer reports every primitive edit here before it happens.
+ * Each edit becomes an UndoOp whose text (inserted or removed bytes) is
+ * appended to a single growable arena, so recording never allocates per
+ * edit. Ops are grouped into transactions: everything between the outermost
+ * undo_begin/undo_end pair is one step, and consecutive typing steps are
+ * merged until the cursor jumps or a new word starts.
+ *
+ * Undo replays a transaction's ops backwards through the doc_* API, so it
+ * costs O(text touched) and never copies the buffer. The budget is checked
+ * before each op is recorded: the oldest transactions are dropped to make
+ * room, and a transaction too large to fit on its own clears the history
+ * and records nothing more until it ends.
+ */
+
+#define UNDO_DEFAULT_BUDGET_KB 32768
+#define UNDO_TYPING_MAX_LEN    2
+
+static size_t undo_usage(UndoJournal* undo)
+{
+    return undo->arena_used +
+           (size_t)undo->op_count * sizeof(UndoOp) +
+           (size_t)undo->txn_count * sizeof(UndoTxn);
+}
+
+static int undo_grow(void** buf, int* cap, int needed, size_t elem)
+{
+    if (needed <= *cap) return 0;
+    int new_cap = *cap > 0 ? *cap : 64;
+    while (new_cap < needed) new_cap *= 2;
+    void* grown = realloc(*buf, (size_t)new_cap * elem);
+    if (!grown) return -1;
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static int undo_arena_reserve(UndoJournal* undo, size_t size)
+{
+    if (undo->arena_used + size > undo->arena_cap) {
+        size_t new_cap = undo->arena_cap > 0 ? undo->arena_cap : 4096;
+        while (new_cap < undo->arena_used + size) new_cap *= 2;
+        if (new_cap > undo->budget && undo->arena_used + size <= undo->budget) new_cap = undo->budget;
+        char* grown = (char*)realloc(undo->arena, new_cap);
+        if (!grown) return -1;
+        undo->arena = grown;
+        undo->arena_cap = new_cap;
+    }
+    return 0;
+}
+
+/* Forgets transactions that can no longer be redone. */
+static void undo_truncate_redo(UndoJournal* undo)
+{
+    if (undo->current == undo->txn_count) return;
+    UndoTxn* first = &undo->txns[undo->current];
+    if (first->first_op < undo->op_count) {
+        undo->arena_used = undo->ops[first->first_op].text;
+    }
+    undo->op_count = first->first_op;
+    undo->txn_count = undo->current;
+}
+
+static void undo_drop_oldest(UndoJournal* undo, int count)
+{
+    if (count <= 0) return;
+    if (count >= undo->txn_count) {
+        undo->op_count = 0;
+        undo->txn_count = 0;
+        undo->current = 0;
+        undo->arena_used = 0;
+        return;
+    }
+
+    int first_op = undo->txns[count].first_op;
+    size_t first_text = first_op < undo->op_count ? undo->ops[first_op].text : undo->arena_used;
+
+    memmove(undo->arena, undo->arena + first_text, undo->arena_used - first_text);
+    undo->arena_used -= first_text;
+
+    memmove(undo->ops, undo->ops + first_op, (size_t)(undo->op_count - first_op) * sizeof(UndoOp));
+    undo->op_count -= first_op;
+    for (int i = 0; i < undo->op_count; i++) {
+        undo->ops[i].text -= first_text;
+    }
+
+    memmove(undo->txns, undo->txns + count, (size_t)(undo->txn_count - count) * sizeof(UndoTxn));
+    undo->txn_count -= count;
+    undo->current -= count;
+    if (undo->current < 0) undo->current = 0;
+    for (int i = 0; i < undo->txn_count; i++) {
+        undo->txns[i].first_op -= first_op;
+    }
+}
+
+/*
+ * Drops the oldest finished transactions until extra more bytes fit in the
+ * budget, going a quarter below it so this does not run on every op.
+ * Returns -1 when the open transaction alone does not fit.
+ */
+static int undo_make_room(UndoJournal* undo, size_t extra)
+{
+    if (undo_usage(undo) + extra <= undo->budget) return 0;
+
+    size_t target = undo->budget - undo->budget / 4;
+    int drop = 0;
+    size_t usage = undo_usage(undo) + extra;
+    while (drop < undo->txn_count - 1 && usage > target) {
+        UndoTxn* txn = &undo->txns[drop];
+        size_t text = 0;
+        if (txn->op_count > 0) {
+            int last = txn->first_op + txn->op_count - 1;
+            text = undo->ops[last].text + (size_t)undo->ops[last].len - undo->ops[txn->first_op].text;
+        }
+        usage -= text + (size_t)txn->op_count * sizeof(UndoOp) + sizeof(UndoTxn);
+        drop++;
+    }
+    undo_drop_oldest(undo, drop);
+    return undo_usage(undo) + extra <= undo->budget ? 0 : -1;
+}
+
+void undo_init(EditorState* state)
+{
+    if (!state) return;
+    memset(&state->undo, 0, sizeof(state->undo));
+    state->undo.budget = (size_t)UNDO_DEFAULT_BUDGET_KB * 1024;
+}
+
+void undo_free(EditorState* state)
+{
+    if (!state) return;
+    size_t budget = state->undo.budget;
+    free(state->undo.arena);
+    free(state->undo.ops);
+    free(state->undo.txns);
+    undo_init(state);
+    state->undo.budget = budget;
+}
+
+/*
+ * Empties the history. Inside undo_begin the rest of the transaction is not
+ * recorded either: undoing only its tail would leave the edit half applied.
+ */
+void undo_clear(EditorState* state)
+{
+    if (!state) return;
+    UndoJournal* undo = &state->undo;
+    undo->arena_used = 0;
+    undo->op_count = 0;
+    undo->txn_count = 0;
+    undo->current = 0;
+    undo->open = 0;
+    undo->discard = undo->depth > 0;
+}
+
+void undo_set_budget(EditorState* state, size_t bytes)
+{
+    if (!state || bytes == 0) return;
+    state->undo.budget = bytes;
+}
+
+void undo_begin(EditorState* state)
+{
+    if (!state || state->undo.applying) return;
+    if (state->undo.depth++ > 0) return;
+    state->undo.open = 0;
+    state->undo.before_x = state->cursor_x;
+    state->undo.before_y = state->cursor_y;
+}
+
+void undo_end(EditorState* state)
+{
+    if (!state || state->undo.applying || state->undo.depth == 0) return;
+    UndoJournal* undo = &state->undo;
+    if (--undo->depth > 0) return;
+    int isolated = undo->isolated;
+    undo->isolated = 0;
+    undo->discard = 0;
+    if (!undo->open) return;
+    undo->open = 0;
+
+    UndoTxn* txn = &undo->txns[undo->txn_count - 1];
+    txn->after_x = state->cursor_x;
+    txn->after_y = state->cursor_y;
+    if (isolated) txn->typing = 0;
+
+    if (undo->txn_count >= 2 && !undo->merge_blocked) {
+        UndoTxn* prev = &undo->txns[undo->txn_count - 2];
+        int starts_word = !isspace((unsigned char)txn->first_char) &&
+                          isspace((unsigned char)prev->last_char);
+        if (prev->typing && txn->typing && !starts_word &&
+            prev->after_x == txn->before_x && prev->after_y == txn->before_y) {
+            prev->op_count += txn->op_count;
+            prev->after_x = txn->after_x;
+            prev->after_y = txn->after_y;
+            prev->last_char = txn->last_char;
+            undo->txn_count--;
+            undo->current--;
+        }
+    }
+    undo->merge_blocked = 0;
+}
+
+/*
+ * Makes the open transaction, or the next one when none is open, a step of
+ * its own: it is not merged with the typing before or after it.
+ */
+void undo_break(EditorState* state)
+{
+    if (!state) return;
+    state->undo.isolated = 1;
+}
+
+/*
+ * Appends an op with room for len bytes of text in the arena. Returns -1 when
+ * the op is not recorded: the journal could not grow or the transaction does
+ * not fit the budget, in which case the history is dropped.
+ */
+static int undo_push(EditorState* state, int type, int y, int x, int len, char** text_out)
+{
+    UndoJournal* undo = &state->undo;
+    if (undo->discard) return -1;
+
+    if (!undo->open) {
+        undo_truncate_redo(undo);
+        if (undo_grow((void**)&undo->txns, &undo->txn_cap, undo->txn_count + 1, sizeof(UndoTxn)) != 0) {
+            undo_clear(state);
+            return -1;
+        }
+        UndoTxn* txn = &undo->txns[undo->txn_count++];
+        memset(txn, 0, sizeof(*txn));
+        txn->first_op = undo->op_count;
+        txn->before_x = undo->before_x;
+        txn->before_y = undo->before_y;
+        txn->typing = 1;
+        undo->current = undo->txn_count;
+        undo->open = 1;
+    }
+
+    if (undo_make_room(undo, (size_t)len + sizeof(UndoOp)) != 0) {
+        undo_clear(state);
+        show_status(state, "Change too large for the undo budget; undo history cleared");
+        return -1;
+    }
+    if (undo_grow((void**)&undo->ops, &undo->op_cap, undo->op_count + 1, sizeof(UndoOp)) != 0 ||
+        undo_arena_reserve(undo, (size_t)len) != 0) {
+        undo_clear(state);
+        return -1;
+    }
+
+    UndoOp* op = &undo->ops[undo->op_count++];
+    op->type = type;
+    op->y = y;
+    op->x = x;
+    op->len = len;
+    op->text = undo->arena_used;
+    undo->arena_used += (size_t)len;
+
+    UndoTxn* txn = &undo->txns[undo->txn_count - 1];
+    txn->op_count++;
+    *text_out = undo->arena + op->text;
+    return 0;
+}
+
+void undo_record(EditorState* state, int type, int y, int x, const char* text, int len)
+{
+    if (!state || state->undo.applying) return;
+    int implicit = state->undo.depth == 0;
+    if (implicit) undo_begin(state);
+
+    char* dst;
+    if (undo_push(state, type, y, x, len, &dst) == 0) {
+        if (len > 0) memcpy(dst, text, len);
+        UndoTxn* txn = &state->undo.txns[state->undo.txn_count - 1];
+        if (type != UNDO_INSERT || len == 0 || len > UNDO_TYPING_MAX_LEN) {
+            txn->typing = 0;
+        } else {
+            if (txn->op_count == 1) txn->first_char = text[0];
+            txn->last_char = text[0];
+        }
+    }
+
+    if (implicit) undo_end(state);
+}
+
+/* Records lines [at, at + count) joined by '\n' as one op. */
+void undo_record_lines(EditorState* state, int type, int at, int count)
+{
+    if (!state || state->undo.applying || count <= 0) return;
+    int implicit = state->undo.depth == 0;
+    if (implicit) undo_begin(state);
+
+    size_t total = (size_t)count - 1;
+    for (int i = at; i < at + count; i++) {
+        total += (size_t)doc_line_length(state, i);
+    }
+
+    if (total > (size_t)0x7fffffff) {
+        undo_clear(state);
+    } else {
+        char* dst;
+        if (undo_push(state, type, at, count, (int)total, &dst) == 0) {
+            for (int i = at; i < at + count; i++) {
+                int len = doc_line_length(state, i);
+                memcpy(dst, state->lines[i], len);
+                dst += len;
+                if (i < at + count - 1) *dst++ = '\n';
+            }
+            state->undo.txns[state->undo.txn_count - 1].typing = 0;
+        }
+    }
+
+    if (implicit) undo_end(state);
+}
+
+/* Records a whole-line replacement; the op keeps the old and new text back to back. */
+void undo_record_set(EditorState* state, int y, const char* old_text, int old_len,
+                     const char* new_text, int new_len)
+{
+    if (!state || state->undo.applying) return;
+    int implicit = state->undo.depth == 0;
+    if (implicit) undo_begin(state);
+
+    char* dst;
+    if (undo_push(state, UNDO_SET_LINE, y, old_len, old_len + new_len, &dst) == 0) {
+        memcpy(dst, old_text, old_len);
+        memcpy(dst + old_len, new_text, new_len);
+        state->undo.txns[state->undo.txn_count - 1].typing = 0;
+    }
+
+    if (implicit) undo_end(state);
+}
+
+static void undo_apply_op(EditorState* state, UndoOp* op, int forward)
+{
+    const char* text = state->undo.arena + op->text;
+    switch (op->type) {
+    case UNDO_INSERT:
+        if (forward) doc_insert_text(state, op->y, op->x, text, op->len);
+        else doc_delete_text(state, op->y, op->x, op->len);
+        break;
+    case UNDO_DELETE:
+        if (forward) doc_delete_text(state, op->y, op->x, op->len);
+        else doc_insert_text(state, op->y, op->x, text, op->len);
+        break;
+    case UNDO_INSERT_LINES:
+        if (forward) doc_insert_lines(state, op->y, text, op->len);
+        else doc_remove_lines(state, op->y, op->x);
+        break;
+    case UNDO_REMOVE_LINES:
+        if (forward) doc_remove_lines(state, op->y, op->x);
+        else doc_insert_lines(state, op->y, text, op->len);
+        break;
+    case UNDO_SET_LINE:
+        if (forward) doc_set_line(state, op->y, text + op->x, op->len - op->x);
+        else doc_set_line(state, op->y, text, op->x);
+        break;
+    }
+}
+
+static void undo_restore_cursor(EditorState* state, int x, int y)
+{
+    if (y >= state->line_count) y = state->line_count - 1;
+    if (y < 0) y = 0;
+    if (x > doc_line_length(state, y)) x = doc_line_length(state, y);
+    if (x < 0) x = 0;
+    state->cursor_x = x;
+    state->cursor_y = y;
+    clear_selection(state);
+    move_cursor(state, 0, 0);
+    update_dirty_status(state);
+}
+
+void undo(EditorState* state)
+{
+    if (!state) return;
+    UndoJournal* undo = &state->undo;
+    if (undo->open || undo->current == 0) {
+        show_status(state, "Nothing to undo");
+        return;
+    }
+
+    UndoTxn* txn = &undo->txns[--undo->current];
+    undo->applying = 1;
+    for (int i = txn->first_op + txn->op_count - 1; i >= txn->first_op; i--) {
+        undo_apply_op(state, &undo->ops[i], 0);
+    }
+    undo->applying = 0;
+    undo->merge_blocked = 1;
+    undo_restore_cursor(state, txn->before_x, txn->before_y);
+}
+
+void redo(EditorState* state)
+{
+    if (!state) return;
+    UndoJournal* undo = &state->undo;
+    if (undo->open || undo->current == undo->txn_count) {
+        show_status(state, "Nothing to redo");
+        return;
+    }
+
+    UndoTxn* txn = &undo->txns[undo->current++];
+    undo->applying = 1;
+    for (int i = txn->first_op; i < txn->first_op + txn->op_count; i++) {
+        undo_apply_op(state, &undo->ops[i], 1);
+    }
+    undo->applying = 0;
+    undo->merge_blocked = 1;
+    undo_restore_cursor(state, txn->after_x, txn->after_y);
+}
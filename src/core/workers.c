@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+#include "editor.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A pool of threads, one per online CPU, started on first use and kept for
+ * the life of the editor. workers_run hands out the indices of one batch of
+ * tasks; the calling thread does not take tasks itself but wakes every
+ * WORKERS_TICK_MS to let the caller redraw progress.
+ */
+
+#define WORKERS_TICK_MS 50
+
+static struct {
+    pthread_t threads[WORKERS_MAX];
+    int count;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    int quit;
+    WorkFn fn;
+    void* arg;
+    int tasks;
+    int next;
+    int finished;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+           .done = PTHREAD_COND_INITIALIZER };
+
+static long workers_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static void* worker_main(void* id)
+{
+    int worker = (int)(intptr_t)id;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.quit && pool.next >= pool.tasks) pthread_cond_wait(&pool.wake, &pool.lock);
+        if (pool.quit) break;
+
+        int index = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+        pool.fn(pool.arg, index, worker);
+        pthread_mutex_lock(&pool.lock);
+        if (++pool.finished == pool.tasks) pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void workers_start(void)
+{
+    pool.started = 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > WORKERS_MAX) cpus = WORKERS_MAX;
+    // A single CPU gains nothing from threads; tasks then run on the caller
+    if (cpus < 2) return;
+    while (pool.count < cpus &&
+           pthread_create(&pool.threads[pool.count], NULL, worker_main,
+                          (void*)(intptr_t)pool.count) == 0) {
+        pool.count++;
+    }
+}
+
+/*
+ * Runs fn(arg, i, worker) for every i in [0, tasks) and returns when all are
+ * done. worker is below WORKERS_MAX and no two tasks run on one at once.
+ */
+void workers_run(int tasks, WorkFn fn, WorkTick tick, void* arg)
+{
+    if (tasks <= 0) return;
+    if (!pool.started) workers_start();
+
+    if (pool.count == 0) {
+        long last_tick = workers_now_ms();
+        for (int i = 0; i < tasks; i++) {
+            fn(arg, i, 0);
+            if (tick && workers_now_ms() - last_tick >= WORKERS_TICK_MS) {
+                tick(arg);
+                last_tick = workers_now_ms();
+            }
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.tasks = tasks;
+    pool.next = 0;
+    pool.finished = 0;
+    pthread_cond_broadcast(&pool.wake);
+    while (pool.finished < pool.tasks) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WORKERS_TICK_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&pool.done, &pool.lock, &until) != 0 && tick &&
+            pool.finished < pool.tasks) {
+            pthread_mutex_unlock(&pool.lock);
+            tick(arg);
+            pthread_mutex_lock(&pool.lock);
+        }
+    }
+    pool.tasks = pool.next = pool.finished = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void workers_free(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.count; i++) pthread_join(pool.threads[i], NULL);
+    pool.count = 0;
+}
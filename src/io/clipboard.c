@@ -0,0 +1,382 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../core/editor.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+/*
+ * System clipboard.
+ *
+ * The provider is picked once, from the display variables and the tools on
+ * PATH, without running anything. A copy is handed to a copy tool that stays
+ * running for as long as it owns the selection (wl-copy --foreground,
+ * xclip -quiet, xsel --nodetach). While that process is alive the clipboard
+ * still holds our text, so a paste returns it without forking; only text
+ * copied by another program is read through the paste command, in full.
+ *
+ * Without a display server (and always over SSH) the terminal's own
+ * clipboard is used through OSC 52, which needs no process at all. Reading it
+ * back is asked for once; a terminal that does not answer is not asked again
+ * and pastes fall back to the editor's own copy.
+ */
+
+#define CLIPBOARD_READ_CHUNK (64 * 1024)
+// Base64 characters per OSC 52 write; GNU screen also caps each of its DCS strings
+#define OSC52_CHUNK          4096
+#define OSC52_SCREEN_CHUNK   512
+// How long a terminal may take to start answering a clipboard query, and to finish
+#define OSC52_FIRST_REPLY_MS 500
+#define OSC52_REPLY_IDLE_MS  2000
+
+typedef struct ClipboardProvider {
+        const char* display;           /* variable that must be set, or NULL */
+        const char* tool;              /* looked up on PATH */
+        const char* copy[2][6];        /* copy commands fed the text on stdin */
+        int owns;                      /* the copy commands run until the selection is taken */
+        const char* paste[2];          /* tried in order until one has text */
+        int osc52;                     /* the terminal clipboard; no tools involved */
+} ClipboardProvider;
+
+static const ClipboardProvider providers[] = {
+        { "WAYLAND_DISPLAY", "wl-paste",
+          { { "wl-copy", "--foreground", NULL } }, 1,
+          { "wl-paste --no-newline 2>/dev/null" }, 0 },
+        { "DISPLAY", "xclip",
+          { { "xclip", "-quiet", "-selection", "clipboard", "-i", NULL },
+            { "xclip", "-quiet", "-selection", "primary", "-i", NULL } }, 1,
+          { "xclip -selection clipboard -o 2>/dev/null", "xclip -selection primary -o 2>/dev/null" }, 0 },
+        { "DISPLAY", "xsel",
+          { { "xsel", "--nodetach", "--clipboard", "--input", NULL },
+            { "xsel", "--nodetach", "--primary", "--input", NULL } }, 1,
+          { "xsel --clipboard --output 2>/dev/null", "xsel --primary --output 2>/dev/null" }, 0 },
+        { NULL, "termux-clipboard-get",
+          { { "termux-clipboard-set", NULL } }, 0,
+          { "termux-clipboard-get 2>/dev/null" }, 0 },
+        { NULL, "pbpaste",
+          { { "pbcopy", NULL } }, 0,
+          { "pbpaste 2>/dev/null" }, 0 },
+        { NULL, NULL, { { NULL } }, 0, { NULL }, 1 },
+};
+
+#define PROVIDER_COUNT ((int)(sizeof(providers) / sizeof(providers[0])))
+
+static struct {
+        int probed;
+        const ClipboardProvider* provider;  /* NULL when only the editor's own copy exists */
+        char* text;                         /* last text copied from the editor */
+        pid_t owners[2];                    /* running copy commands of an owning provider, in copy order */
+        int osc52_reads;                    /* 1 once the terminal answered a query, -1 if it did not */
+} clip;
+
+static int on_path(const char* tool)
+{
+        const char* path = getenv("PATH");
+        if (!path) return 0;
+        char full[4096];
+        for (const char* dir = path; ; ) {
+                const char* end = strchr(dir, ':');
+                int len = end ? (int)(end - dir) : (int)strlen(dir);
+                if (len > 0 && snprintf(full, sizeof(full), "%.*s/%s", len, dir, tool) < (int)sizeof(full) &&
+                    access(full, X_OK) == 0) {
+                        return 1;
+                }
+                if (!end) return 0;
+                dir = end + 1;
+        }
+}
+
+void clipboard_init(void)
+{
+        if (clip.probed) return;
+        clip.probed = 1;
+        // A copy tool that exits early must not take the editor down with it
+        signal(SIGPIPE, SIG_IGN);
+        int has_display = 0;
+        for (int i = 0; i < PROVIDER_COUNT; i++) {
+                const char* display = providers[i].display;
+                if (display && getenv(display) && *getenv(display)) has_display = 1;
+        }
+        // Over SSH without a forwarded display, local tools would reach the wrong machine
+        int remote = getenv("SSH_CONNECTION") || getenv("SSH_TTY");
+        for (int i = 0; i < PROVIDER_COUNT; i++) {
+                const ClipboardProvider* p = &providers[i];
+                if (p->osc52) {
+                        if (!isatty(STDOUT_FILENO)) continue;
+                } else {
+                        if (remote && !has_display) continue;
+                        if (p->display && !(getenv(p->display) && *getenv(p->display))) continue;
+                        if (!on_path(p->tool)) continue;
+                }
+                clip.provider = p;
+                return;
+        }
+}
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Encodes len bytes (a multiple of 3 unless it is the end) into out; returns the length. */
+static size_t base64_encode(const unsigned char* in, size_t len, char* out)
+{
+        size_t k = 0;
+        for (size_t i = 0; i < len; i += 3) {
+                unsigned v = in[i] << 16;
+                if (i + 1 < len) v |= in[i + 1] << 8;
+                if (i + 2 < len) v |= in[i + 2];
+                out[k++] = base64_chars[(v >> 18) & 63];
+                out[k++] = base64_chars[(v >> 12) & 63];
+                out[k++] = i + 1 < len ? base64_chars[(v >> 6) & 63] : '=';
+                out[k++] = i + 2 < len ? base64_chars[v & 63] : '=';
+        }
+        return k;
+}
+
+/* Decodes in place and stops at the first byte that is not base64; returns the length. */
+static size_t base64_decode(char* s, size_t len)
+{
+        unsigned v = 0;
+        int bits = 0;
+        size_t k = 0;
+        for (size_t i = 0; i < len; i++) {
+                const char* c = s[i] ? strchr(base64_chars, s[i]) : NULL;
+                if (!c) break;
+                v = (v << 6) | (unsigned)(c - base64_chars);
+                bits += 6;
+                if (bits >= 8) {
+                        bits -= 8;
+                        s[k++] = (char)((v >> bits) & 0xff);
+                }
+        }
+        return k;
+}
+
+/*
+ * Sets the terminal clipboard. The text is encoded and written a chunk at a
+ * time; inside GNU screen every chunk goes out in its own DCS string, which
+ * screen joins and passes on.
+ */
+static void osc52_copy(const char* text, size_t len)
+{
+        const char* term = getenv("TERM");
+        int screen = !getenv("TMUX") && term && strncmp(term, "screen", 6) == 0;
+        size_t chunk = screen ? OSC52_SCREEN_CHUNK : OSC52_CHUNK;
+        char out[OSC52_CHUNK];
+
+        fputs(screen ? "\033P\033]52;c;" : "\033]52;c;", stdout);
+        for (size_t i = 0; i < len; i += chunk / 4 * 3) {
+                size_t n = len - i < chunk / 4 * 3 ? len - i : chunk / 4 * 3;
+                size_t k = base64_encode((const unsigned char*)text + i, n, out);
+                if (screen && i > 0) fputs("\033\\\033P", stdout);
+                fwrite(out, 1, k, stdout);
+        }
+        fputs(screen ? "\a\033\\" : "\a", stdout);
+        fflush(stdout);
+}
+
+/*
+ * Asks the terminal for its clipboard and reads the answer straight from
+ * stdin, like a bracketed paste. Keys typed meanwhile go back to curses.
+ */
+static char* osc52_paste(void)
+{
+        if (clip.osc52_reads < 0) return NULL;
+        fputs("\033]52;c;?\a", stdout);
+        fflush(stdout);
+
+        size_t cap = CLIPBOARD_READ_CHUNK, len = 0;
+        char* buf = malloc(cap + 1);
+        if (!buf) return NULL;
+        char* start = NULL;
+        char* end = NULL;
+        int wait_ms = clip.osc52_reads > 0 ? OSC52_REPLY_IDLE_MS : OSC52_FIRST_REPLY_MS;
+        while (!end) {
+                struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+                int ready = poll(&pfd, 1, start ? OSC52_REPLY_IDLE_MS : wait_ms);
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready <= 0) break;
+                if (cap - len < CLIPBOARD_READ_CHUNK / 2) {
+                        size_t offset = start ? (size_t)(start - buf) : 0;
+                        char* grown = realloc(buf, cap * 2 + 1);
+                        if (!grown) break;
+                        buf = grown;
+                        cap *= 2;
+                        if (start) start = buf + offset;
+                }
+                ssize_t n = read(STDIN_FILENO, buf + len, cap - len);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                size_t scanned = len;
+                len += n;
+                buf[len] = '\0';
+                if (!start) {
+                        start = strstr(buf, "\033]52;");
+                        if (!start) continue;
+                        scanned = start - buf;
+                }
+                // The answer ends with BEL or with ST (ESC \\)
+                for (char* p = buf + scanned; p < buf + len && !end; p++) {
+                        if (*p == '\a' || (*p == '\033' && p + 1 < buf + len && p[1] == '\\')) end = p;
+                }
+        }
+
+        if (!start || !end) {
+                for (size_t i = len; i-- > 0; ) ungetch((unsigned char)buf[i]);
+                free(buf);
+                if (clip.osc52_reads == 0) clip.osc52_reads = -1;
+                return NULL;
+        }
+        clip.osc52_reads = 1;
+        for (char* p = buf + len - 1; p >= end + (*end == '\a' ? 1 : 2); p--) ungetch((unsigned char)*p);
+        for (char* p = start - 1; p >= buf; p--) ungetch((unsigned char)*p);
+
+        // ESC ] 52 ; <selection> ; <base64>
+        char* data = strchr(start + 5, ';');
+        size_t n = data && data < end ? base64_decode(data + 1, end - data - 1) : 0;
+        if (n == 0) {
+                free(buf);
+                return NULL;
+        }
+        memmove(buf, data + 1, n);
+        buf[n] = '\0';
+        return buf;
+}
+
+/* Reaps copy commands that have exited; returns 1 while ours still owns the clipboard. */
+static int clipboard_owned(void)
+{
+        for (int i = 0; i < 2; i++) {
+                if (clip.owners[i] > 0 && waitpid(clip.owners[i], NULL, WNOHANG) != 0) clip.owners[i] = 0;
+        }
+        // Pastes read the clipboard; owners[1] only holds the primary selection
+        return clip.owners[0] > 0;
+}
+
+/* Starts argv with text on its stdin and returns its pid, or -1. */
+static pid_t clipboard_spawn(const char* const* argv, const char* text, size_t len)
+{
+        int fds[2];
+        if (pipe(fds) != 0) return -1;
+        pid_t pid = fork();
+        if (pid < 0) {
+                close(fds[0]);
+                close(fds[1]);
+                return -1;
+        }
+        if (pid == 0) {
+                // Its own session, so it keeps the selection after the editor exits
+                setsid();
+                dup2(fds[0], STDIN_FILENO);
+                int null = open("/dev/null", O_WRONLY);
+                if (null >= 0) {
+                        dup2(null, STDOUT_FILENO);
+                        dup2(null, STDERR_FILENO);
+                }
+                close(fds[0]);
+                close(fds[1]);
+                execvp(argv[0], (char* const*)argv);
+                _exit(127);
+        }
+        close(fds[0]);
+        for (size_t off = 0; off < len; ) {
+                ssize_t n = write(fds[1], text + off, len - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                off += n;
+        }
+        close(fds[1]);
+        return pid;
+}
+
+static void clipboard_release(void)
+{
+        for (int i = 0; i < 2; i++) {
+                if (clip.owners[i] <= 0) continue;
+                kill(clip.owners[i], SIGTERM);
+                waitpid(clip.owners[i], NULL, 0);
+                clip.owners[i] = 0;
+        }
+}
+
+void copy_to_system_clipboard(const char* text)
+{
+        if (!text || !*text) return;
+        clipboard_init();
+
+        size_t len = strlen(text);
+        char* copy = malloc(len + 1);
+        if (!copy) return;
+        memcpy(copy, text, len + 1);
+        free(clip.text);
+        clip.text = copy;
+
+        const ClipboardProvider* p = clip.provider;
+        if (!p) return;
+        if (p->osc52) {
+                osc52_copy(text, len);
+                return;
+        }
+        // The new copy takes the selection anyway; the old owners are stopped so they can be reaped
+        clipboard_release();
+        for (int i = 0; i < 2 && p->copy[i][0]; i++) {
+                pid_t pid = clipboard_spawn(p->copy[i], text, len);
+                if (pid < 0) continue;
+                if (p->owns) {
+                        clip.owners[i] = pid;
+                } else {
+                        waitpid(pid, NULL, 0);
+                }
+        }
+}
+
+/* Runs a paste command and returns all of its output, or NULL if there was none. */
+static char* clipboard_read(const char* command)
+{
+        FILE* fp = popen(command, "r");
+        if (!fp) return NULL;
+        size_t cap = CLIPBOARD_READ_CHUNK, len = 0;
+        char* buf = malloc(cap + 1);
+        while (buf) {
+                if (cap - len < CLIPBOARD_READ_CHUNK / 2) {
+                        char* grown = realloc(buf, cap * 2 + 1);
+                        if (!grown) {
+                                free(buf);
+                                buf = NULL;
+                                break;
+                        }
+                        buf = grown;
+                        cap *= 2;
+                }
+                size_t n = fread(buf + len, 1, cap - len, fp);
+                if (n == 0) break;
+                len += n;
+        }
+        pclose(fp);
+        if (!buf || len == 0) {
+                free(buf);
+                return NULL;
+        }
+        buf[len] = '\0';
+        return buf;
+}
+
+char* get_system_clipboard(void)
+{
+        clipboard_init();
+        char* text = NULL;
+        if (clip.provider && clip.provider->osc52) text = osc52_paste();
+        if (text) return text;
+        if (clipboard_owned() || !clip.provider || clip.provider->osc52) {
+                return clip.text ? strdup(clip.text) : NULL;
+        }
+        for (int i = 0; i < 2 && clip.provider->paste[i]; i++) {
+                text = clipboard_read(clip.provider->paste[i]);
+                if (text) return text;
+        }
+        return NULL;
+}
+
+/* Leaves the copy commands running so the clipboard outlives the editor. */
+void clipboard_free(void)
+{
+        free(clip.text);
+        clip.text = NULL;
+}
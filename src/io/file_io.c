@@ -50,15 +50,6 @@ void load_file(EditorState* state, const char* filename)
                 file_created = 1;
         }
 
-        for (int i = 0; i < state->line_count; i++) {
-                if (state->lines[i]) {
-                        free(state->lines[i]);
-                        state->lines[i] = NULL;
-                }
-        }
-
-        state->line_count = 0;
-
         
         fseek(file, 0, SEEK_END);
         long file_size = ftell(file);
@@ -66,81 +57,33 @@ void load_file(EditorState* state, const char* filename)
 
         if (file_size < 0) {
                 fclose(file);
-                state->lines[0] = (char*)malloc(MAX_LINE_LENGTH);
-                if (state->lines[0]) {
-                        state->lines[0][0] = '\0';
-                        state->line_count = 1;
-                }
+                doc_free(state);
+                doc_init(state);
                 strncpy(state->filename, filename, sizeof(state->filename) - 1);
                 state->filename[sizeof(state->filename) - 1] = '\0';
                 show_status(state, "Created file");
                 return;
         }
 
-        if (file_size > 0) {
-                char * content = (char * ) malloc(file_size + 1);
-                if (!content) {
-                        show_status(state, "Memory allocation failed for file content");
-                        fclose(file);
-                        return;
-                }
-
-                size_t read_size = fread(content, 1, file_size, file);
-                content[read_size] = '\0';
-
-                state->has_trailing_newline = (read_size > 0 && content[read_size - 1] == '\n');
-
-                if (read_size > 0 && content[read_size - 1] == '\n') {
-                        content[read_size - 1] = '\0';
-                        read_size--;
-                }
-
-                char* line_start = content;
-                char* ptr = content;
-                while (*ptr && state->line_count < MAX_LINES) {
-                        if (*ptr == '\n') {
-                                *ptr = '\0';
-                                state->lines[state->line_count] = (char*)malloc(MAX_LINE_LENGTH);
-                                if (!state->lines[state->line_count]) {
-                                        show_status(state, "Memory allocation failed");
-                                        free(content);
-                                        fclose(file);
-                                        return;
-                                }
-                                strncpy(state->lines[state->line_count], line_start, MAX_LINE_LENGTH - 1);
-                                state->lines[state->line_count][MAX_LINE_LENGTH - 1] = '\0';
-                                state->line_count++;
-                                line_start = ptr + 1;
-                        }
-                        ptr++;
-                }
-
-                if (line_start < ptr && state->line_count < MAX_LINES) {
-                        state->lines[state->line_count] = (char*)malloc(MAX_LINE_LENGTH);
-                        if (!state->lines[state->line_count]) {
-                                show_status(state, "Memory allocation failed");
-                                free(content);
-                                fclose(file);
-                                return;
-                        }
-                        strncpy(state->lines[state->line_count], line_start, MAX_LINE_LENGTH - 1);
-                        state->lines[state->line_count][MAX_LINE_LENGTH - 1] = '\0';
-                        state->line_count++;
-                }
-
-                free(content);
+        char * content = (char * ) malloc(file_size + 1);
+        if (!content) {
+                show_status(state, "Memory allocation failed for file content");
+                fclose(file);
+                return;
         }
 
+        size_t read_size = fread(content, 1, file_size, file);
         fclose(file);
 
-        if (state->line_count == 0) {
-                state->lines[0] = (char*)malloc(MAX_LINE_LENGTH);
-                if (!state->lines[0]) {
-                        show_status(state, "Memory allocation failed");
-                        return;
-                }
-                state->lines[0][0] = '\0';
-                state->line_count = 1;
+        state->has_trailing_newline = (read_size > 0 && content[read_size - 1] == '\n');
+        if (state->has_trailing_newline) {
+                read_size--;
+        }
+
+        if (doc_load_buffer(state, content, read_size) != 0) {
+                doc_init(state);
+                show_status(state, "Memory allocation failed");
+                return;
         }
 
         strncpy(state->filename, filename, sizeof(state->filename) - 1);
@@ -194,23 +137,12 @@ void save_file(EditorState* state)
                 return;
         }
 
-        for (int i = 0; i < state -> line_count; i++) {
-                if (fprintf(file, "%s", state -> lines[i]) < 0) {
-                        char error_msg[256];
-                        snprintf(error_msg, sizeof(error_msg), "Error: Failed to write to file (%s)", strerror(errno));
-                        show_status(state, error_msg);
-                        fclose(file);
-                        return;
-                }
-                if (i < state->line_count - 1 || state->has_trailing_newline) {
-                        if (fprintf(file, "\n") < 0) {
-                                char error_msg[256];
-                                snprintf(error_msg, sizeof(error_msg), "Error: Failed to write to file (%s)", strerror(errno));
-                                show_status(state, error_msg);
-                                fclose(file);
-                                return;
-                        }
-                }
+        if (doc_write(state, file) != 0) {
+                char error_msg[256];
+                snprintf(error_msg, sizeof(error_msg), "Error: Failed to write to file (%s)", strerror(errno));
+                show_status(state, error_msg);
+                fclose(file);
+                return;
         }
 
         if (fclose(file) != 0) {
@@ -535,6 +467,9 @@ void load_config(EditorState* state)
                                 state->auto_tabbing_enabled = atoi(val) ? 1 : 0;
                         } else if (strcmp(key, "sticky_cursor_enabled")==0) {
                                 state->sticky_cursor_enabled = atoi(val) ? 1 : 0;
+                        } else if (strcmp(key, "undo_budget_kb")==0) {
+                                long kb = atol(val);
+                                if (kb > 0) undo_set_budget(state, (size_t)kb * 1024);
                         }
                 }
         }
@@ -560,6 +495,7 @@ void save_config(EditorState* state)
         fprintf(fp, "auto_complete_enabled=%d\n", state->auto_complete_enabled);
         fprintf(fp, "auto_tabbing_enabled=%d\n", state->auto_tabbing_enabled);
         fprintf(fp, "sticky_cursor_enabled=%d\n", state->sticky_cursor_enabled);
+        fprintf(fp, "undo_budget_kb=%lu\n", (unsigned long)(state->undo.budget / 1024));
         fclose(fp);
 }
 
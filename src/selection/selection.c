@@ -34,45 +34,10 @@ void copy_selected_text(EditorState* state)
                 return;
         }
 
-        int start_y = state -> select_start_y;
-        int end_y = state -> select_end_y;
-        int start_x = state -> select_start_x;
-        int end_x = state -> select_end_x;
-
-        char temp_file[] = "/tmp/kilo_editor_clipboard_temp.txt";
-        FILE * fp = fopen(temp_file, "w");
-        if (!fp) {
-                show_status(state, "Failed to create temporary file for clipboard");
-                return;
-        }
-
-        for (int i = start_y; i <= end_y; i++) {
-                int line_len = strlen(state -> lines[i]);
-                int line_start = (i == start_y) ? start_x : 0;
-                int line_end = (i == end_y) ? end_x : line_len;
-                int copy_len = line_end - line_start;
-
-                if (copy_len > 0) {
-                        fprintf(fp, "%.*s", copy_len, state -> lines[i] + line_start);
-                }
-
-                if (i < end_y) {
-                        fprintf(fp, "\n");
-                }
-        }
-        fclose(fp);
-
-        int is_wayland = getenv("WAYLAND_DISPLAY") != NULL;
-        if (is_wayland) {
-                system("cat '/tmp/kilo_editor_clipboard_temp.txt' | wl-copy 2>/dev/null &");
-        } else {
-                system("cat '/tmp/kilo_editor_clipboard_temp.txt' | xclip -selection clipboard 2>/dev/null &");
-                system("cat '/tmp/kilo_editor_clipboard_temp.txt' | xclip -selection primary 2>/dev/null &");
-        }
-
-        system("rm -f '/tmp/kilo_editor_clipboard_temp.txt' 2>/dev/null &");
-
-        
+        char* selected = get_selected_text(state);
+        if (!selected) return;
+        copy_to_system_clipboard(selected);
+        free(selected);
 }
 
 void clear_selection(EditorState* state)
@@ -195,42 +160,28 @@ void delete_selected_text(EditorState* state)
         int start_x = state -> select_start_x;
         int end_x = state -> select_end_x;
 
+        undo_begin(state);
         if (start_y == end_y)
         {
-                char * line = state -> lines[start_y];
-                memmove( & line[start_x], & line[end_x], strlen(line) - end_x + 1);
+                doc_delete_text(state, start_y, start_x, end_x - start_x);
                 state -> cursor_x = start_x;
                 state -> cursor_y = start_y;
         }
         else
         {
-                char * first_line = state -> lines[start_y];
-                first_line[start_x] = '\0';
-
-                char * last_line = state -> lines[end_y];
-                char * remaining_text = (char * ) malloc(MAX_LINE_LENGTH);
-                if (!remaining_text) return;
-                strcpy(remaining_text, & last_line[end_x]);
-
-                int lines_to_remove = end_y - start_y;
-                for (int i = start_y + 1; i <= end_y; i++) {
-                        free(state -> lines[i]);
+                doc_delete_text(state, end_y, 0, end_x);
+                doc_delete_text(state, start_y, start_x, doc_line_length(state, start_y) - start_x);
+                if (end_y - start_y > 1) {
+                        doc_remove_lines(state, start_y + 1, end_y - start_y - 1);
                 }
-
-                for (int i = start_y + 1; i < state -> line_count - lines_to_remove; i++) {
-                        state -> lines[i] = state -> lines[i + lines_to_remove];
-                }
-
-                state -> line_count -= lines_to_remove;
-
-                if (strlen(first_line) + strlen(remaining_text) < MAX_LINE_LENGTH) {
-                        strcat(first_line, remaining_text);
+                if (doc_join_lines(state, start_y) != 0) {
+                        show_status(state, "Memory allocation failed");
                 }
 
                 state -> cursor_x = start_x;
                 state -> cursor_y = start_y;
-                free(remaining_text);
         }
+        undo_end(state);
 
         state -> dirty = 1;
 
@@ -0,0 +1,430 @@
+#include "../core/editor.h"
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Bracket matching works per bracket type on the running depth (opens minus
+ * closes) through the file, ignoring strings and comments as before. Each
+ * line's brackets are summarized in one node of a treap keyed by line
+ * position, and every node also combines the summaries of its subtree, so
+ * finding a partner takes O(log n) plus a scan of the two lines involved.
+ *
+ * The tree is built on the first query. After that, editing, inserting or
+ * removing a line only marks the nodes on its path to the root stale, and
+ * the next query recomputes just those.
+ */
+
+#define BRACKET_NONE (1 << 30)
+// Inserting more lines than this at once, and more than an eighth of the
+// tree, drops the tree for a rebuild instead of inserting line by line
+#define BRACKET_BULK_LINES 1024
+
+// Node 0 stands for the empty tree: size 0 and an empty summary
+#define NODE(index, i) (&(index)->nodes[i])
+
+static int bracket_type(char ch, int* opening)
+{
+    switch (ch) {
+    case '(': *opening = 1; return 0;
+    case ')': *opening = 0; return 0;
+    case '[': *opening = 1; return 1;
+    case ']': *opening = 0; return 1;
+    case '{': *opening = 1; return 2;
+    case '}': *opening = 0; return 2;
+    default: return -1;
+    }
+}
+
+static void bracket_empty(BracketSummary* s)
+{
+    for (int t = 0; t < 3; t++) {
+        s->sum[t] = 0;
+        s->min_open[t] = BRACKET_NONE;
+        s->min_close[t] = BRACKET_NONE;
+    }
+}
+
+/* min_open is the lowest depth before an opening bracket, min_close the lowest after a closing one. */
+static void bracket_summarize(const char* line, int len, BracketSummary* s)
+{
+    bracket_empty(s);
+    for (int i = 0; i < len; i++) {
+        int opening;
+        int t = bracket_type(line[i], &opening);
+        if (t < 0) continue;
+        if (opening) {
+            if (s->sum[t] < s->min_open[t]) s->min_open[t] = s->sum[t];
+            s->sum[t]++;
+        } else {
+            s->sum[t]--;
+            if (s->sum[t] < s->min_close[t]) s->min_close[t] = s->sum[t];
+        }
+    }
+}
+
+static void bracket_combine(BracketSummary* out, const BracketSummary* a, const BracketSummary* b)
+{
+    for (int t = 0; t < 3; t++) {
+        int open = b->min_open[t] == BRACKET_NONE ? BRACKET_NONE : a->sum[t] + b->min_open[t];
+        int close = b->min_close[t] == BRACKET_NONE ? BRACKET_NONE : a->sum[t] + b->min_close[t];
+        out->min_open[t] = a->min_open[t] < open ? a->min_open[t] : open;
+        out->min_close[t] = a->min_close[t] < close ? a->min_close[t] : close;
+        out->sum[t] = a->sum[t] + b->sum[t];
+    }
+}
+
+static unsigned int bracket_random(BracketIndex* index)
+{
+    unsigned int x = index->seed ? index->seed : 0x9e3779b9u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    index->seed = x;
+    return x;
+}
+
+static int bracket_node_new(BracketIndex* index)
+{
+    int node = index->free_list;
+    if (node) {
+        index->free_list = NODE(index, node)->left;
+    } else {
+        if (index->used == index->cap) {
+            int cap = index->cap * 2;
+            BracketNode* nodes = (BracketNode*)realloc(index->nodes, (size_t)cap * sizeof(BracketNode));
+            if (!nodes) return 0;
+            index->nodes = nodes;
+            index->cap = cap;
+        }
+        node = index->used++;
+    }
+    BracketNode* n = NODE(index, node);
+    n->left = n->right = 0;
+    n->size = 1;
+    n->prio = bracket_random(index);
+    n->line_valid = 0;
+    n->valid = 0;
+    return node;
+}
+
+static void bracket_pull(BracketIndex* index, int node)
+{
+    BracketNode* n = NODE(index, node);
+    n->size = NODE(index, n->left)->size + 1 + NODE(index, n->right)->size;
+    n->valid = 0;
+}
+
+static int bracket_rotate_right(BracketIndex* index, int node)
+{
+    int top = NODE(index, node)->left;
+    NODE(index, node)->left = NODE(index, top)->right;
+    NODE(index, top)->right = node;
+    bracket_pull(index, node);
+    bracket_pull(index, top);
+    return top;
+}
+
+static int bracket_rotate_left(BracketIndex* index, int node)
+{
+    int top = NODE(index, node)->right;
+    NODE(index, node)->right = NODE(index, top)->left;
+    NODE(index, top)->left = node;
+    bracket_pull(index, node);
+    bracket_pull(index, top);
+    return top;
+}
+
+/* Inserts the lone node leaf before position pos of the subtree. */
+static int bracket_insert_at(BracketIndex* index, int node, int pos, int leaf)
+{
+    if (!node) return leaf;
+    BracketNode* n = NODE(index, node);
+    int left_size = NODE(index, n->left)->size;
+    if (pos <= left_size) {
+        n->left = bracket_insert_at(index, n->left, pos, leaf);
+        bracket_pull(index, node);
+        if (NODE(index, n->left)->prio > n->prio) return bracket_rotate_right(index, node);
+    } else {
+        n->right = bracket_insert_at(index, n->right, pos - left_size - 1, leaf);
+        bracket_pull(index, node);
+        if (NODE(index, n->right)->prio > n->prio) return bracket_rotate_left(index, node);
+    }
+    return node;
+}
+
+static int bracket_merge(BracketIndex* index, int a, int b)
+{
+    if (!a) return b;
+    if (!b) return a;
+    if (NODE(index, a)->prio > NODE(index, b)->prio) {
+        NODE(index, a)->right = bracket_merge(index, NODE(index, a)->right, b);
+        bracket_pull(index, a);
+        return a;
+    }
+    NODE(index, b)->left = bracket_merge(index, a, NODE(index, b)->left);
+    bracket_pull(index, b);
+    return b;
+}
+
+static int bracket_remove_at(BracketIndex* index, int node, int pos)
+{
+    BracketNode* n = NODE(index, node);
+    int left_size = NODE(index, n->left)->size;
+    if (pos < left_size) {
+        n->left = bracket_remove_at(index, n->left, pos);
+    } else if (pos > left_size) {
+        n->right = bracket_remove_at(index, n->right, pos - left_size - 1);
+    } else {
+        int merged = bracket_merge(index, n->left, n->right);
+        n->left = index->free_list;
+        index->free_list = node;
+        return merged;
+    }
+    bracket_pull(index, node);
+    return node;
+}
+
+static int bracket_sizes(BracketIndex* index, int node)
+{
+    if (!node) return 0;
+    BracketNode* n = NODE(index, node);
+    n->size = bracket_sizes(index, n->left) + 1;
+    n->size += bracket_sizes(index, n->right);
+    return n->size;
+}
+
+/* Builds the tree over n lines in O(n), shaped as if they were inserted one by one. */
+static int bracket_index_build(BracketIndex* index, int n)
+{
+    bracket_index_free(index);
+    index->nodes = (BracketNode*)malloc((size_t)(n + 1) * sizeof(BracketNode));
+    int* stack = (int*)malloc((size_t)n * sizeof(int));
+    if (!index->nodes || !stack) {
+        free(stack);
+        bracket_index_free(index);
+        return -1;
+    }
+    index->cap = n + 1;
+    index->used = 1;
+    BracketNode* empty = NODE(index, 0);
+    memset(empty, 0, sizeof(*empty));
+    bracket_empty(&empty->line);
+    bracket_empty(&empty->all);
+
+    // Lines arrive in order, so each new node is the rightmost; the stack holds the right spine
+    int depth = 0;
+    for (int i = 0; i < n; i++) {
+        int node = bracket_node_new(index);
+        int last = 0;
+        while (depth > 0 && NODE(index, stack[depth - 1])->prio < NODE(index, node)->prio) {
+            last = stack[--depth];
+        }
+        NODE(index, node)->left = last;
+        if (depth > 0) NODE(index, stack[depth - 1])->right = node;
+        stack[depth++] = node;
+    }
+    index->root = stack[0];
+    free(stack);
+    bracket_sizes(index, index->root);
+    return 0;
+}
+
+/* Recomputes the stale summaries of the subtree whose first line is lo. */
+static void bracket_refresh(EditorState* state, int node, int lo)
+{
+    BracketIndex* index = &state->doc.brackets;
+    BracketNode* n = NODE(index, node);
+    if (!node || n->valid) return;
+    int y = lo + NODE(index, n->left)->size;
+    bracket_refresh(state, n->left, lo);
+    bracket_refresh(state, n->right, y + 1);
+    if (!n->line_valid) {
+        bracket_summarize(state->lines[y], state->doc.info[y].len, &n->line);
+        n->line_valid = 1;
+    }
+    BracketSummary left_and_line;
+    bracket_combine(&left_and_line, &NODE(index, n->left)->all, &n->line);
+    bracket_combine(&n->all, &left_and_line, &NODE(index, n->right)->all);
+    n->valid = 1;
+}
+
+void bracket_index_free(BracketIndex* index)
+{
+    if (!index) return;
+    free(index->nodes);
+    memset(index, 0, sizeof(*index));
+}
+
+/* Records that the text of line y changed. */
+void bracket_index_touch(BracketIndex* index, int y)
+{
+    int node = index->root;
+    while (node) {
+        BracketNode* n = NODE(index, node);
+        n->valid = 0;
+        int left_size = NODE(index, n->left)->size;
+        if (y < left_size) {
+            node = n->left;
+        } else if (y == left_size) {
+            n->line_valid = 0;
+            return;
+        } else {
+            y -= left_size + 1;
+            node = n->right;
+        }
+    }
+}
+
+/* Records count new lines before line at. */
+void bracket_index_insert(BracketIndex* index, int at, int count)
+{
+    if (!index->root) return;
+    if (count > BRACKET_BULK_LINES && count > NODE(index, index->root)->size / 8) {
+        bracket_index_free(index);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        int leaf = bracket_node_new(index);
+        if (!leaf) {
+            bracket_index_free(index);
+            return;
+        }
+        index->root = bracket_insert_at(index, index->root, at + i, leaf);
+    }
+}
+
+/* Records that lines at to at + count - 1 were removed. */
+void bracket_index_remove(BracketIndex* index, int at, int count)
+{
+    for (int i = 0; i < count && index->root && at < NODE(index, index->root)->size; i++) {
+        index->root = bracket_remove_at(index, index->root, at);
+    }
+}
+
+/* First line >= from where *acc plus its min_close reaches target; *acc sums the lines passed over. */
+static int bracket_find_first(BracketIndex* index, int node, int lo, int from, int t, int* acc, int target)
+{
+    if (!node) return -1;
+    const BracketNode* n = NODE(index, node);
+    if (lo + n->size - 1 < from) return -1;
+    if (lo >= from && (n->all.min_close[t] == BRACKET_NONE || *acc + n->all.min_close[t] > target)) {
+        *acc += n->all.sum[t];
+        return -1;
+    }
+    int found = bracket_find_first(index, n->left, lo, from, t, acc, target);
+    if (found >= 0) return found;
+    int y = lo + NODE(index, n->left)->size;
+    if (y >= from) {
+        if (n->line.min_close[t] != BRACKET_NONE && *acc + n->line.min_close[t] <= target) return y;
+        *acc += n->line.sum[t];
+    }
+    return bracket_find_first(index, n->right, y + 1, from, t, acc, target);
+}
+
+/* Last line <= to with an opening bracket whose depth, measured back from line to, reaches target. */
+static int bracket_find_last(BracketIndex* index, int node, int lo, int to, int t, int* acc, int target)
+{
+    if (!node || lo > to) return -1;
+    const BracketNode* n = NODE(index, node);
+    if (lo + n->size - 1 <= to &&
+        (n->all.min_open[t] == BRACKET_NONE || n->all.min_open[t] - n->all.sum[t] - *acc > target)) {
+        *acc += n->all.sum[t];
+        return -1;
+    }
+    int y = lo + NODE(index, n->left)->size;
+    int found = bracket_find_last(index, n->right, y + 1, to, t, acc, target);
+    if (found >= 0) return found;
+    if (y <= to) {
+        if (n->line.min_open[t] != BRACKET_NONE && n->line.min_open[t] - n->line.sum[t] - *acc <= target) return y;
+        *acc += n->line.sum[t];
+    }
+    return bracket_find_last(index, n->left, lo, to, t, acc, target);
+}
+
+/*
+ * Finds the partner of the bracket at column x of line y. Returns 1 and
+ * stores its position when it has one, 0 when it is unmatched and -1 when
+ * there is no bracket there.
+ */
+int bracket_match(EditorState* state, int y, int x, int* match_y, int* match_x)
+{
+    if (!state || y < 0 || y >= state->line_count) return -1;
+    const char* line = state->lines[y];
+    int len = state->doc.info[y].len;
+    if (x < 0 || x >= len) return -1;
+
+    int opening;
+    int t = bracket_type(line[x], &opening);
+    if (t < 0) return -1;
+
+    int found_y = -1, found_x = -1;
+    int depth = 1;
+    if (opening) {
+        for (int j = x + 1; j < len && found_x < 0; j++) {
+            int o;
+            if (bracket_type(line[j], &o) != t) continue;
+            depth += o ? 1 : -1;
+            if (depth == 0) {
+                found_y = y;
+                found_x = j;
+            }
+        }
+    } else {
+        for (int j = x - 1; j >= 0 && found_x < 0; j--) {
+            int o;
+            if (bracket_type(line[j], &o) != t) continue;
+            depth += o ? -1 : 1;
+            if (depth == 0) {
+                found_y = y;
+                found_x = j;
+            }
+        }
+    }
+
+    BracketIndex* index = &state->doc.brackets;
+    if (found_x < 0 && !index->root && bracket_index_build(index, state->line_count) != 0) return 0;
+
+    if (found_x < 0) {
+        bracket_refresh(state, index->root, 0);
+        int acc = 0;
+        if (opening) {
+            int k = bracket_find_first(index, index->root, 0, y + 1, t, &acc, -depth);
+            if (k >= 0) {
+                const char* text = state->lines[k];
+                for (int j = 0; j < state->doc.info[k].len; j++) {
+                    int o;
+                    if (bracket_type(text[j], &o) != t) continue;
+                    acc += o ? 1 : -1;
+                    if (acc <= -depth) {
+                        found_y = k;
+                        found_x = j;
+                        break;
+                    }
+                }
+            }
+        } else if (y > 0) {
+            int k = bracket_find_last(index, index->root, 0, y - 1, t, &acc, -depth);
+            if (k >= 0) {
+                const char* text = state->lines[k];
+                BracketSummary s;
+                bracket_summarize(text, state->doc.info[k].len, &s);
+                int limit = s.sum[t] + acc - depth;
+                int level = 0;
+                for (int j = 0; j < state->doc.info[k].len; j++) {
+                    int o;
+                    if (bracket_type(text[j], &o) != t) continue;
+                    if (o && level <= limit) {
+                        found_y = k;
+                        found_x = j;
+                    }
+                    level += o ? 1 : -1;
+                }
+            }
+        }
+    }
+
+    if (found_x < 0) return 0;
+    if (match_y) *match_y = found_y;
+    if (match_x) *match_x = found_x;
+    return 1;
+}
@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../core/editor.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Tokenizing runs on a worker thread. The renderer queues copies of the lines
+ * it is about to draw, the worker turns them into spans, and
+ * update_syntax_highlighting moves finished spans into the document. A result
+ * is kept only if its line still has the version and buffer it was queued
+ * with; anything else is dropped and asked for again on the next frame.
+ */
+struct Highlighter {
+    pthread_t thread;
+    int threaded;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    int quit;
+    int busy;
+    HighlightJob current;
+    HighlightJob* queue;
+    int queued, queue_cap;
+    HighlightJob* done;
+    int done_count, done_cap;
+    unsigned long serial;
+    int file_type;
+};
+
+static int job_push(HighlightJob** list, int* count, int* cap, const HighlightJob* job)
+{
+    if (*count == *cap) {
+        int grown = *cap ? *cap * 2 : 64;
+        HighlightJob* jobs = realloc(*list, (size_t)grown * sizeof(HighlightJob));
+        if (!jobs) return -1;
+        *list = jobs;
+        *cap = grown;
+    }
+    (*list)[(*count)++] = *job;
+    return 0;
+}
+
+static int job_same(const HighlightJob* a, const HighlightJob* b)
+{
+    return a->line == b->line && a->version == b->version && a->key == b->key &&
+           a->serial == b->serial && a->lex == b->lex && a->file_type == b->file_type;
+}
+
+static void* highlight_main(void* arg)
+{
+    Highlighter* hl = arg;
+    pthread_mutex_lock(&hl->lock);
+    for (;;) {
+        while (!hl->quit && hl->queued == 0) pthread_cond_wait(&hl->wake, &hl->lock);
+        if (hl->quit) break;
+
+        HighlightJob job = hl->queue[0];
+        memmove(hl->queue, hl->queue + 1, (size_t)(--hl->queued) * sizeof(HighlightJob));
+        hl->current = job;
+        hl->busy = 1;
+        pthread_mutex_unlock(&hl->lock);
+
+        job.span_count = syntax_tokenize(&job, &job.spans);
+        free(job.text);
+        job.text = NULL;
+
+        pthread_mutex_lock(&hl->lock);
+        hl->busy = 0;
+        if (job.span_count < 0 || job_push(&hl->done, &hl->done_count, &hl->done_cap, &job) < 0) {
+            free(job.spans);
+        }
+        if (hl->queued == 0) pthread_cond_broadcast(&hl->idle);
+    }
+    pthread_mutex_unlock(&hl->lock);
+    return NULL;
+}
+
+static Highlighter* highlight_get(EditorState* state)
+{
+    if (state->highlighter) return state->highlighter;
+    Highlighter* hl = calloc(1, sizeof(Highlighter));
+    if (!hl) return NULL;
+    pthread_mutex_init(&hl->lock, NULL);
+    pthread_cond_init(&hl->wake, NULL);
+    pthread_cond_init(&hl->idle, NULL);
+    hl->file_type = state->file_type;
+    // Without a thread, requests are tokenized on the spot
+    hl->threaded = pthread_create(&hl->thread, NULL, highlight_main, hl) == 0;
+    state->highlighter = hl;
+    return hl;
+}
+
+static void drop_queue(Highlighter* hl)
+{
+    for (int i = 0; i < hl->queued; i++) free(hl->queue[i].text);
+    hl->queued = 0;
+}
+
+static void install(EditorState* state, HighlightJob* job)
+{
+    int y = job->line;
+    if (job->serial != state->highlighter->serial || job->file_type != state->file_type ||
+        y >= state->line_count || state->lines[y] != job->key ||
+        state->doc.info[y].version != job->version) {
+        free(job->spans);
+        return;
+    }
+    DocLineInfo* info = &state->doc.info[y];
+    free(info->spans);
+    info->spans = job->spans;
+    info->span_count = job->span_count;
+    info->span_lex = job->lex;
+}
+
+/* Moves spans the worker has finished into the document. */
+void update_syntax_highlighting(EditorState* state)
+{
+    Highlighter* hl = state->highlighter;
+    if (!hl) return;
+    pthread_mutex_lock(&hl->lock);
+    HighlightJob* done = hl->done;
+    int count = hl->done_count;
+    hl->done = NULL;
+    hl->done_count = hl->done_cap = 0;
+    pthread_mutex_unlock(&hl->lock);
+
+    for (int i = 0; i < count; i++) install(state, &done[i]);
+    free(done);
+}
+
+/* Returns the span count for line_num and sets *spans, or -1 if none are ready. */
+int highlight_spans(EditorState* state, int line_num, const HighlightSpan** spans)
+{
+    DocLineInfo* info = &state->doc.info[line_num];
+    if (info->span_count < 0) return -1;
+    if (info->span_lex != syntax_line_state(state, line_num)) {
+        free(info->spans);
+        info->spans = NULL;
+        info->span_count = -1;
+        return -1;
+    }
+    if (spans) *spans = info->spans;
+    return info->span_count;
+}
+
+void highlight_request(EditorState* state, int line_num)
+{
+    Highlighter* hl = highlight_get(state);
+    if (!hl) return;
+
+    HighlightJob job;
+    memset(&job, 0, sizeof(job));
+    job.line = line_num;
+    job.version = state->doc.info[line_num].version;
+    job.key = state->lines[line_num];
+    job.serial = hl->serial;
+    syntax_prepare_job(state, line_num, &job);
+
+    if (hl->threaded) {
+        pthread_mutex_lock(&hl->lock);
+        int known = hl->busy && job_same(&hl->current, &job);
+        for (int i = 0; !known && i < hl->queued; i++) known = job_same(&hl->queue[i], &job);
+        for (int i = 0; !known && i < hl->done_count; i++) known = job_same(&hl->done[i], &job);
+        pthread_mutex_unlock(&hl->lock);
+        if (known) return;
+    }
+
+    job.len = state->doc.info[line_num].len;
+    job.text = malloc((size_t)job.len + 1);
+    if (!job.text) return;
+    memcpy(job.text, state->lines[line_num], (size_t)job.len);
+    job.text[job.len] = '\0';
+
+    if (!hl->threaded) {
+        job.span_count = syntax_tokenize(&job, &job.spans);
+        free(job.text);
+        if (job.span_count >= 0) install(state, &job);
+        else free(job.spans);
+        return;
+    }
+
+    pthread_mutex_lock(&hl->lock);
+    if (job_push(&hl->queue, &hl->queued, &hl->queue_cap, &job) < 0) {
+        free(job.text);
+    } else {
+        pthread_cond_signal(&hl->wake);
+    }
+    pthread_mutex_unlock(&hl->lock);
+}
+
+/* Blocks until the queue is drained or timeout_ms passes. */
+void highlight_wait(EditorState* state, int timeout_ms)
+{
+    Highlighter* hl = state->highlighter;
+    if (!hl || !hl->threaded) return;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)timeout_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&hl->lock);
+    while (hl->queued > 0 || hl->busy) {
+        if (pthread_cond_timedwait(&hl->idle, &hl->lock, &deadline) != 0) break;
+    }
+    pthread_mutex_unlock(&hl->lock);
+}
+
+/* Whether the worker has work queued or results not yet installed. */
+int highlight_pending(EditorState* state)
+{
+    Highlighter* hl = state->highlighter;
+    if (!hl || !hl->threaded) return 0;
+    pthread_mutex_lock(&hl->lock);
+    int pending = hl->queued > 0 || hl->busy || hl->done_count > 0;
+    pthread_mutex_unlock(&hl->lock);
+    return pending;
+}
+
+/*
+ * Called at the start of a frame: forgets requests for lines that may have
+ * scrolled away, and drops every span when the file type changed.
+ */
+void highlight_sync(EditorState* state)
+{
+    Highlighter* hl = state->highlighter;
+    if (!hl) return;
+    pthread_mutex_lock(&hl->lock);
+    drop_queue(hl);
+    pthread_mutex_unlock(&hl->lock);
+
+    if (hl->file_type != state->file_type) {
+        for (int i = 0; i < state->line_count; i++) {
+            DocLineInfo* info = &state->doc.info[i];
+            free(info->spans);
+            info->spans = NULL;
+            info->span_count = -1;
+        }
+        hl->file_type = state->file_type;
+        highlight_reset(state);
+    }
+}
+
+/* Invalidates everything queued or finished, e.g. when the document is replaced. */
+void highlight_reset(EditorState* state)
+{
+    Highlighter* hl = state->highlighter;
+    if (!hl) return;
+    pthread_mutex_lock(&hl->lock);
+    hl->serial++;
+    drop_queue(hl);
+    for (int i = 0; i < hl->done_count; i++) free(hl->done[i].spans);
+    hl->done_count = 0;
+    pthread_mutex_unlock(&hl->lock);
+}
+
+void highlight_free(EditorState* state)
+{
+    Highlighter* hl = state->highlighter;
+    if (!hl) return;
+    if (hl->threaded) {
+        pthread_mutex_lock(&hl->lock);
+        hl->quit = 1;
+        pthread_cond_signal(&hl->wake);
+        pthread_mutex_unlock(&hl->lock);
+        pthread_join(hl->thread, NULL);
+    }
+    highlight_reset(state);
+    free(hl->queue);
+    free(hl->done);
+    pthread_cond_destroy(&hl->idle);
+    pthread_cond_destroy(&hl->wake);
+    pthread_mutex_destroy(&hl->lock);
+    free(hl);
+    state->highlighter = NULL;
+}
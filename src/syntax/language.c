@@ -0,0 +1,486 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../core/editor.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Language definitions are key = value files in config/languages, one per
+ * language (c.lang documents every key). Each is compiled once into byte
+ * class tables, a DFA over all of its operators and comment/string openers,
+ * and a perfect hash of its keywords, so the lexer in syntax.c never has to
+ * know which language it is looking at. Ids handed out are index + 1; 0 is
+ * plain text.
+ */
+static Language* languages = NULL;
+static int language_count = 0;
+static int languages_loaded = 0;
+
+unsigned int perfect_hash(const char* key, int len, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+int perfect_build(PerfectHash* table, const char** keys, const int* values, int n)
+{
+    unsigned int slot_count = 1, bucket_count = 1;
+    while (slot_count < (unsigned int)n * 4) slot_count <<= 1;
+    while (bucket_count < (unsigned int)n / 2 + 1) bucket_count <<= 1;
+
+    PerfectSlot* slots = (PerfectSlot*)calloc(slot_count, sizeof(PerfectSlot));
+    unsigned short* disp = (unsigned short*)calloc(bucket_count, sizeof(unsigned short));
+    int* bucket_of = (int*)malloc((size_t)(n ? n : 1) * sizeof(int));
+    int* bucket_size = (int*)calloc(bucket_count, sizeof(int));
+    if (!slots || !disp || !bucket_of || !bucket_size) goto fail;
+
+    for (int i = 0; i < n; i++) {
+        bucket_of[i] = perfect_hash(keys[i], strlen(keys[i]), 0) & (bucket_count - 1);
+        bucket_size[bucket_of[i]]++;
+    }
+
+    // Place the fullest buckets first while most slots are still free
+    for (int size = n; size > 0; size--) {
+        for (unsigned int b = 0; b < bucket_count; b++) {
+            if (bucket_size[b] != size) continue;
+            unsigned int d;
+            for (d = 1; d < 65536; d++) {
+                int ok = 1;
+                for (int i = 0; i < n && ok; i++) {
+                    if (bucket_of[i] != (int)b) continue;
+                    unsigned int s = perfect_hash(keys[i], strlen(keys[i]), d) & (slot_count - 1);
+                    if (slots[s].key) ok = 0;
+                    for (int j = 0; j < i && ok; j++) {
+                        if (bucket_of[j] == (int)b &&
+                            (perfect_hash(keys[j], strlen(keys[j]), d) & (slot_count - 1)) == s) ok = 0;
+                    }
+                }
+                if (ok) break;
+            }
+            if (d == 65536) goto fail;
+            disp[b] = (unsigned short)d;
+            for (int i = 0; i < n; i++) {
+                if (bucket_of[i] != (int)b) continue;
+                unsigned int s = perfect_hash(keys[i], strlen(keys[i]), d) & (slot_count - 1);
+                slots[s].key = keys[i];
+                slots[s].len = strlen(keys[i]);
+                slots[s].value = values[i];
+            }
+        }
+    }
+
+    free(bucket_of);
+    free(bucket_size);
+    table->slots = slots;
+    table->disp = disp;
+    table->slot_mask = slot_count - 1;
+    table->bucket_mask = bucket_count - 1;
+    return 0;
+
+fail:
+    free(slots);
+    free(disp);
+    free(bucket_of);
+    free(bucket_size);
+    return -1;
+}
+
+/* Returns the value stored for key, or 0. */
+int perfect_lookup(const PerfectHash* table, const char* key, int len)
+{
+    if (!table->slots) return 0;
+    unsigned int b = perfect_hash(key, len, 0) & table->bucket_mask;
+    const PerfectSlot* slot = &table->slots[perfect_hash(key, len, table->disp[b]) & table->slot_mask];
+    if (slot->key && slot->len == len && memcmp(slot->key, key, len) == 0) return slot->value;
+    return 0;
+}
+
+void perfect_free(PerfectHash* table)
+{
+    free(table->slots);
+    free(table->disp);
+    memset(table, 0, sizeof(*table));
+}
+
+static const struct {
+    const char* name;
+    int class_bit;
+} keyword_classes[] = {
+    { "type", LK_TYPE },
+    { "control", LK_CONTROL },
+    { "constant", LK_CONSTANT },
+    { "library_type", LK_LIBRARY_TYPE },
+    { "modifier", LK_MODIFIER },
+    { "storage", LK_STORAGE },
+    { "preprocessor", LK_PREPROCESSOR },
+    { "library_function", LK_LIBRARY_FUNCTION },
+    { "command", LK_COMMAND },
+};
+
+static const struct {
+    const char* name;
+    int flag;
+} language_features[] = {
+    { "cpp_raw_strings", LF_CPP_RAW_STRINGS },
+    { "rust_raw_strings", LF_RUST_RAW_STRINGS },
+    { "comment_needs_space", LF_COMMENT_NEEDS_SPACE },
+};
+
+/* Splits off the next whitespace-separated word of *cursor in place. */
+static char* next_word(char** cursor)
+{
+    char* p = *cursor;
+    while (*p && isspace((unsigned char)*p)) p++;
+    if (!*p) return NULL;
+    char* word = p;
+    while (*p && !isspace((unsigned char)*p)) p++;
+    if (*p) *p++ = '\0';
+    *cursor = p;
+    return word;
+}
+
+static void copy_word(char* dst, size_t size, const char* word)
+{
+    size_t len = strlen(word);
+    if (len >= size) len = size - 1;
+    memcpy(dst, word, len);
+    dst[len] = '\0';
+}
+
+static int add_token(Language* lang, int kind, const char* open, const char* close, int multiline)
+{
+    if (strlen(open) >= LANG_TOKEN_SIZE || strlen(close) >= LANG_TOKEN_SIZE) return 0;
+    for (int i = 0; i < lang->token_count; i++) {
+        LanguageToken* t = &lang->tokens[i];
+        // multiline_strings may repeat an opener from strings to mark it
+        if (t->kind == kind && strcmp(t->open, open) == 0) {
+            t->multiline |= multiline;
+            return 0;
+        }
+    }
+    if (lang->token_count == lang->token_cap) {
+        int cap = lang->token_cap ? lang->token_cap * 2 : 32;
+        LanguageToken* tokens = realloc(lang->tokens, (size_t)cap * sizeof(LanguageToken));
+        if (!tokens) return -1;
+        lang->tokens = tokens;
+        lang->token_cap = cap;
+    }
+    LanguageToken* t = &lang->tokens[lang->token_count++];
+    memset(t, 0, sizeof(*t));
+    strcpy(t->open, open);
+    strcpy(t->close, close);
+    t->kind = (unsigned char)kind;
+    t->multiline = (unsigned char)multiline;
+    return 0;
+}
+
+static int add_keyword(Language* lang, const char* word, int class_bit, int** values)
+{
+    for (int i = 0; i < lang->word_count; i++) {
+        if (strcmp(lang->words[i], word) == 0) {
+            (*values)[i] |= class_bit;
+            return 0;
+        }
+    }
+    char** words = realloc(lang->words, (size_t)(lang->word_count + 1) * sizeof(char*));
+    if (!words) return -1;
+    lang->words = words;
+    int* grown = realloc(*values, (size_t)(lang->word_count + 1) * sizeof(int));
+    if (!grown) return -1;
+    *values = grown;
+    char* copy = strdup(word);
+    if (!copy) return -1;
+    lang->words[lang->word_count] = copy;
+    (*values)[lang->word_count++] = class_bit;
+    return 0;
+}
+
+static int parse_entry(Language* lang, const char* key, char* value, int** keyword_values)
+{
+    char* word;
+    if (strcmp(key, "name") == 0) {
+        if ((word = next_word(&value))) copy_word(lang->name, sizeof(lang->name), word);
+    } else if (strcmp(key, "extensions") == 0) {
+        while ((word = next_word(&value)) && lang->extension_count < LANG_MAX_NAMES) {
+            copy_word(lang->extensions[lang->extension_count++], sizeof(lang->extensions[0]), word);
+        }
+    } else if (strcmp(key, "filenames") == 0) {
+        while ((word = next_word(&value)) && lang->filename_count < LANG_MAX_NAMES) {
+            copy_word(lang->filenames[lang->filename_count++], sizeof(lang->filenames[0]), word);
+        }
+    } else if (strcmp(key, "comment_lines") == 0) {
+        while ((word = next_word(&value)) && lang->comment_line_count < 4) {
+            copy_word(lang->comment_lines[lang->comment_line_count++], LANG_TOKEN_SIZE, word);
+        }
+    } else if (strcmp(key, "number_prefixes") == 0) {
+        while ((word = next_word(&value)) && lang->number_prefix_count < 8) {
+            copy_word(lang->number_prefixes[lang->number_prefix_count++], sizeof(lang->number_prefixes[0]), word);
+        }
+    } else if (strcmp(key, "number_suffixes") == 0 || strcmp(key, "exponent") == 0 ||
+               strcmp(key, "digit_separators") == 0 || strcmp(key, "identifier_chars") == 0) {
+        int flag = key[0] == 'n' ? LB_SUFFIX : key[0] == 'e' ? LB_EXPONENT : key[0] == 'd' ? LB_SEPARATOR : LB_WORD;
+        while ((word = next_word(&value))) {
+            for (const char* c = word; *c; c++) lang->byte_flags[(unsigned char)*c] |= flag;
+        }
+    } else if (strcmp(key, "line_comment") == 0 || strcmp(key, "operators") == 0 ||
+               strcmp(key, "strings") == 0 || strcmp(key, "multiline_strings") == 0 ||
+               strcmp(key, "raw_strings") == 0 || strcmp(key, "heredoc") == 0) {
+        int kind = LANG_OPERATOR, multiline = 0;
+        if (strcmp(key, "line_comment") == 0) kind = LANG_LINE_COMMENT;
+        else if (strcmp(key, "strings") == 0) kind = LANG_STRING;
+        else if (strcmp(key, "multiline_strings") == 0) kind = LANG_STRING, multiline = 1;
+        else if (strcmp(key, "raw_strings") == 0) kind = LANG_RAW_STRING, multiline = 1;
+        else if (strcmp(key, "heredoc") == 0) kind = LANG_HEREDOC;
+        while ((word = next_word(&value))) {
+            if (add_token(lang, kind, word, kind == LANG_OPERATOR ? "" : word, multiline) < 0) return -1;
+        }
+    } else if (strcmp(key, "block_comment") == 0) {
+        char* close;
+        while ((word = next_word(&value)) && (close = next_word(&value))) {
+            if (add_token(lang, LANG_BLOCK_COMMENT, word, close, 1) < 0) return -1;
+        }
+    } else if (strcmp(key, "features") == 0) {
+        while ((word = next_word(&value))) {
+            for (size_t f = 0; f < sizeof(language_features) / sizeof(language_features[0]); f++) {
+                if (strcmp(word, language_features[f].name) == 0) lang->features |= language_features[f].flag;
+            }
+        }
+    } else if (strncmp(key, "keywords.", 9) == 0) {
+        int class_bit = 0;
+        for (size_t k = 0; k < sizeof(keyword_classes) / sizeof(keyword_classes[0]); k++) {
+            if (strcmp(key + 9, keyword_classes[k].name) == 0) class_bit = keyword_classes[k].class_bit;
+        }
+        if (!class_bit) return 0;
+        while ((word = next_word(&value))) {
+            if (add_keyword(lang, word, class_bit, keyword_values) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builds the byte classes and the delimiter DFA. The DFA is a trie over every
+ * opener, with bytes that appear in none of them sharing dead column 0; the
+ * lexer follows it for the longest opener at a position. When two kinds share
+ * an opener, comments beat strings beat heredocs beat operators.
+ */
+static int compile_language(Language* lang)
+{
+    for (int b = 0; b < 256; b++) {
+        int cls = LC_GAP;
+        if (isalpha(b) || b == '_') cls = LC_WORD;
+        else if (isdigit(b)) cls = LC_DIGIT;
+        else if (b == '(' || b == ')' || b == '[' || b == ']' || b == '{' || b == '}') cls = LC_BRACKET;
+        if (cls == LC_GAP && (lang->byte_flags[b] & LB_WORD)) cls = LC_WORD;
+        if (cls == LC_WORD || isdigit(b)) lang->byte_flags[b] |= LB_WORD;
+        lang->base_class[b] = (unsigned char)cls;
+        lang->byte_class[b] = (unsigned char)cls;
+    }
+
+    int columns = 0, max_states = 2;
+    for (int i = 0; i < lang->token_count; i++) {
+        const char* open = lang->tokens[i].open;
+        for (const char* c = open; *c; c++) {
+            if (!lang->dfa_column[(unsigned char)*c]) lang->dfa_column[(unsigned char)*c] = (unsigned char)++columns;
+        }
+        max_states += (int)strlen(open);
+    }
+    if (max_states > 32767) return -1;
+    lang->dfa_width = columns + 1;
+    lang->dfa = calloc((size_t)max_states * lang->dfa_width, sizeof(short));
+    lang->dfa_accept = calloc((size_t)max_states, sizeof(short));
+    if (!lang->dfa || !lang->dfa_accept) return -1;
+
+    static const int priority[] = {
+        LANG_LINE_COMMENT, LANG_BLOCK_COMMENT, LANG_STRING, LANG_RAW_STRING, LANG_HEREDOC, LANG_OPERATOR
+    };
+    int states = 2;
+    for (size_t p = 0; p < sizeof(priority) / sizeof(priority[0]); p++) {
+        for (int i = 0; i < lang->token_count; i++) {
+            const LanguageToken* t = &lang->tokens[i];
+            if (t->kind != priority[p] || !t->open[0]) continue;
+            int s = 1;
+            for (const char* c = t->open; *c; c++) {
+                short* next = &lang->dfa[s * lang->dfa_width + lang->dfa_column[(unsigned char)*c]];
+                if (!*next) *next = (short)states++;
+                s = *next;
+            }
+            if (!lang->dfa_accept[s]) lang->dfa_accept[s] = (short)(i + 1);
+            lang->byte_class[(unsigned char)t->open[0]] = LC_DELIM;
+        }
+    }
+
+    return 0;
+}
+
+static void free_language(Language* lang)
+{
+    free(lang->tokens);
+    free(lang->dfa);
+    free(lang->dfa_accept);
+    perfect_free(&lang->keywords);
+    for (int i = 0; i < lang->word_count; i++) free(lang->words[i]);
+    free(lang->words);
+}
+
+static int language_named(const char* name)
+{
+    for (int i = 0; i < language_count; i++) {
+        if (strcmp(languages[i].name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Parses and compiles one definition; a name already loaded is skipped. */
+static void load_language(const char* path, const char* stem)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) return;
+
+    Language lang;
+    memset(&lang, 0, sizeof(lang));
+    copy_word(lang.name, sizeof(lang.name), stem);
+    int* keyword_values = NULL;
+    int ok = 0;
+
+    char line[4096];
+    while (ok == 0 && fgets(line, sizeof(line), fp)) {
+        char* p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '#' || *p == '\0') continue;
+        char* eq = strchr(p, '=');
+        if (!eq) continue;
+        char* key_end = eq;
+        while (key_end > p && isspace((unsigned char)key_end[-1])) key_end--;
+        *key_end = '\0';
+        ok = parse_entry(&lang, p, eq + 1, &keyword_values);
+    }
+    fclose(fp);
+
+    if (ok == 0 && !language_named(lang.name)) {
+        ok = compile_language(&lang);
+        if (ok == 0) ok = perfect_build(&lang.keywords, (const char**)lang.words, keyword_values, lang.word_count);
+        if (ok == 0) {
+            Language* grown = realloc(languages, (size_t)(language_count + 1) * sizeof(Language));
+            if (grown) {
+                languages = grown;
+                languages[language_count++] = lang;
+                free(keyword_values);
+                return;
+            }
+        }
+    }
+    free(keyword_values);
+    free_language(&lang);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/* Loads every *.lang in dir, in name order; returns 0 if dir could not be opened. */
+static int load_language_dir(const char* dir)
+{
+    DIR* d = opendir(dir);
+    if (!d) return 0;
+
+    char** names = NULL;
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d))) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 5 || strcmp(entry->d_name + len - 5, ".lang") != 0) continue;
+        char** grown = realloc(names, (size_t)(count + 1) * sizeof(char*));
+        if (!grown) break;
+        names = grown;
+        if (!(names[count] = strdup(entry->d_name))) break;
+        count++;
+    }
+    closedir(d);
+
+    qsort(names, count, sizeof(char*), compare_names);
+    for (int i = 0; i < count; i++) {
+        char path[1024];
+        char stem[64];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        snprintf(stem, sizeof(stem), "%.*s", (int)strlen(names[i]) - 5, names[i]);
+        load_language(path, stem);
+        free(names[i]);
+    }
+    free(names);
+    return 1;
+}
+
+/* User definitions come first so they can replace an installed one of the same name. */
+static void languages_load(void)
+{
+    if (languages_loaded) return;
+    languages_loaded = 1;
+
+    const char* home = getenv("HOME");
+    if (home) {
+        char home_dir[512];
+        snprintf(home_dir, sizeof(home_dir), "%s/.config/root-editor/languages", home);
+        load_language_dir(home_dir);
+    }
+
+    const char* language_paths[] = {
+        "/usr/local/share/root-editor/languages",
+        "/usr/share/root-editor/languages",
+        "./config/languages",
+        "config/languages",
+        "../config/languages",
+        NULL
+    };
+    for (int i = 0; language_paths[i] != NULL; i++) {
+        if (load_language_dir(language_paths[i])) break;
+    }
+}
+
+/* Returns the id of the language for filename, matched on its name or extension, or 0. */
+int language_detect(const char* filename)
+{
+    if (!filename || !*filename) return 0;
+    languages_load();
+
+    const char* base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    const char* ext = strrchr(base, '.');
+
+    for (int i = 0; i < language_count; i++) {
+        const Language* lang = &languages[i];
+        for (int j = 0; j < lang->filename_count; j++) {
+            if (strcmp(base, lang->filenames[j]) == 0) return i + 1;
+        }
+        for (int j = 0; ext && j < lang->extension_count; j++) {
+            if (strcmp(ext, lang->extensions[j]) == 0) return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* The highlight worker calls this too; the table never changes once a language is in use. */
+const Language* language_get(int id)
+{
+    if (id <= 0 || id > language_count) return NULL;
+    return &languages[id - 1];
+}
+
+void languages_free(void)
+{
+    for (int i = 0; i < language_count; i++) free_language(&languages[i]);
+    free(languages);
+    languages = NULL;
+    language_count = 0;
+    languages_loaded = 0;
+}
@@ -3,22 +3,6 @@
 #include <ctype.h>
 #include <stdlib.h>
 
-#define FILE_TYPE_PLAIN   0
-#define FILE_TYPE_C       1
-#define FILE_TYPE_CPP     2
-#define FILE_TYPE_CSHARP  3
-#define FILE_TYPE_RUST    4
-#define FILE_TYPE_PYTHON  5
-#define FILE_TYPE_JAVASCRIPT 6
-#define FILE_TYPE_JAVA    7
-#define FILE_TYPE_PHP     8
-#define FILE_TYPE_RUBY    9
-#define FILE_TYPE_SHELL   10
-#define FILE_TYPE_HTML    11
-#define FILE_TYPE_CSS     12
-#define FILE_TYPE_MAKEFILE 13
-#define FILE_TYPE_TYPESCRIPT 14
-#define FILE_TYPE_JSON    15
 #define COLOR_DATA_TYPE        7   
 #define COLOR_STRING           8   
 #define COLOR_COMMENT          9   
@@ -44,106 +28,6 @@
 
 
 
-typedef struct {
-    char token[64];
-    char scope[128];
-    int start_pos;
-    int end_pos;
-    int is_function;
-    int is_variable;
-    int is_type;
-    int is_keyword;
-    int is_constant;
-} TokenInfo;
-const char* data_types[] = {
-    "char","int","float","double","void","short","long","signed","unsigned",
-    "bool","string","byte","sbyte","ushort","uint","ulong","decimal",
-    "i8","i16","i32","i64","u8","u16","u32","u64","f32","f64",
-    "isize","usize","str","String"
-};
-const int data_types_count = sizeof(data_types) / sizeof(data_types[0]);
-
-const char* modifiers[] = {
-    "long","short","unsigned","signed","mut","const","static","public","volatile",
-    "extern","register","auto","pub","priv","ref","async","await","unsafe"
-};
-const int modifiers_count = sizeof(modifiers) / sizeof(modifiers[0]);
-
-const char* control_flow[] = {
-    "if","else","for","while","do","switch","case","default","break",
-    "continue","return","goto","match","loop","try","catch","finally",
-    "throw","raise","pass","yield","with","as","fn","fi"
-};
-const int control_flow_count = sizeof(control_flow) / sizeof(control_flow[0]);
-
-const char* storage_class[] = {
-    "static","const","volatile","extern","let","var","val","def",
-    "class","struct","enum","union","typedef","using","import","from",
-    "impl","trait","dyn","where","type"
-};
-const int storage_class_count = sizeof(storage_class) / sizeof(storage_class[0]);
-
-const char* preprocessor[] = {
-    "include","define","ifdef","ifndef","endif","pragma","macro",
-    "derive","cfg","allow","warn","deny","forbid"
-};
-const int preprocessor_count = sizeof(preprocessor) / sizeof(preprocessor[0]);
-
-const char* constants[] = {
-    "NULL","null","None","true","false","TRUE","FALSE","EXIT_SUCCESS",
-    "EXIT_FAILURE","Some","Ok","Err","self","Self","crate","super"
-};
-const int constants_count = sizeof(constants) / sizeof(constants[0]);
-
-const char* stdlib_functions[] = {
-    "printf","scanf","strlen","strcpy","strcat","strcmp","malloc","free",
-    "calloc","realloc","memcpy","memset","fopen","fclose","fread","fwrite",
-    "fprintf","fscanf","sprintf","sscanf","atoi","atol","atof","rand","srand"
-};
-const int stdlib_functions_count = sizeof(stdlib_functions) / sizeof(stdlib_functions[0]);
-
-const char* stdlib_types[] = {
-    "size_t","FILE","time_t","clock_t","ptrdiff_t",
-    "int8_t","int16_t","int32_t","int64_t",
-    "uint8_t","uint16_t","uint32_t","uint64_t",
-    "uintptr_t","intptr_t","va_list"
-};
-const int stdlib_types_count = sizeof(stdlib_types) / sizeof(stdlib_types[0]);
-
-const char* c_operators[] = {
-    "+","-","*","/","%","=","==","!=","<",">","<=",">=","&&","||","!","&",
-    "|","^","~","<<",">>","+=","-=","*=","/=","%=","&=","|=","^=","<<=",">>=",
-    "++","--","->",".","?",":"
-};
-const int c_operator_count = sizeof(c_operators) / sizeof(c_operators[0]);
-void load_keywords(EditorState* state);
-int is_in_list(const char* word, const char** list, int count)
-{
-    if (!word) return 0;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(word, list[i]) == 0) return 1;
-    }
-    return 0;
-}
-
-int is_data_type(const char* word)        { return is_in_list(word, data_types, data_types_count); }
-int is_modifier(const char* word)         { return is_in_list(word, modifiers, modifiers_count); }
-int is_control_flow(const char* word)     { return is_in_list(word, control_flow, control_flow_count); }
-int is_storage_class(const char* word)    { return is_in_list(word, storage_class, storage_class_count); }
-int is_preprocessor(const char* word)     { return is_in_list(word, preprocessor, preprocessor_count); }
-int is_constant(const char* word)         { return is_in_list(word, constants, constants_count); }
-int is_stdlib_function(const char* word)  { return is_in_list(word, stdlib_functions, stdlib_functions_count); }
-int is_stdlib_type(const char* word)      { return is_in_list(word, stdlib_types, stdlib_types_count); }
-
-int is_operator(const char* op)
-{
-    if (!op) return 0;
-    for (int i = 0; i < c_operator_count; i++) {
-        if (strcmp(op, c_operators[i]) == 0) return 1;
-    }
-    return 0;
-}
-
 int is_bracket(char ch)
 {
     return ch=='(' || ch==')' || ch=='[' || ch==']' || ch=='{' || ch=='}';
@@ -163,124 +47,18 @@ int is_number(const char* token)
 void init_syntax_highlighting(EditorState* state)
 {
     if (!state) return;
-
     if (!state->syntax_enabled) return;
     detect_file_type(state);
-    load_keywords(state);
 }
 
+/* Picks the language definition for the file name; unknown files are plain text. */
 void detect_file_type(EditorState* state)
 {
-    if (!state)
-    {
-        return;
-    }
-    if (!*state->filename)
-    {
-        state->file_type = FILE_TYPE_PLAIN;
-        state->syntax_enabled = 1;
-        return;
-    }
-    if (strcmp(state->filename, "Makefile") == 0 || strcmp(state->filename, "makefile") == 0)
-    {
-        state->file_type = FILE_TYPE_MAKEFILE;
-        state->syntax_enabled = 1;
-        return;
-    }
-    const char* ext = strrchr(state->filename, '.');
-    if (!ext)
-    {
-        state->file_type = FILE_TYPE_PLAIN;
-        state->syntax_enabled = 1;
-        return;
-    }
-
-    if (strcmp(ext, ".c") == 0 || strcmp(ext, ".cpp") == 0 || strcmp(ext, ".cc") == 0 ||
-        strcmp(ext, ".cxx") == 0 || strcmp(ext, ".h") == 0 || strcmp(ext, ".hpp") == 0 ||
-        strcmp(ext, ".py") == 0 || strcmp(ext, ".java") == 0 || strcmp(ext, ".js") == 0 ||
-        strcmp(ext, ".ts") == 0 || strcmp(ext, ".php") == 0 || strcmp(ext, ".rb") == 0 ||
-        strcmp(ext, ".rs") == 0 || strcmp(ext, ".go") == 0 || strcmp(ext, ".swift") == 0 ||
-        strcmp(ext, ".kt") == 0 || strcmp(ext, ".scala") == 0 || strcmp(ext, ".cs") == 0 ||
-        strcmp(ext, ".fs") == 0 || strcmp(ext, ".ml") == 0 || strcmp(ext, ".hs") == 0 ||
-        strcmp(ext, ".lua") == 0 || strcmp(ext, ".pl") == 0 || strcmp(ext, ".pm") == 0 ||
-        strcmp(ext, ".tcl") == 0 || strcmp(ext, ".sh") == 0 || strcmp(ext, ".bash") == 0 ||
-        strcmp(ext, ".zsh") == 0 || strcmp(ext, ".fish") == 0 || strcmp(ext, ".ps1") == 0 ||
-        strcmp(ext, ".sql") == 0 || strcmp(ext, ".html") == 0 || strcmp(ext, ".xml") == 0 ||
-        strcmp(ext, ".css") == 0 || strcmp(ext, ".scss") == 0 || strcmp(ext, ".sass") == 0 ||
-        strcmp(ext, ".less") == 0 || strcmp(ext, ".json") == 0 || strcmp(ext, ".yaml") == 0 ||
-        strcmp(ext, ".yml") == 0 || strcmp(ext, ".toml") == 0 || strcmp(ext, ".ini") == 0 ||
-        strcmp(ext, ".cfg") == 0 || strcmp(ext, ".conf") == 0 || strcmp(ext, ".md") == 0 ||
-        strcmp(ext, ".tex") == 0 || strcmp(ext, ".r") == 0 || strcmp(ext, ".R") == 0 ||
-        strcmp(ext, ".m") == 0 || strcmp(ext, ".jl") == 0 || strcmp(ext, ".dart") == 0 ||
-        strcmp(ext, ".dart") == 0 || strcmp(ext, ".txt") == 0)
-    {
-
-        if (strcmp(ext, ".py") == 0) state->file_type = FILE_TYPE_PYTHON;
-        else if (strcmp(ext, ".c") == 0 || strcmp(ext, ".cpp") == 0 || strcmp(ext, ".cc") == 0 ||
-                  strcmp(ext, ".cxx") == 0 || strcmp(ext, ".h") == 0 || strcmp(ext, ".hpp") == 0)
-        {
-            state->file_type = FILE_TYPE_C;
-        }
-        else if (strcmp(ext, ".rs") == 0)
-        {
-            state->file_type = FILE_TYPE_RUST;
-        }
-        else if (strcmp(ext, ".js") == 0)
-        {
-            state->file_type = FILE_TYPE_JAVASCRIPT;
-        }
-        else if (strcmp(ext, ".ts") == 0)
-        {
-            state->file_type = FILE_TYPE_TYPESCRIPT;
-        }
-        else if (strcmp(ext, ".java") == 0)
-        {
-            state->file_type = FILE_TYPE_JAVA;
-        }
-        else if (strcmp(ext, ".php") == 0)
-        {
-            state->file_type = FILE_TYPE_PHP;
-        }
-        else if (strcmp(ext, ".rb") == 0)
-        {
-            state->file_type = FILE_TYPE_RUBY;
-        }
-        else if (strcmp(ext, ".sh") == 0 || strcmp(ext, ".bash") == 0 || strcmp(ext, ".bat") == 0 || strcmp(ext, ".cmd") == 0)
-        {
-            state->file_type = FILE_TYPE_SHELL;
-        }
-        else if (strcmp(ext, ".html") == 0)
-        {
-            state->file_type = FILE_TYPE_HTML;
-        }
-        else if (strcmp(ext, ".css") == 0)
-        {
-            state->file_type = FILE_TYPE_CSS;
-        }
-        else if (strcmp(ext, ".cs") == 0)
-        {
-            state->file_type = FILE_TYPE_CSHARP;
-        }
-        else if (strcmp(ext, ".json") == 0)
-        {
-            state->file_type = FILE_TYPE_JSON;
-        }
-        else
-        {
-            state->file_type = FILE_TYPE_PLAIN;
-        }
-
-        state->syntax_enabled = 1;
-    }
-    else
-    {
-        state->file_type = FILE_TYPE_PLAIN;
-        state->syntax_enabled = 1;
-    }
+    if (!state) return;
+    state->file_type = language_detect(state->filename);
+    state->syntax_enabled = 1;
 }
 
-void load_keywords(EditorState* state) { (void)state; }
-
 void free_syntax_data(EditorState* state)
 {
     if (!state->keywords) return;
@@ -290,137 +68,76 @@ void free_syntax_data(EditorState* state)
     state->keyword_count = 0;
 }
 
-void update_syntax_highlighting(EditorState* state)
-{
-    
-    (void)state;
-}
-void analyze_token_context(EditorState* state, int line_num, int token_start, int token_end, TokenInfo* info)
+// First rule for scope that sets a foreground (or, with font set, a fontStyle).
+static int scope_rule(const Theme* theme, const char* scope, int font)
 {
-    if (!state->lines[line_num]) return;
-
-    char* line = state->lines[line_num];
-    char token[64] = {0};
-    int len = token_end - token_start;
-    if (len >= sizeof(token)) len = sizeof(token) - 1;
-    strncpy(token, &line[token_start], len);
-    token[len] = '\0';
-    strcpy(info->token, token);
-    info->start_pos = token_start;
-    info->end_pos = token_end;
-
-    
-    info->is_function = 0;
-    info->is_variable = 0;
-    info->is_type = 0;
-    info->is_keyword = 0;
-    info->is_constant = 0;
-
-    
-    int after_pos = token_end;
-    while (after_pos < strlen(line) && isspace(line[after_pos])) after_pos++;
-
-    
-    if (after_pos < strlen(line) && line[after_pos] == '(') {
-        info->is_function = 1;
-        strcpy(info->scope, "entity.name.function");
-        return;
-    }
-
-    
-    int before_pos = token_start - 1;
-    while (before_pos >= 0 && isspace(line[before_pos])) before_pos--;
-
-    
-    if (state->file_type == FILE_TYPE_C || state->file_type == FILE_TYPE_CPP) {
-        if (strcmp(token, "int") == 0 || strcmp(token, "char") == 0 || strcmp(token, "float") == 0 ||
-            strcmp(token, "double") == 0 || strcmp(token, "void") == 0 || strcmp(token, "long") == 0 ||
-            strcmp(token, "short") == 0 || strcmp(token, "unsigned") == 0 || strcmp(token, "signed") == 0) {
-            info->is_type = 1;
-            strcpy(info->scope, "storage.type");
-            return;
-        }
-    }
-
-    
-    if (strcmp(token, "if") == 0 || strcmp(token, "else") == 0 || strcmp(token, "for") == 0 ||
-        strcmp(token, "while") == 0 || strcmp(token, "do") == 0 || strcmp(token, "switch") == 0 ||
-        strcmp(token, "case") == 0 || strcmp(token, "default") == 0 || strcmp(token, "break") == 0 ||
-        strcmp(token, "continue") == 0 || strcmp(token, "return") == 0 || strcmp(token, "goto") == 0) {
-        info->is_keyword = 1;
-        strcpy(info->scope, "keyword.control");
-        return;
-    }
-
-    
-    if (strcmp(token, "NULL") == 0 || strcmp(token, "null") == 0 || strcmp(token, "true") == 0 ||
-        strcmp(token, "false") == 0 || strcmp(token, "TRUE") == 0 || strcmp(token, "FALSE") == 0) {
-        info->is_constant = 1;
-        strcpy(info->scope, "constant.language");
-        return;
+    for (int i = 0; i < theme->rule_count; i++) {
+        const ThemeRule* rule = &theme->rules[i];
+        if (!theme->pool[font ? rule->font_style : rule->color]) continue;
+        if (match_scope(scope, theme->pool + rule->scope)) return i;
     }
-
-    
-    info->is_variable = 1;
-    strcpy(info->scope, "variable");
+    return -1;
 }
-int get_vscode_scope_color(EditorState* state, const char* token, int pos_in_line, char* line, int line_num)
-{
-    
-    TokenInfo info;
-    analyze_token_context(state, line_num, pos_in_line, pos_in_line + strlen(token), &info);
-
-    
-    if (strlen(info.scope) > 0) {
-        int color = get_dynamic_color(state, info.scope);
-        if (color != COLOR_DEFAULT) return color;
-    }
-
-    
-    switch (state->file_type) {
-        case FILE_TYPE_C:
-        case FILE_TYPE_CPP:
-            
-            if (strcmp(token, "int") == 0 || strcmp(token, "char") == 0 || strcmp(token, "float") == 0 ||
-                strcmp(token, "double") == 0 || strcmp(token, "void") == 0 || strcmp(token, "long") == 0 ||
-                strcmp(token, "short") == 0 || strcmp(token, "unsigned") == 0 || strcmp(token, "signed") == 0 ||
-                strcmp(token, "bool") == 0 || strcmp(token, "size_t") == 0) {
-                return get_dynamic_color(state, "storage.type");
-            }
-            
-            if (strcmp(token, "if") == 0 || strcmp(token, "else") == 0 || strcmp(token, "for") == 0 ||
-                strcmp(token, "while") == 0 || strcmp(token, "do") == 0 || strcmp(token, "switch") == 0 ||
-                strcmp(token, "case") == 0 || strcmp(token, "default") == 0 || strcmp(token, "break") == 0 ||
-                strcmp(token, "continue") == 0 || strcmp(token, "return") == 0 || strcmp(token, "goto") == 0) {
-                return get_dynamic_color(state, "keyword.control");
-            }
-            break;
-    }
 
-    
-    if (info.is_function) {
-        return get_dynamic_color(state, "entity.name.function");
-    }
-    if (info.is_type) {
-        return get_dynamic_color(state, "storage.type");
-    }
-    if (info.is_keyword) {
-        return get_dynamic_color(state, "keyword.control");
-    }
-    if (info.is_constant) {
-        return get_dynamic_color(state, "constant.language");
-    }
+static int scope_cache_grow(ScopeCache* cache)
+{
+    int cap = cache->cap ? cache->cap * 2 : 64;
+    ScopeEntry* slots = calloc(cap, sizeof(ScopeEntry));
+    if (!slots) return -1;
+    for (int i = 0; i < cache->cap; i++) {
+        ScopeEntry* e = &cache->slots[i];
+        if (!e->scope) continue;
+        int j = e->hash & (cap - 1);
+        while (slots[j].scope) j = (j + 1) & (cap - 1);
+        slots[j] = *e;
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->cap = cap;
+    return 0;
+}
 
-    if (state->file_type == FILE_TYPE_SHELL) {
-        if (is_control_flow(token)) return COLOR_MODIFIER;
-        if (strcmp(token, "echo") == 0 || strcmp(token, "clear") == 0 || strcmp(token, "cd") == 0 || strcmp(token, "sudo") == 0 || strcmp(token, "rm") == 0 || strcmp(token, "cp") == 0 || strcmp(token, "mkdir") == 0) return COLOR_INTEGER_LITERAL;
-    }
+// Returns the entry for scope, resolving its rule on first sight; NULL on OOM.
+static ScopeEntry* scope_cache_find(Theme* theme, const char* scope)
+{
+    ScopeCache* cache = &theme->cache;
+    unsigned int h = perfect_hash(scope, (int)strlen(scope), 0);
+    int j = 0;
+    if (cache->cap) {
+        for (j = h & (cache->cap - 1); cache->slots[j].scope; j = (j + 1) & (cache->cap - 1)) {
+            ScopeEntry* e = &cache->slots[j];
+            if (e->hash == h && strcmp(e->scope, scope) == 0) return e;
+        }
+    }
+    if ((cache->count + 1) * 4 > cache->cap * 3) {
+        if (scope_cache_grow(cache) < 0) return NULL;
+        for (j = h & (cache->cap - 1); cache->slots[j].scope; j = (j + 1) & (cache->cap - 1));
+    }
+
+    size_t len = strlen(scope);
+    char* key = malloc(len + 1);
+    if (!key) return NULL;
+    memcpy(key, scope, len + 1);
+    int rule = scope_rule(theme, scope, 0);
+    ScopeEntry* e = &cache->slots[j];
+    e->scope = key;
+    e->hash = h;
+    e->color = rule >= 0 ? hex_to_color_pair(theme->pool + theme->rules[rule].color) : COLOR_DEFAULT;
+    e->font = scope_rule(theme, scope, 1);
+    e->resolved = -1;
+    cache->count++;
+    return e;
+}
 
-    return get_dynamic_color(state, "variable");
+void scope_cache_free(ScopeCache* cache)
+{
+    for (int i = 0; i < cache->cap; i++) free(cache->slots[i].scope);
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
 }
-static int get_hierarchical_color(EditorState* state, const char* scope)
+
+static int resolve_hierarchical_color(EditorState* state, const char* scope)
 {
-    if (!scope) return COLOR_DEFAULT;
     int color = get_dynamic_color(state, scope);
     if (color != COLOR_DEFAULT) return color;
 
@@ -480,9 +197,28 @@ static int get_hierarchical_color(EditorState* state, const char* scope)
     }
     return COLOR_DEFAULT;
 }
+
+// Fallback chains are walked once per scope and remembered until the theme reloads.
+int get_hierarchical_color(EditorState* state, const char* scope)
+{
+    if (!scope) return COLOR_DEFAULT;
+    if (!state->theme) return resolve_hierarchical_color(state, scope);
+    ScopeEntry* entry = scope_cache_find(state->theme, scope);
+    if (entry && entry->resolved >= 0) return entry->resolved;
+
+    int color = resolve_hierarchical_color(state, scope);
+    entry = scope_cache_find(state->theme, scope);
+    if (entry) entry->resolved = color;
+    return color;
+}
 int load_syntax_json(EditorState* state)
 {
     if (!state) return 0;
+    if (state->theme) return 1;
+    if (theme_shared()) {
+        state->theme = theme_retain(theme_shared());
+        return 1;
+    }
 
     const char* syntax_paths[] = {
         "/usr/local/share/root-editor/syntax.json",
@@ -573,1071 +309,452 @@ int match_scope(const char* token_scope, const char* rule_scope)
 
 int get_dynamic_color(EditorState* state, const char* scope)
 {
-    if (!state->json_loaded || !scope) return COLOR_DEFAULT;
-    for (int i = 0; i < state->json_rules_count; i++) {
-        if (match_scope(scope, state->json_scopes[i])) {
-            return hex_to_color_pair(state->json_colors[i]);
-        }
-    }
-    return COLOR_DEFAULT;
+    Theme* theme = state->theme;
+    if (!theme || !scope) return COLOR_DEFAULT;
+    ScopeEntry* entry = scope_cache_find(theme, scope);
+    if (entry) return entry->color;
+    int rule = scope_rule(theme, scope, 0);
+    return rule >= 0 ? hex_to_color_pair(theme->pool + theme->rules[rule].color) : COLOR_DEFAULT;
 }
 
 const char* get_dynamic_font_style(EditorState* state, const char* scope)
 {
-    if (!state->json_loaded || !scope) return "";
-    for (int i = 0; i < state->json_rules_count; i++) {
-        if (match_scope(scope, state->json_scopes[i])) {
-            return state->json_font_styles[i];
+    Theme* theme = state->theme;
+    if (!theme || !scope) return "";
+    ScopeEntry* entry = scope_cache_find(theme, scope);
+    int rule = entry ? entry->font : scope_rule(theme, scope, 1);
+    return rule >= 0 ? theme->pool + theme->rules[rule].font_style : "";
+}
+#define LEX_NORMAL        0
+#define LEX_BLOCK_COMMENT 1
+#define LEX_STRING        2
+#define LEX_RAW_STRING    3
+#define LEX_HEREDOC       4
+#define LEX_KIND(s)       ((s) & 0xff)
+#define LEX_DELIM(s)      (((s) & ~LEX_STALE) >> 8)
+#define LEX_MAX_DELIMS    256
+#define LEX_DELIM_SIZE    64
+
+/*
+ * Lexer states are a kind in the low byte and, for block comments, strings
+ * and heredocs, an index into this table of closing delimiters.
+ */
+static char lex_delims[LEX_MAX_DELIMS][LEX_DELIM_SIZE];
+static int lex_delim_count = 0;
+
+static unsigned int lex_make(int kind, const char* term, int term_len)
+{
+    if (term_len <= 0 || term_len >= LEX_DELIM_SIZE) return LEX_NORMAL;
+    for (int i = 0; i < lex_delim_count; i++) {
+        if ((int)strlen(lex_delims[i]) == term_len && memcmp(lex_delims[i], term, term_len) == 0) {
+            return kind | ((unsigned int)i << 8);
         }
     }
-    return "";
+    if (lex_delim_count == LEX_MAX_DELIMS) return LEX_NORMAL;
+    memcpy(lex_delims[lex_delim_count], term, term_len);
+    lex_delims[lex_delim_count][term_len] = '\0';
+    return kind | ((unsigned int)lex_delim_count++ << 8);
 }
-static int toggle_block_comment_state_in_line(const char* line, int upto_col, int in_comment)
-{
-    if (!line) return in_comment;
-    int len = (int)strlen(line);
-    if (len < 0) len = 0; 
-    if (upto_col < 0) upto_col = 0;
-    if (upto_col > len) upto_col = len;
 
-    for (int i = 0; i < upto_col; i++) {
-        if (!in_comment) {
-            if (line[i] == '/' && i + 1 < upto_col && line[i + 1] == '*') {
-                in_comment = 1;
-                i++; 
-            } else if (line[i] == '/' && i + 1 < upto_col && line[i + 1] == '/') {
-                
-                break;
-            }
-        } else {
-            if (line[i] == '*' && i + 1 < upto_col && line[i + 1] == '/') {
-                in_comment = 0;
-                i++; 
+/* Returns the index just past term in line[from, len), or -1. */
+static int lex_find_close(const char* line, int len, int from, const char* term, int escapes)
+{
+    int term_len = (int)strlen(term);
+    while (from + term_len <= len) {
+        const char* hit = memchr(line + from, term[0], len - from - term_len + 1);
+        if (escapes) {
+            const char* esc = memchr(line + from, '\\', (hit ? hit : line + len) - (line + from));
+            if (esc) {
+                from = (int)(esc - line) + 2;
+                continue;
             }
         }
+        if (!hit) return -1;
+        if (memcmp(hit, term, term_len) == 0) return (int)(hit - line) + term_len;
+        from = (int)(hit - line) + 1;
     }
-    return in_comment;
+    return -1;
 }
 
-static int in_block_comment_before(EditorState* state, int line_num, int upto_col)
+/* Whether an unclosed string ending in term stays open past the end of the line. */
+static int lex_string_spans_lines(const Language* lang, const char* term)
 {
-    if (!state || line_num < 0 || line_num >= state->line_count) {
-        return 0;
-    }
-
-    int in_comment = 0;
-    
-    int max_lines_to_check = 137; 
-    int lines_checked = 0;
-
-    for (int l = 0; l < line_num && lines_checked < max_lines_to_check; l++) {
-        if (!state->lines[l]) continue; 
-        const char* ln = state->lines[l];
-        int len = (int)strlen(ln);
-        if (len < 0) len = 0; 
-        in_comment = toggle_block_comment_state_in_line(ln, len, in_comment);
-        lines_checked++;
+    for (int i = 0; i < lang->token_count; i++) {
+        const LanguageToken* t = &lang->tokens[i];
+        if (t->kind == LANG_STRING && t->multiline && strcmp(t->close, term) == 0) return 1;
     }
-
-    
-    if (lines_checked >= max_lines_to_check) {
-        return 0;
-    }
-
-    const char* cur = state->lines[line_num];
-    if (cur) {
-        int len = (int)strlen(cur);
-        if (upto_col < 0) upto_col = 0;
-        if (upto_col > len) upto_col = len;
-        in_comment = toggle_block_comment_state_in_line(cur, upto_col, in_comment);
-    }
-    return in_comment;
+    return 0;
 }
 
-static int starts_with_preprocessor(const char* line)
+/* Length of the longest operator or opener at line[i], following the language DFA. */
+static int lex_match(const Language* lang, const char* line, int len, int i, int* token)
 {
-    if (!line) return 0;
-    int i = 0;
-    while (line[i] == ' ' || line[i] == '\t') i++;
-    return line[i] == '#';
-}
-void highlight_line(EditorState* state, int line_num, int screen_row, int line_num_width, int horizontal_scroll_offset)
-{
-    if (!state->syntax_enabled || !state->syntax_display_enabled) {
-        char* line = state->lines[line_num];
-        attron(COLOR_PAIR(COLOR_DEFAULT));
-        mvprintw(screen_row, line_num_width, "%.*s", COLS - line_num_width - 1, line);
-        attroff(COLOR_PAIR(COLOR_DEFAULT));
-        return;
+    int s = 1, best = 0;
+    for (int j = i; j < len && s; j++) {
+        int column = lang->dfa_column[(unsigned char)line[j]];
+        if (!column) break;
+        s = lang->dfa[s * lang->dfa_width + column];
+        if (s && lang->dfa_accept[s]) {
+            best = j - i + 1;
+            *token = lang->dfa_accept[s] - 1;
+        }
     }
+    return best;
+}
 
-    char* line = state->lines[line_num];
-    int len = strlen(line);
-
-    
-    int start_col = horizontal_scroll_offset;
-    if (start_col < 0) start_col = 0;
-    if (start_col > len) start_col = len;
-
-    int max_y, max_x;
-    getmaxyx(stdscr, max_y, max_x);
-    int avail_width = max_x - line_num_width - 1;
-    int end_col = start_col + avail_width;
-    if (end_col > len) end_col = len;
-
-    
-    int is_comment_line = 0;
+typedef struct SpanList {
+    HighlightSpan* spans;
+    int count, cap;
+    int failed;
+} SpanList;
 
-    
-    if (len >= 2) {
-        int i = start_col;
-        while (i < end_col && isspace(line[i])) i++; 
-        if (i + 1 < end_col && line[i] == '/' && line[i + 1] == '/') {
-            is_comment_line = 1;
-        } else if (line[i] == '#') {
-            is_comment_line = 1;
-        }
-    } else if (len >= 1) {
-        int i = start_col;
-        while (i < end_col && isspace(line[i])) i++; 
-        if (line[i] == '#') {
-            is_comment_line = 1;
+static void span_push(SpanList* out, int start, int len, int pair, int flags)
+{
+    if (!out || len <= 0 || out->failed) return;
+    if (out->count == out->cap) {
+        int grown = out->cap ? out->cap * 2 : 16;
+        HighlightSpan* list = realloc(out->spans, (size_t)grown * sizeof(HighlightSpan));
+        if (!list) {
+            out->failed = 1;
+            return;
         }
+        out->spans = list;
+        out->cap = grown;
     }
+    HighlightSpan* span = &out->spans[out->count++];
+    span->start = start;
+    span->len = len;
+    span->pair = (short)pair;
+    span->flags = (short)flags;
+}
 
-    
-    int in_block_comment = in_block_comment_before(state, line_num, start_col);
-
-    if (is_comment_line) {
-        attron(COLOR_PAIR(COLOR_COMMENT));
-        mvprintw(screen_row, line_num_width, "%.*s", end_col - start_col, line + start_col);
-        attroff(COLOR_PAIR(COLOR_COMMENT));
-        return;
+static int lex_number(const Language* lang, const char* line, int len, int i, SpanList* out)
+{
+    int start = i, is_float = 0;
+    for (int p = 0; p < lang->number_prefix_count; p++) {
+        const char* prefix = lang->number_prefixes[p];
+        int n = (int)strlen(prefix);
+        if (i + n < len && memcmp(line + i, prefix, n) == 0 && isalnum((unsigned char)line[i + n])) {
+            i += n;
+            while (i < len && (isalnum((unsigned char)line[i]) || (lang->byte_flags[(unsigned char)line[i]] & LB_SEPARATOR))) i++;
+            span_push(out, start, i - start, COLOR_INTEGER_LITERAL, 0);
+            return i;
+        }
+    }
+
+#define DIGIT_AT(k) ((k) < len && (isdigit((unsigned char)line[k]) || \
+                     (lang->byte_flags[(unsigned char)line[k]] & LB_SEPARATOR)))
+    while (DIGIT_AT(i)) i++;
+    if (i + 1 < len && line[i] == '.' && isdigit((unsigned char)line[i + 1])) {
+        is_float = 1;
+        i++;
+        while (DIGIT_AT(i)) i++;
     }
-
-    int col = line_num_width;
-
-    int in_double_quote = 0;
-    int in_single_quote = 0;
-    for (int check_i = 0; check_i < start_col; check_i++) {
-        if (line[check_i] == '"' && (check_i == 0 || line[check_i-1] != '\\')) {
-            in_double_quote = !in_double_quote;
-        } else if (line[check_i] == '\'' && (check_i == 0 || line[check_i-1] != '\\')) {
-            in_single_quote = !in_single_quote;
+    if (i < len && (lang->byte_flags[(unsigned char)line[i]] & LB_EXPONENT)) {
+        int k = i + 1;
+        if (k < len && (line[k] == '+' || line[k] == '-')) k++;
+        if (k < len && isdigit((unsigned char)line[k])) {
+            is_float = 1;
+            i = k;
+            while (DIGIT_AT(i)) i++;
         }
     }
+#undef DIGIT_AT
+    while (i < len && (lang->byte_flags[(unsigned char)line[i]] & LB_SUFFIX)) i++;
+    span_push(out, start, i - start, is_float ? COLOR_FLOAT_LITERAL : COLOR_INTEGER_LITERAL, 0);
+    return i;
+}
 
-    for (int i = start_col; i < end_col && col < max_x - 1; ) {
-        if (in_block_comment) {
-            int close_pos = -1;
-            for (int j = i; j < len - 1; j++) {
-                if (line[j] == '*' && line[j + 1] == '/') { close_pos = j; break; }
-            }
-            int seg_len;
-            if (close_pos >= 0) {
-                seg_len = (close_pos + 2) - i;
-                in_block_comment = 0;
-            } else {
-                seg_len = len - i;
-            }
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            mvprintw(screen_row, col, "%.*s", seg_len, &line[i]);
-            col += seg_len;
-            attroff(COLOR_PAIR(COLOR_COMMENT));
-            if (close_pos >= 0) {
-                i = close_pos + 2;
-                continue;
-            } else {
-                break;
-            }
-        }
-        char ch = line[i];
-
-        
-        if (isspace(ch)) { mvaddch(screen_row, col++, ch); i++; continue; }
-
-        if (is_bracket(ch)) {
-             int is_unmatched = 0;
-             if (ch == '(' || ch == '[' || ch == '{' || ch == '"' || ch == '\'') {
-                 
-                 char closing = (ch == '(') ? ')' : (ch == '[') ? ']' : (ch == '{') ? '}' : ch;
-                 int stack = 0;
-                 int found_closing = 0;
-
-                 
-                 for (int j = i; j < len; j++) {
-                     if (line[j] == ch) stack++;
-                     else if (line[j] == closing) {
-                         stack--;
-                         if (stack == 0) {
-                             found_closing = 1;
-                             break;
-                         }
-                     }
-                 }
-
-                 
-                 if (!found_closing) {
-                     for (int ln = line_num + 1; ln < state->line_count && !found_closing; ln++) {
-                         char* check_line = state->lines[ln];
-                         if (!check_line) continue;
-                         int check_len = strlen(check_line);
-                         for (int j = 0; j < check_len; j++) {
-                             if (check_line[j] == ch) stack++;
-                             else if (check_line[j] == closing) {
-                                 stack--;
-                                 if (stack == 0) {
-                                     found_closing = 1;
-                                     break;
-                                 }
-                             }
-                         }
-                     }
-                 }
-
-                 if (!found_closing) is_unmatched = 1;
-             } else if (ch == ')' || ch == ']' || ch == '}') {
-                 
-                 char opening = (ch == ')') ? '(' : (ch == ']') ? '[' : '{';
-                 int stack = 0;
-                 int found_opening = 0;
-
-                 
-                 for (int j = i; j >= 0; j--) {
-                     if (line[j] == ch) stack++;
-                     else if (line[j] == opening) {
-                         stack--;
-                         if (stack == 0) {
-                             found_opening = 1;
-                             break;
-                         }
-                     }
-                 }
-
-                 
-                 if (!found_opening) {
-                     for (int ln = line_num - 1; ln >= 0 && !found_opening; ln--) {
-                         char* check_line = state->lines[ln];
-                         if (!check_line) continue;
-                         int check_len = strlen(check_line);
-                         for (int j = check_len - 1; j >= 0; j--) {
-                             if (check_line[j] == ch) stack++;
-                             else if (check_line[j] == opening) {
-                                 stack--;
-                                 if (stack == 0) {
-                                     found_opening = 1;
-                                     break;
-                                 }
-                             }
-                         }
-                     }
-                 }
-
-                 if (!found_opening) is_unmatched = 1;
-             }
-             attron(COLOR_PAIR(is_unmatched ? COLOR_ERROR : COLOR_DELIMITER));
-             mvaddch(screen_row, col++, ch);
-             attroff(COLOR_PAIR(is_unmatched ? COLOR_ERROR : COLOR_DELIMITER));
-             i++;
-             continue;
-         }
-
-        if ((state->file_type==FILE_TYPE_PYTHON && ch=='#') ||
-            (ch=='/' && i+1<len && (line[i+1]=='/' || line[i+1]=='*'))) {
-            int comment_end = len;
-            if (ch=='/' && i+1 < len && line[i+1]=='*') {
-                
-                for (int j = i + 2; j < len - 1; j++) {
-                    if (line[j] == '*' && line[j+1] == '/') {
-                        comment_end = j + 2;
-                        break;
-                    }
-                }
-            }
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            mvprintw(screen_row, col, "%.*s", comment_end - i, &line[i]);
-            col += comment_end - i;
-            attroff(COLOR_PAIR(COLOR_COMMENT));
-            if (comment_end < len) {
-                i = comment_end;
-                continue;
-            } else {
-                break;
-            }
-        }
-
-        int op_len = 0;
-        for (int l = 3; l > 0; l--) {
-            if (i + l <= len) {
-                char temp[4] = {0};
-                strncpy(temp, &line[i], l);
-                if (is_operator(temp)) { op_len = l; break; }
-            }
-        }
-        if (op_len > 0) {
-            attron(COLOR_PAIR(COLOR_OPERATOR));
-            for (int k = 0; k < op_len; k++) mvaddch(screen_row, col++, line[i+k]);
-            attroff(COLOR_PAIR(COLOR_OPERATOR));
-            i += op_len;
-            continue;
-        }
-
-        
-        if (isdigit(ch) || (ch=='-' && i+1<len && isdigit(line[i+1]))) {
-            int start = i;
-            int has_dot = 0;
-            while (i < len && (isdigit(line[i]) || (line[i]=='.' && !has_dot))) {
-                if (line[i]=='.') has_dot=1;
-                i++;
-            }
-            attron(COLOR_PAIR(has_dot ? COLOR_FLOAT_LITERAL : COLOR_INTEGER_LITERAL));
-            mvprintw(screen_row, col, "%.*s", i-start, &line[start]);
-            col += i-start;
-            attroff(COLOR_PAIR(has_dot ? COLOR_FLOAT_LITERAL : COLOR_INTEGER_LITERAL));
-            continue;
-        }
-
-        
-        if (ch=='"' || ch=='\'') {
-             char quote = ch;
-             int start = i++;
-             int found_closing = 0;
-             
-             int string_end = i;
-             while (string_end < len && line[string_end] != quote) {
-                 if (line[string_end]=='\\' && string_end+1<len) string_end++;
-                 string_end++;
-             }
-             if (string_end < len) {
-                 string_end++;
-                 found_closing = 1;
-             } else {
-                 
-                 int full_string_end = i;
-                 while (full_string_end < len && line[full_string_end] != quote) {
-                     if (line[full_string_end]=='\\' && full_string_end+1<len) full_string_end++;
-                     full_string_end++;
-                 }
-                 if (full_string_end < len) {
-                     found_closing = 1;
-                 }
-             }
-             
-             if ((quote == '"' && in_double_quote) || (quote == '\'' && in_single_quote)) {
-                 found_closing = 1;
-             }
-
-             int print_len = (string_end <= end_col) ? string_end - start : end_col - start;
-             attron(COLOR_PAIR(found_closing ? COLOR_STRING : COLOR_ERROR));
-             mvprintw(screen_row, col, "%.*s", print_len, &line[start]);
-             col += print_len;
-             i = (string_end <= end_col) ? string_end : end_col;
-
-             
-             if (quote == '"' && !in_double_quote) in_double_quote = 1;
-             else if (quote == '"' && in_double_quote) in_double_quote = 0;
-             else if (quote == '\'' && !in_single_quote) in_single_quote = 1;
-             else if (quote == '\'' && in_single_quote) in_single_quote = 0;
-             attroff(COLOR_PAIR(found_closing ? COLOR_STRING : COLOR_ERROR));
-             continue;
-         }
-
-        
-
-        
-        if (isalpha(ch) || ch=='_') {
-            int start = i;
-            while (i < len && (isalnum(line[i]) || line[i]=='_')) i++;
-            int word_len = i-start;
-            char word[64] = {0};
-            strncpy(word, &line[start], word_len);
-
-            int color = COLOR_DEFAULT;
-
-            
-            if (is_data_type(word)) color = COLOR_DATA_TYPE;
-            
-            else if (is_control_flow(word)) color = COLOR_CONTROL_FLOW;
-            
-            else if (i < len && line[i]=='(') color = COLOR_FUNCTION;
-            
-            else if (is_constant(word)) color = COLOR_CONSTANT;
-            else if (is_stdlib_type(word)) color = COLOR_STDLIB_TYPE;
-            else if (is_modifier(word)) color = COLOR_MODIFIER;
-            else if (is_storage_class(word)) color = COLOR_STORAGE_CLASS;
-            else if (is_preprocessor(word)) color = COLOR_PREPROCESSOR;
-            else if (is_stdlib_function(word)) color = COLOR_STDLIB_FUNCTION;
+static int keyword_color(int kw, int is_call)
+{
+    if (kw & LK_TYPE) return COLOR_DATA_TYPE;
+    if (kw & LK_CONTROL) return COLOR_CONTROL_FLOW;
+    if (is_call) return COLOR_FUNCTION;
+    if (kw & LK_CONSTANT) return COLOR_CONSTANT;
+    if (kw & LK_LIBRARY_TYPE) return COLOR_STDLIB_TYPE;
+    if (kw & LK_MODIFIER) return COLOR_MODIFIER;
+    if (kw & LK_STORAGE) return COLOR_STORAGE_CLASS;
+    if (kw & LK_PREPROCESSOR) return COLOR_PREPROCESSOR;
+    if (kw & LK_LIBRARY_FUNCTION) return COLOR_STDLIB_FUNCTION;
+    if (kw & LK_COMMAND) return COLOR_INTEGER_LITERAL;
+    return COLOR_DEFAULT;
+}
 
-            if (state->file_type == FILE_TYPE_SHELL) {
-                if (is_control_flow(word)) color = COLOR_MODIFIER;
-                else if (strcmp(word, "echo") == 0 || strcmp(word, "clear") == 0 || strcmp(word, "cd") == 0 || strcmp(word, "sudo") == 0 || strcmp(word, "rm") == 0 || strcmp(word, "cp") == 0 || strcmp(word, "mkdir") == 0) color = COLOR_INTEGER_LITERAL;
-            }
-        
-            if (state->file_type == FILE_TYPE_JSON) {
-                
-                if (strcmp(word, "true") == 0 || strcmp(word, "false") == 0) {
-                    color = COLOR_CONSTANT;
-                } else if (strcmp(word, "null") == 0) {
-                    color = COLOR_CONSTANT;
-                } else if (is_number(word)) {
-                    color = COLOR_INTEGER_LITERAL;
-                } else {
-                    
-                    color = COLOR_STRING;
-                }
-            }
-        
-            attron(COLOR_PAIR(color));
-            mvprintw(screen_row, col, "%.*s", word_len, &line[start]);
-            col += word_len;
-            attroff(COLOR_PAIR(color));
-            continue;
+/*
+ * Returns the closing delimiter of a raw string whose prefix starts a word at
+ * line[i] (C++ R"x( and Rust r#"), setting *body to where its text begins.
+ */
+static int lex_raw_prefix(const Language* lang, const char* line, int len, int i, char* term, int* body)
+{
+    char next = i + 1 < len ? line[i + 1] : '\0';
+    if ((lang->features & LF_CPP_RAW_STRINGS) && line[i] == 'R' && next == '"') {
+        int paren = i + 2;
+        while (paren < len && paren - i - 2 < 16 && line[paren] != '(' && !isspace((unsigned char)line[paren])) paren++;
+        if (paren < len && line[paren] == '(') {
+            int delim_len = paren - i - 2;
+            term[0] = ')';
+            memcpy(term + 1, line + i + 2, delim_len);
+            term[delim_len + 1] = '"';
+            term[delim_len + 2] = '\0';
+            *body = paren + 1;
+            return 1;
+        }
+    }
+    if ((lang->features & LF_RUST_RAW_STRINGS) && line[i] == 'r' && (next == '"' || next == '#')) {
+        int j = i + 1;
+        while (j < len && line[j] == '#' && j - i <= 16) j++;
+        if (j < len && line[j] == '"') {
+            int hashes = j - i - 1;
+            term[0] = '"';
+            memset(term + 1, '#', hashes);
+            term[hashes + 1] = '\0';
+            *body = j + 1;
+            return 1;
         }
-
-        
-        mvaddch(screen_row, col++, ch);
-        i++;
     }
+    return 0;
 }
-void highlight_line_segment(EditorState* state, int line_num, int screen_row, int line_num_width, int start_col, int max_len)
-{
-    if (!state || line_num < 0 || line_num >= state->line_count) return;
-    char* line = state->lines[line_num];
-    if (!line) return;
-
-    int len = (int)strlen(line);
-    if (start_col < 0) start_col = 0;
-    if (start_col > len) start_col = len;
-
-    int max_y, max_x;
-    getmaxyx(stdscr, max_y, max_x);
-
-    const int text_margin = 0;
-    const int text_start_col = line_num_width + text_margin;
-    int avail_screen_w = max_x - text_start_col - 1;
-    if (avail_screen_w < 1) avail_screen_w = 1;
-
-    int usable = max_len;
-    if (usable > avail_screen_w) usable = avail_screen_w;
-
-    int end_col = start_col + usable;
-    if (end_col > len) end_col = len;
-
-    
-    int has_selection = state->select_mode && line_num >= state->select_start_y && line_num <= state->select_end_y;
-    int sel_start_x = has_selection ? (line_num == state->select_start_y ? state->select_start_x : 0) : -1;
-    int sel_end_x   = has_selection ? (line_num == state->select_end_y   ? state->select_end_x   : len) : -1;
-
-    
-    if (has_selection) {
-        if (sel_start_x < start_col) sel_start_x = start_col;
-        if (sel_end_x > end_col) sel_end_x = end_col;
-        if (sel_start_x >= sel_end_x) has_selection = 0;
-    }
 
-    
-    int is_preproc = starts_with_preprocessor(line);
-    if (is_preproc) {
-        int print_len = end_col - start_col;
-        if (print_len > 0) {
-            int pre_color = get_hierarchical_color(state, "keyword.control");
-            if (has_selection) {
-                int vis_sel_start = sel_start_x - start_col;
-                int vis_sel_end = sel_end_x - start_col;
-                if (vis_sel_start < 0) vis_sel_start = 0;
-                if (vis_sel_end > print_len) vis_sel_end = print_len;
-                if (vis_sel_end < 0) vis_sel_end = 0;
+/*
+ * Lexes one line in a single pass over lang's tables, starting in state s
+ * (term is the closing delimiter s refers to). With out set, the line's
+ * spans are collected and the end state is not computed, so the highlight
+ * worker never interns delimiters; without it, only the end state is.
+ */
+static unsigned int lex_line(const Language* lang, const char* line, int len, unsigned int s,
+                             const char* term, SpanList* out)
+{
+    unsigned int heredoc = LEX_NORMAL;
+    int kind = LEX_KIND(s);
+    int i = 0;
 
-                if (vis_sel_start > 0) {
-                    attron(COLOR_PAIR(pre_color));
-                    mvprintw(screen_row, text_start_col, "%.*s", vis_sel_start, line + start_col);
-                    attroff(COLOR_PAIR(pre_color));
-                }
-                if (vis_sel_end > vis_sel_start) {
-                    attron(COLOR_PAIR(COLOR_SELECTION));
-                    mvprintw(screen_row, text_start_col + vis_sel_start, "%.*s",
-                             vis_sel_end - vis_sel_start, line + start_col + vis_sel_start);
-                    attroff(COLOR_PAIR(COLOR_SELECTION));
-                }
-                if (vis_sel_end < print_len) {
-                    attron(COLOR_PAIR(pre_color));
-                    mvprintw(screen_row, text_start_col + vis_sel_end, "%.*s",
-                             print_len - vis_sel_end, line + start_col + vis_sel_end);
-                    attroff(COLOR_PAIR(pre_color));
-                }
-            } else {
-                attron(COLOR_PAIR(pre_color));
-                mvprintw(screen_row, text_start_col, "%.*s", print_len, line + start_col);
-                attroff(COLOR_PAIR(pre_color));
+    if (kind == LEX_HEREDOC) {
+        span_push(out, 0, len, COLOR_STRING, 0);
+        while (i < len && line[i] == '\t') i++;
+        if (len - i == (int)strlen(term) && memcmp(line + i, term, len - i) == 0) return LEX_NORMAL;
+        return s;
+    }
+    if (kind != LEX_NORMAL) {
+        int end = lex_find_close(line, len, 0, term, kind == LEX_STRING);
+        span_push(out, 0, end < 0 ? len : end, kind == LEX_BLOCK_COMMENT ? COLOR_COMMENT : COLOR_STRING, 0);
+        if (end < 0) {
+            // A string continued by a trailing backslash ends here unless this line continues it too
+            if (kind == LEX_STRING && !lex_string_spans_lines(lang, term) && !(len > 0 && line[len - 1] == '\\')) {
+                return LEX_NORMAL;
+            }
+            return s;
+        }
+        i = end;
+    } else if (lang->comment_line_count) {
+        int first = 0;
+        while (first < len && isspace((unsigned char)line[first])) first++;
+        for (int c = 0; c < lang->comment_line_count; c++) {
+            int n = (int)strlen(lang->comment_lines[c]);
+            if (first + n <= len && memcmp(line + first, lang->comment_lines[c], n) == 0) {
+                // The whole line is drawn as a comment, but it is still lexed for its end state
+                span_push(out, 0, len, COLOR_COMMENT, 0);
+                if (out) return LEX_NORMAL;
+                break;
             }
         }
-        return;
-    }
-
-    
-    int in_block_comment = in_block_comment_before(state, line_num, start_col);
-
-    int col = text_start_col;
-
-    
-    int comment_start = -1;
-    for (int check_i = start_col; check_i < end_col - 1; check_i++) {
-        if (line[check_i] == '/' && line[check_i + 1] == '/') {
-            comment_start = check_i;
-            break;
-        }
     }
 
-    
-    if (comment_start >= start_col) {
-        
-        int normal_end = comment_start;
-        for (int i = start_col; i < normal_end && col < max_x - 1; ) {
-            char ch = line[i];
-            int is_selected = has_selection && i >= sel_start_x && i < sel_end_x;
-
-            if (is_selected) {
-                attron(A_BOLD);
-            }
-
-            if (in_block_comment) {
-                int close_pos = -1;
-                for (int j = i; j < normal_end - 1; j++) {
-                    if (line[j] == '*' && line[j + 1] == '/') { close_pos = j; break; }
-                }
-                int seg_len;
-                if (close_pos >= 0) {
-                    seg_len = (close_pos + 2) - i;
-                    in_block_comment = 0;
-                } else {
-                    seg_len = normal_end - i;
-                }
-                int cmt_color = get_hierarchical_color(state, "comment");
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-                mvprintw(screen_row, col, "%.*s", seg_len, &line[i]);
-                col += seg_len;
-                i += seg_len;
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                continue;
-            }
-
-            
-            if (isspace((unsigned char)ch)) {
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-                mvaddch(screen_row, col++, ch);
-                attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                i++;
+    while (i < len) {
+        unsigned char b = (unsigned char)line[i];
+        int cls = lang->byte_class[b];
+        if (cls == LC_DELIM) {
+            int index = 0;
+            int n = lex_match(lang, line, len, i, &index);
+            const LanguageToken* t = &lang->tokens[index];
+            if (n > 0 && t->kind == LANG_OPERATOR) {
+                span_push(out, i, n, COLOR_OPERATOR, 0);
+                i += n;
                 continue;
             }
-
-            
-            if (ch == '(' || ch == ')' || ch == '[' || ch == ']' || ch == '{' || ch == '}' ||
-                ch == '.' || ch == ',' || ch == ';' || ch == '<' || ch == '>') {
-                const char* scope = "punctuation";
-                if (ch == '(' || ch == ')') scope = "punctuation.parenthesis";
-                else if (ch == '[' || ch == ']') scope = "punctuation.bracket";
-                else if (ch == '{' || ch == '}') scope = "punctuation.curly";
-                else if (ch == '<' || ch == '>') scope = "punctuation.angle";
-                else if (ch == '.') scope = "punctuation.dot";
-                else if (ch == ',') scope = "punctuation.comma";
-                else if (ch == ';') scope = "punctuation.semicolon";
-
-                int pcolor = get_hierarchical_color(state, scope);
-                if (pcolor == COLOR_DEFAULT) pcolor = get_hierarchical_color(state, "punctuation");
-                if (pcolor == COLOR_DEFAULT) pcolor = get_hierarchical_color(state, "keyword.operator");
-
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : pcolor));
-                mvaddch(screen_row, col++, ch);
-                attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : pcolor));
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                i++;
-                continue;
-            }
-
-            
-            int op_len = 0;
-            if (ch == '=' || ch == '!' || ch == '<' || ch == '>' || ch == '+' || ch == '-' ||
-                ch == '*' || ch == '/' || ch == '%' || ch == '&' || ch == '|' || ch == '^' ||
-                ch == '~' || ch == '?' || ch == ':') {
-                if (i + 1 < normal_end) {
-                    char next = line[i + 1];
-                    if ((ch == '=' && (next == '=' || next == '+' || next == '-' || next == '*' || next == '/' || next == '%' || next == '&' || next == '|' || next == '^' || next == '<' || next == '>')) ||
-                        (ch == '+' && next == '+') ||
-                        (ch == '-' && next == '-') ||
-                        (ch == '&' && next == '&') ||
-                        (ch == '|' && next == '|') ||
-                        (ch == '<' && (next == '<' || next == '=')) ||
-                        (ch == '>' && (next == '>' || next == '='))) {
-                        op_len = 2;
-                    } else if (i + 2 < normal_end && ch == '>' && line[i+1] == '>' && line[i+2] == '=') {
-                        op_len = 3;
-                    } else if (i + 2 < normal_end && ch == '<' && line[i+1] == '<' && line[i+2] == '=') {
-                        op_len = 3;
-                    }
-                }
-                if (op_len == 0) op_len = 1;
-
-                int op_color = get_hierarchical_color(state, "keyword.operator");
-                if (op_color == COLOR_DEFAULT) op_color = get_hierarchical_color(state, "punctuation");
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : op_color));
-                for (int k = 0; k < op_len; k++) {
-                    mvaddch(screen_row, col++, line[i + k]);
-                }
-                attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : op_color));
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                i += op_len;
-                continue;
-            }
-
-            
-            if (isdigit((unsigned char)ch) || (ch == '-' && i + 1 < len && isdigit((unsigned char)line[i + 1]))) {
-                int num_start = i;
-                if (ch == '0' && i + 1 < len && (line[i + 1] == 'x' || line[i + 1] == 'X')) {
-                    i += 2;
-                    while (i < normal_end && isxdigit((unsigned char)line[i])) i++;
-                } else if (ch == '0' && i + 1 < len && (line[i + 1] == 'b' || line[i + 1] == 'B')) {
-                    i += 2;
-                    while (i < normal_end && (line[i] == '0' || line[i] == '1')) i++;
-                } else if (ch == '0' && i + 1 < len && isdigit((unsigned char)line[i + 1])) {
+            if (n > 0 && t->kind == LANG_LINE_COMMENT) {
+                if ((lang->features & LF_COMMENT_NEEDS_SPACE) && i > 0 && !isspace((unsigned char)line[i - 1])) {
                     i++;
-                    while (i < normal_end && line[i] >= '0' && line[i] <= '7') i++;
-                } else {
-                    int has_dot = 0, has_e = 0;
-                    while (i < normal_end && (isdigit((unsigned char)line[i]) ||
-                            (line[i] == '.' && !has_dot) ||
-                            ((line[i] == 'e' || line[i] == 'E') && !has_e))) {
-                        if (line[i] == '.') has_dot = 1;
-                        if (line[i] == 'e' || line[i] == 'E') {
-                            has_e = 1;
-                            if (i + 1 < normal_end && (line[i + 1] == '+' || line[i + 1] == '-')) i++;
-                        }
-                        i++;
-                    }
-                }
-                int seg_len = i - num_start;
-                int num_color = get_hierarchical_color(state, "constant.numeric");
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : num_color));
-                mvprintw(screen_row, col, "%.*s", seg_len, &line[num_start]);
-                col += seg_len;
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                continue;
-            }
-
-            
-            if (ch == '"' || ch == '\'') {
-                char quote = ch;
-                int start = i++;
-                int escaped = 0;
-                while (i < normal_end) {
-                    if (line[i] == '\\' && !escaped) { escaped = 1; i++; }
-                    else if (line[i] == quote && !escaped) { i++; break; }
-                    else { escaped = 0; i++; }
-                }
-                int str_color = get_hierarchical_color(state, "string");
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : str_color));
-                mvprintw(screen_row, col, "%.*s", i - start, &line[start]);
-                col += (i - start);
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                continue;
-            }
-
-            
-            if (isalpha((unsigned char)ch) || ch == '_' || ch == '$') {
-                int start = i;
-                while (i < normal_end && (isalnum((unsigned char)line[i]) || line[i] == '_' || line[i] == '$')) i++;
-                int word_len = i - start;
-                char word[64] = {0};
-                if (word_len < (int)sizeof(word)) {
-                    strncpy(word, &line[start], word_len);
-                }
-
-                int color = get_vscode_scope_color(state, word, start, line, line_num);
-                if (color == COLOR_DEFAULT) {
-                    color = get_hierarchical_color(state, "variable");
-                }
-
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : color));
-                mvprintw(screen_row, col, "%.*s", word_len, &line[start]);
-                col += word_len;
-                if (is_selected) {
-                    attroff(A_BOLD);
-                }
-                continue;
-            }
-
-            
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-            mvaddch(screen_row, col++, ch);
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-            if (is_selected) {
-                attroff(A_BOLD);
-            }
-            i++;
-        }
-
-        
-        int comment_len = end_col - comment_start;
-        if (comment_len > 0) {
-            int is_selected_comment = has_selection && comment_start >= sel_start_x && comment_start < sel_end_x;
-            if (is_selected_comment) {
-                attron(A_BOLD);
-            }
-            attron(COLOR_PAIR(is_selected_comment ? COLOR_SELECTION : COLOR_OPERATOR));
-            mvprintw(screen_row, col, "%.*s", comment_len, &line[comment_start]);
-            col += comment_len;
-            attroff(COLOR_PAIR(is_selected_comment ? COLOR_SELECTION : COLOR_OPERATOR));
-            if (is_selected_comment) {
-                attroff(A_BOLD);
-            }
-        }
-        return;
-    }
-
-    for (int i = start_col; i < end_col && col < max_x - 1; ) {
-        char ch = line[i];
-
-        
-        int is_selected = has_selection && i >= sel_start_x && i < sel_end_x;
-
-        
-        if (in_block_comment) {
-            int close_pos = -1;
-            for (int j = i; j < end_col - 1; j++) {
-                if (line[j] == '*' && line[j + 1] == '/') { close_pos = j; break; }
-            }
-            int seg_len;
-            if (close_pos >= 0) {
-                seg_len = (close_pos + 2) - i;
-                in_block_comment = 0; 
-            } else {
-                seg_len = end_col - i;
-            }
-            int cmt_color = get_hierarchical_color(state, "comment");
-            const char* font_style = get_dynamic_font_style(state, "comment");
-
-            
-            if (strcmp(font_style, "italic") == 0) {
-                attron(A_DIM);  
-            }
-
-            if (is_selected) attron(A_REVERSE); else attron(COLOR_PAIR(cmt_color));
-            mvprintw(screen_row, col, "%.*s", seg_len, &line[i]);
-            col += seg_len;
-            i += seg_len;
-            if (is_selected) attroff(A_REVERSE); else attroff(COLOR_PAIR(cmt_color));
-
-            
-            if (strcmp(font_style, "italic") == 0) {
-                attroff(A_DIM);
-            }
-            continue;
-        }
-
-        
-        if (isspace((unsigned char)ch)) {
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-            mvaddch(screen_row, col++, ch);
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-            i++;
-            continue;
-        }
-
-        
-        if (ch == '(' || ch == ')' || ch == '[' || ch == ']' || ch == '{' || ch == '}' ||
-            ch == '.' || ch == ',' || ch == ';' || ch == '<' || ch == '>') {
-            const char* scope = "punctuation";
-            if (ch == '(' || ch == ')') scope = "punctuation.parenthesis";
-            else if (ch == '[' || ch == ']') scope = "punctuation.bracket";
-            else if (ch == '{' || ch == '}') scope = "punctuation.curly";
-            else if (ch == '<' || ch == '>') scope = "punctuation.angle";
-            else if (ch == '.') scope = "punctuation.dot";
-            else if (ch == ',') scope = "punctuation.comma";
-            else if (ch == ';') scope = "punctuation.semicolon";
-
-            int pcolor = get_hierarchical_color(state, scope);
-            if (pcolor == COLOR_DEFAULT) pcolor = get_hierarchical_color(state, "punctuation");
-            if (pcolor == COLOR_DEFAULT) pcolor = get_hierarchical_color(state, "keyword.operator");
-
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : pcolor));
-            mvaddch(screen_row, col++, ch);
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : pcolor));
-            i++;
-            continue;
-        }
-
-        
-        int op_len = 0;
-        if (ch == '=' || ch == '!' || ch == '<' || ch == '>' || ch == '+' || ch == '-' ||
-            ch == '*' || ch == '/' || ch == '%' || ch == '&' || ch == '|' || ch == '^' ||
-            ch == '~' || ch == '?' || ch == ':') {
-            if (i + 1 < end_col) {
-                char next = line[i + 1];
-                if ((ch == '=' && (next == '=' || next == '+' || next == '-' || next == '*' || next == '/' || next == '%' || next == '&' || next == '|' || next == '^' || next == '<' || next == '>')) ||
-                    (ch == '+' && next == '+') ||
-                    (ch == '-' && next == '-') ||
-                    (ch == '&' && next == '&') ||
-                    (ch == '|' && next == '|') ||
-                    (ch == '<' && (next == '<' || next == '=')) ||
-                    (ch == '>' && (next == '>' || next == '='))) {
-                    op_len = 2;
-                } else if (i + 2 < end_col && ch == '>' && line[i+1] == '>' && line[i+2] == '=') {
-                    op_len = 3;
-                } else if (i + 2 < end_col && ch == '<' && line[i+1] == '<' && line[i+2] == '=') {
-                    op_len = 3;
-                }
-            }
-            if (op_len == 0) op_len = 1;
-
-            
-            if (ch == '/' && i + 1 < end_col && line[i + 1] == '/') {
-                int cmt_color = get_hierarchical_color(state, "comment");
-                const char* font_style = get_dynamic_font_style(state, "comment");
-
-                
-                if (strcmp(font_style, "italic") == 0) {
-                    attron(A_DIM);  
-                }
-
-                attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-                mvprintw(screen_row, col, "%.*s", end_col - i, &line[i]);
-                col += (end_col - i);
-                i = end_col;
-                attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-
-                
-                if (strcmp(font_style, "italic") == 0) {
-                    attroff(A_DIM);
+                    continue;
                 }
+                span_push(out, i, len - i, COLOR_COMMENT, 0);
                 break;
             }
-            if (ch == '/' && i + 1 < end_col && line[i + 1] == '*') {
-                int j = i + 2;
-                int closed = -1;
-                while (j < end_col - 1) {
-                    if (line[j] == '*' && line[j + 1] == '/') { closed = j; break; }
-                    j++;
-                }
-                int cmt_color = get_hierarchical_color(state, "comment");
-                if (closed >= 0) {
-                    int cmt_len = (closed + 2) - i;
-                    attron(A_DIM);
-                    attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-                    mvprintw(screen_row, col, "%.*s", cmt_len, &line[i]);
-                    col += cmt_len;
-                    i += cmt_len;
-                    attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-                    attroff(A_DIM);
+            if (n > 0 && t->kind == LANG_HEREDOC) {
+                int j = i + n;
+                if (j < len && (line[j] == '-' || line[j] == '~')) j++;
+                span_push(out, i, j - i, COLOR_OPERATOR, 0);
+                while (j < len && (line[j] == ' ' || line[j] == '\t')) j++;
+                int marker = j;
+                char quote = j < len && (line[j] == '\'' || line[j] == '"') ? line[j++] : '\0';
+                int word = j;
+                while (j < len && (isalnum((unsigned char)line[j]) || line[j] == '_')) j++;
+                if (j > word) {
+                    if (!out) heredoc = lex_make(LEX_HEREDOC, line + word, j - word);
+                    if (quote && j < len && line[j] == quote) j++;
+                    span_push(out, marker, j - marker, COLOR_STRING, 0);
+                    i = j;
                 } else {
-                    
-                    int cmt_len = end_col - i;
-                    attron(A_DIM);
-                    attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-                    mvprintw(screen_row, col, "%.*s", cmt_len, &line[i]);
-                    col += cmt_len;
-                    i = end_col;
-                    attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-                    attroff(A_DIM);
-                    
+                    i += n;
                 }
                 continue;
             }
-
-            int op_color = get_hierarchical_color(state, "keyword.operator");
-            if (op_color == COLOR_DEFAULT) op_color = get_hierarchical_color(state, "punctuation");
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : op_color));
-            for (int k = 0; k < op_len; k++) {
-                mvaddch(screen_row, col++, line[i + k]);
-            }
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : op_color));
-            i += op_len;
-            continue;
-        }
-
-        
-        if (isdigit((unsigned char)ch) || (ch == '-' && i + 1 < len && isdigit((unsigned char)line[i + 1]))) {
-            int num_start = i;
-            if (ch == '0' && i + 1 < len && (line[i + 1] == 'x' || line[i + 1] == 'X')) {
-                i += 2;
-                while (i < end_col && isxdigit((unsigned char)line[i])) i++;
-            } else if (ch == '0' && i + 1 < len && (line[i + 1] == 'b' || line[i + 1] == 'B')) {
-                i += 2;
-                while (i < end_col && (line[i] == '0' || line[i] == '1')) i++;
-            } else if (ch == '0' && i + 1 < len && isdigit((unsigned char)line[i + 1])) {
-                i++;
-                while (i < end_col && line[i] >= '0' && line[i] <= '7') i++;
-            } else {
-                int has_dot = 0, has_e = 0;
-                while (i < end_col && (isdigit((unsigned char)line[i]) ||
-                        (line[i] == '.' && !has_dot) ||
-                        ((line[i] == 'e' || line[i] == 'E') && !has_e))) {
-                    if (line[i] == '.') has_dot = 1;
-                    if (line[i] == 'e' || line[i] == 'E') {
-                        has_e = 1;
-                        if (i + 1 < end_col && (line[i + 1] == '+' || line[i + 1] == '-')) i++;
-                    }
-                    i++;
+            if (n > 0) {
+                // Block comments and strings
+                int is_comment = t->kind == LANG_BLOCK_COMMENT;
+                int escapes = t->kind == LANG_STRING;
+                int end = lex_find_close(line, len, i + n, t->close, escapes);
+                if (end >= 0) {
+                    span_push(out, i, end - i, is_comment ? COLOR_COMMENT : COLOR_STRING, 0);
+                    i = end;
+                    continue;
                 }
+                int open = is_comment || t->multiline || (escapes && len > 0 && line[len - 1] == '\\');
+                span_push(out, i, len - i, open ? (is_comment ? COLOR_COMMENT : COLOR_STRING) : COLOR_ERROR, 0);
+                if (!open) return heredoc;
+                if (out) return s;
+                return lex_make(is_comment ? LEX_BLOCK_COMMENT : t->kind == LANG_RAW_STRING ? LEX_RAW_STRING : LEX_STRING,
+                                t->close, (int)strlen(t->close));
             }
-            int seg_len = i - num_start;
-            int num_color = get_hierarchical_color(state, "constant.numeric");
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : num_color));
-            mvprintw(screen_row, col, "%.*s", seg_len, &line[num_start]);
-            col += seg_len;
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : num_color));
-            continue;
-        }
-
-        
-        if (ch == '"' || ch == '\'') {
-            char quote = ch;
-            int start = i++;
-            int escaped = 0;
-            while (i < end_col) {
-                if (line[i] == '\\' && !escaped) { escaped = 1; i++; }
-                else if (line[i] == quote && !escaped) { i++; break; }
-                else { escaped = 0; i++; }
-            }
-            int str_color = get_hierarchical_color(state, "string");
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : str_color));
-            mvprintw(screen_row, col, "%.*s", i - start, &line[start]);
-            col += (i - start);
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : str_color));
-            continue;
-        }
-
-        
-        if ((state->file_type == FILE_TYPE_PYTHON ||
-              state->file_type == FILE_TYPE_RUBY ||
-              state->file_type == FILE_TYPE_SHELL ||
-              state->file_type == FILE_TYPE_MAKEFILE) && ch == '#') {
-            int cmt_color = get_hierarchical_color(state, "comment");
-            const char* font_style = get_dynamic_font_style(state, "comment");
-
-            
-            if (strcmp(font_style, "italic") == 0) {
-                attron(A_DIM);  
-            }
-
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-            mvprintw(screen_row, col, "%.*s", end_col - i, &line[i]);
-            col += (end_col - i);
-            i = end_col;
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-
-            
-            if (strcmp(font_style, "italic") == 0) {
-                attroff(A_DIM);
-            }
-            break;
+            cls = lang->base_class[b];
         }
 
-        
-        if (state->file_type == FILE_TYPE_HTML && ch == '<' && i + 3 < len && strncmp(&line[i], "<!--", 4) == 0) {
-            int j = i + 4;
-            int endpos = -1;
-            while (j < end_col - 2) {
-                if (line[j] == '-' && line[j + 1] == '-' && line[j + 2] == '>') { endpos = j + 3; break; }
-                j++;
-            }
-            int cmt_color = get_hierarchical_color(state, "comment");
-            const char* font_style = get_dynamic_font_style(state, "comment");
-            int seg_len = (endpos >= 0 ? endpos : end_col) - i;
-
-
-            if (strcmp(font_style, "italic") == 0) {
-                attron(A_DIM);
-            }
-
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-            mvprintw(screen_row, col, "%.*s", seg_len, &line[i]);
-            col += seg_len;
-            i += seg_len;
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : cmt_color));
-
-
-            if (strcmp(font_style, "italic") == 0) {
-                attroff(A_DIM);
-            }
-            continue;
-        }
-
-        if (state->file_type == FILE_TYPE_JSON && ch == '"' && i < end_col) {
-            
-            int start = i++;
-            int escaped = 0;
-            while (i < end_col) {
-                if (line[i] == '\\' && !escaped) { escaped = 1; i++; }
-                else if (line[i] == '"' && !escaped) { i++; break; }
-                else { escaped = 0; i++; }
+        if (cls == LC_BRACKET) {
+            span_push(out, i, 1, COLOR_DELIMITER, HL_BRACKET);
+            i++;
+        } else if (cls == LC_DIGIT) {
+            i = lex_number(lang, line, len, i, out);
+        } else if (cls == LC_WORD) {
+            char raw[LEX_DELIM_SIZE];
+            int body;
+            if (lang->features && lex_raw_prefix(lang, line, len, i, raw, &body)) {
+                int end = lex_find_close(line, len, body, raw, 0);
+                span_push(out, i, (end < 0 ? len : end) - i, COLOR_STRING, 0);
+                if (end < 0) return out ? s : lex_make(LEX_RAW_STRING, raw, (int)strlen(raw));
+                i = end;
+                continue;
             }
-            int str_color = get_hierarchical_color(state, "string");
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : str_color));
-            mvprintw(screen_row, col, "%.*s", i - start, &line[start]);
-            col += (i - start);
-            continue;
-        }
-
-        
-        if (isalpha((unsigned char)ch) || ch == '_' || ch == '$') {
             int start = i;
-            while (i < end_col && (isalnum((unsigned char)line[i]) || line[i] == '_' || line[i] == '$')) i++;
-            int word_len = i - start;
-            char word[64] = {0};
-            if (word_len < (int)sizeof(word)) {
-                strncpy(word, &line[start], word_len);
-            }
-
-            int color = get_vscode_scope_color(state, word, start, line, line_num);
-            if (color == COLOR_DEFAULT) {
-                color = get_hierarchical_color(state, "variable");
+            while (i < len && (lang->byte_flags[(unsigned char)line[i]] & LB_WORD)) i++;
+            if (out) {
+                int kw = perfect_lookup(&lang->keywords, line + start, i - start);
+                span_push(out, start, i - start, keyword_color(kw, i < len && line[i] == '('), 0);
             }
+        } else {
+            i++;
+            while (i < len && lang->byte_class[(unsigned char)line[i]] == LC_GAP) i++;
+        }
+    }
+    return heredoc;
+}
 
-            
-            const char* font_style = "";
-            if (color != COLOR_DEFAULT) {
-                TokenInfo info;
-                analyze_token_context(state, line_num, start, i, &info);
-                if (strlen(info.scope) > 0) {
-                    font_style = get_dynamic_font_style(state, info.scope);
-                }
-            }
+/* Returns the state at the end of a line that starts in state s. */
+static unsigned int lex_run(EditorState* state, const char* line, int len, unsigned int s)
+{
+    const Language* lang = language_get(state->file_type);
+    if (!lang) return LEX_NORMAL;
+    return lex_line(lang, line, len, s, LEX_KIND(s) == LEX_NORMAL ? "" : lex_delims[LEX_DELIM(s)], NULL);
+}
 
-            
-            if (strcmp(font_style, "underline") == 0) {
-                attron(A_UNDERLINE);
-            }
+/*
+ * Brings the cached end-of-line states up to date for lines before
+ * line_num. Edits mark their line stale and lower lex_valid; relexing stops
+ * as soon as an unedited line ends in the same state it did before. Returns
+ * 1 when a known end state changed, which means rows below may need a repaint.
+ */
+int syntax_update_states(EditorState* state, int line_num)
+{
+    Document* doc = &state->doc;
+    if (line_num > state->line_count) line_num = state->line_count;
+    if (doc->lex_file_type != state->file_type) {
+        for (int i = 0; i < state->line_count; i++) doc->info[i].lex = LEX_UNKNOWN;
+        doc->lex_valid = 0;
+        doc->lex_file_type = state->file_type;
+    }
+
+    int damaged = 0;
+    int changed = 0;
+    int y = doc->lex_valid;
+    for (; y < line_num; y++) {
+        DocLineInfo* info = &doc->info[y];
+        if (!changed && !(info->lex & LEX_STALE)) continue;
+        unsigned int start = y > 0 ? doc->info[y - 1].lex : LEX_NORMAL;
+        unsigned int end = lex_run(state, state->lines[y], info->len, start);
+        changed = end != (info->lex & ~LEX_STALE);
+        if (changed && info->lex != LEX_UNKNOWN) damaged = 1;
+        info->lex = end;
+    }
+    if (changed && y < state->line_count) doc->info[y].lex |= LEX_STALE;
+    if (y > doc->lex_valid) doc->lex_valid = y;
+    return damaged;
+}
 
-            attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : color));
-            mvprintw(screen_row, col, "%.*s", word_len, &line[start]);
-            col += word_len;
-            attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : color));
+/* Lexer state at the start of line_num; brings earlier lines up to date first. */
+unsigned int syntax_line_state(EditorState* state, int line_num)
+{
+    syntax_update_states(state, line_num);
+    return line_num > 0 ? state->doc.info[line_num - 1].lex : LEX_NORMAL;
+}
 
-            
-            if (strcmp(font_style, "underline") == 0) {
-                attroff(A_UNDERLINE);
-            }
-            continue;
-        }
+/* Fills in everything about line_num the tokenizer needs besides its text. */
+void syntax_prepare_job(EditorState* state, int line_num, HighlightJob* job)
+{
+    unsigned int lex = syntax_line_state(state, line_num);
+    job->lex = lex;
+    job->file_type = state->file_type;
+    job->term[0] = '\0';
+    if (LEX_KIND(lex) != LEX_NORMAL) strcpy(job->term, lex_delims[LEX_DELIM(lex)]);
+}
 
-        
-        attron(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-        mvaddch(screen_row, col++, ch);
-        attroff(COLOR_PAIR(is_selected ? COLOR_SELECTION : COLOR_DEFAULT));
-        i++;
+/*
+ * Splits a line snapshot into colored spans. This runs on the highlight
+ * worker, so it only reads the job and the language tables: no ncurses and
+ * no EditorState. Returns the span count, or -1 when out of memory.
+ */
+int syntax_tokenize(const HighlightJob* job, HighlightSpan** spans_out)
+{
+    SpanList out;
+    memset(&out, 0, sizeof(out));
+    const Language* lang = language_get(job->file_type);
+    if (lang) lex_line(lang, job->text, job->len, job->lex, job->term, &out);
+    *spans_out = out.spans;
+    return out.failed ? -1 : out.count;
+}
+static void draw_plain_run(int screen_row, int col, const char* text, int len)
+{
+    if (!memchr(text, '\t', len)) {
+        mvaddnstr(screen_row, col, text, len);
+        return;
     }
-    
-    
-}
\ No newline at end of file
+    // A tab only takes one column here; the next character overwrites its expansion
+    for (int i = 0; i < len; i++) mvaddch(screen_row, col + i, text[i]);
+}
+
+/* Draws columns [offset, offset + width) of line_num from its highlight spans. */
+void syntax_draw_spans(EditorState* state, int line_num, const HighlightSpan* spans, int count,
+                       int screen_row, int screen_col, int offset, int width)
+{
+    const char* line = state->lines[line_num];
+    int end = offset + width;
+    if (end > state->doc.info[line_num].len) end = state->doc.info[line_num].len;
+
+    int pos = offset;
+    for (int k = 0; k < count && pos < end; k++) {
+        const HighlightSpan* span = &spans[k];
+        int span_end = span->start + span->len;
+        if (span_end <= pos) continue;
+        int start = span->start > pos ? span->start : pos;
+        if (start >= end) break;
+        if (start > pos) draw_plain_run(screen_row, screen_col + pos - offset, line + pos, start - pos);
+        if (span_end > end) span_end = end;
+
+        int pair = span->pair;
+        if ((span->flags & HL_BRACKET) && bracket_match(state, line_num, span->start, NULL, NULL) == 0) {
+            pair = COLOR_ERROR;
+        }
+        attron(COLOR_PAIR(pair));
+        mvaddnstr(screen_row, screen_col + start - offset, line + start, span_end - start);
+        attroff(COLOR_PAIR(pair));
+        pos = span_end;
+    }
+    if (pos < end) draw_plain_run(screen_row, screen_col + pos - offset, line + pos, end - pos);
+}
@@ -1,52 +1,445 @@
 #include "../core/editor.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 
-int parse_json_token_colors(const char* json_content, EditorState* state) {
-    if (!json_content || !state) {
-        return 0;
+// The theme most recently parsed; buffers opened later share it instead of reparsing.
+static Theme* shared_theme = NULL;
+
+typedef enum {
+    JSON_EOF,
+    JSON_ERROR,
+    JSON_OBJECT_BEGIN,
+    JSON_OBJECT_END,
+    JSON_ARRAY_BEGIN,
+    JSON_ARRAY_END,
+    JSON_COLON,
+    JSON_COMMA,
+    JSON_STRING,
+    JSON_LITERAL
+} JsonToken;
+
+/* Pull tokenizer over an in-memory document; string tokens are unescaped into text. */
+typedef struct {
+    const char* pos;
+    JsonToken token;
+    char* text;
+    int text_len, text_cap;
+} JsonReader;
+
+/* Interning table used while a Theme is being built; holds pool offsets, -1 when empty. */
+typedef struct {
+    int* slots;
+    int slot_mask;
+    int count;
+} ThemeBuilder;
+
+static int json_text_append(JsonReader* r, const char* s, int len)
+{
+    if (r->text_len + len + 1 > r->text_cap) {
+        int cap = r->text_cap ? r->text_cap : 256;
+        while (r->text_len + len + 1 > cap) cap *= 2;
+        char* text = realloc(r->text, cap);
+        if (!text) return -1;
+        r->text = text;
+        r->text_cap = cap;
+    }
+    memcpy(r->text + r->text_len, s, len);
+    r->text_len += len;
+    r->text[r->text_len] = '\0';
+    return 0;
+}
+
+static int json_hex4(const char* p)
+{
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+static JsonToken json_read_string(JsonReader* r)
+{
+    const char* p = r->pos + 1;
+    r->text_len = 0;
+    if (json_text_append(r, "", 0) < 0) return JSON_ERROR;
+
+    while (*p != '"') {
+        // Copy the run up to the next quote or escape in one go.
+        const char* run = p;
+        while (*p && *p != '"' && *p != '\\') p++;
+        if (json_text_append(r, run, (int)(p - run)) < 0) return JSON_ERROR;
+        if (*p == '\0') return JSON_ERROR;
+        if (*p != '\\') continue;
+
+        p++;
+        char c = *p++;
+        switch (c) {
+            case '"': case '\\': case '/': break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': {
+                int cp = json_hex4(p);
+                if (cp < 0) return JSON_ERROR;
+                p += 4;
+                if (cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+                    int lo = json_hex4(p + 2);
+                    if (lo >= 0xdc00 && lo < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        p += 6;
+                    }
+                }
+                char utf8[4];
+                int n;
+                if (cp < 0x80) {
+                    utf8[0] = (char)cp;
+                    n = 1;
+                } else if (cp < 0x800) {
+                    utf8[0] = (char)(0xc0 | (cp >> 6));
+                    utf8[1] = (char)(0x80 | (cp & 0x3f));
+                    n = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = (char)(0xe0 | (cp >> 12));
+                    utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf8[2] = (char)(0x80 | (cp & 0x3f));
+                    n = 3;
+                } else {
+                    utf8[0] = (char)(0xf0 | (cp >> 18));
+                    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+                    utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf8[3] = (char)(0x80 | (cp & 0x3f));
+                    n = 4;
+                }
+                if (json_text_append(r, utf8, n) < 0) return JSON_ERROR;
+                continue;
+            }
+            default: return JSON_ERROR;
+        }
+        if (json_text_append(r, &c, 1) < 0) return JSON_ERROR;
+    }
+    r->pos = p + 1;
+    return JSON_STRING;
+}
+
+// Advances to the next token. Comments are skipped, since VS Code themes are often JSONC.
+static JsonToken json_next(JsonReader* r)
+{
+    const char* p = r->pos;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+        if (p[0] == '/' && p[1] == '/') {
+            while (*p && *p != '\n') p++;
+        } else if (p[0] == '/' && p[1] == '*') {
+            const char* close = strstr(p + 2, "*/");
+            if (!close) return r->token = JSON_ERROR;
+            p = close + 2;
+        } else {
+            break;
+        }
+    }
+    r->pos = p + 1;
+
+    switch (*p) {
+        case '\0': r->pos = p; return r->token = JSON_EOF;
+        case '{': return r->token = JSON_OBJECT_BEGIN;
+        case '}': return r->token = JSON_OBJECT_END;
+        case '[': return r->token = JSON_ARRAY_BEGIN;
+        case ']': return r->token = JSON_ARRAY_END;
+        case ':': return r->token = JSON_COLON;
+        case ',': return r->token = JSON_COMMA;
+        case '"':
+            r->pos = p;
+            return r->token = json_read_string(r);
+        default:
+            if (*p == '-' || isalnum((unsigned char)*p)) {
+                while (*p == '-' || *p == '+' || *p == '.' || isalnum((unsigned char)*p)) p++;
+                r->pos = p;
+                return r->token = JSON_LITERAL;
+            }
+            return r->token = JSON_ERROR;
+    }
+}
+
+// Consumes the value whose first token is current.
+static int json_skip_value(JsonReader* r)
+{
+    if (r->token == JSON_STRING || r->token == JSON_LITERAL) return 0;
+    if (r->token != JSON_OBJECT_BEGIN && r->token != JSON_ARRAY_BEGIN) return -1;
+
+    int depth = 1;
+    while (depth > 0) {
+        switch (json_next(r)) {
+            case JSON_OBJECT_BEGIN: case JSON_ARRAY_BEGIN: depth++; break;
+            case JSON_OBJECT_END: case JSON_ARRAY_END: depth--; break;
+            case JSON_EOF: case JSON_ERROR: return -1;
+            default: break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Steps to the next member of the current object and reads the first token of its value.
+ * Returns 1 with the (possibly truncated) key in key, 0 at the closing brace, -1 on error.
+ */
+static int json_next_member(JsonReader* r, int* first, char* key, size_t key_size)
+{
+    json_next(r);
+    if (r->token == JSON_OBJECT_END) return 0;
+    if (!*first) {
+        if (r->token != JSON_COMMA) return -1;
+        // Tolerate trailing commas.
+        if (json_next(r) == JSON_OBJECT_END) return 0;
+    }
+    *first = 0;
+    if (r->token != JSON_STRING) return -1;
+    snprintf(key, key_size, "%s", r->text);
+    if (json_next(r) != JSON_COLON) return -1;
+    json_next(r);
+    return r->token == JSON_EOF || r->token == JSON_ERROR ? -1 : 1;
+}
+
+// Like json_next_member for array elements.
+static int json_next_element(JsonReader* r, int* first)
+{
+    json_next(r);
+    if (r->token == JSON_ARRAY_END) return 0;
+    if (!*first) {
+        if (r->token != JSON_COMMA) return -1;
+        if (json_next(r) == JSON_ARRAY_END) return 0;
+    }
+    *first = 0;
+    return r->token == JSON_EOF || r->token == JSON_ERROR ? -1 : 1;
+}
+
+// Slot holding s in the interning table, or the empty slot where it belongs.
+static int theme_intern_slot(const Theme* theme, const ThemeBuilder* b, const char* s, int len)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    int j = h & b->slot_mask;
+    for (; b->slots[j] >= 0; j = (j + 1) & b->slot_mask) {
+        const char* known = theme->pool + b->slots[j];
+        if (strncmp(known, s, len) == 0 && known[len] == '\0') break;
+    }
+    return j;
+}
+
+// Appends s to the pool unless an identical string is already there; returns its offset.
+static int theme_intern(Theme* theme, ThemeBuilder* b, const char* s, int len)
+{
+    if ((b->count + 1) * 2 > b->slot_mask) {
+        int mask = b->slots ? b->slot_mask * 2 + 1 : 255;
+        int* slots = malloc((mask + 1) * sizeof(int));
+        if (!slots) return -1;
+        memset(slots, -1, (mask + 1) * sizeof(int));
+        free(b->slots);
+        b->slots = slots;
+        b->slot_mask = mask;
+        for (int at = 0; at < theme->pool_len; at += (int)strlen(theme->pool + at) + 1) {
+            b->slots[theme_intern_slot(theme, b, theme->pool + at, (int)strlen(theme->pool + at))] = at;
+        }
     }
 
-    state->json_rules_count = 0;
-    const char *pos = json_content;
-    char buffer[1024];
+    int j = theme_intern_slot(theme, b, s, len);
+    if (b->slots[j] >= 0) return b->slots[j];
+
+    if (theme->pool_len + len + 1 > theme->pool_cap) {
+        int cap = theme->pool_cap ? theme->pool_cap : 1024;
+        while (theme->pool_len + len + 1 > cap) cap *= 2;
+        char* pool = realloc(theme->pool, cap);
+        if (!pool) return -1;
+        theme->pool = pool;
+        theme->pool_cap = cap;
+    }
+    int at = theme->pool_len;
+    memcpy(theme->pool + at, s, len);
+    theme->pool[at + len] = '\0';
+    theme->pool_len += len + 1;
+    b->slots[j] = at;
+    b->count++;
+    return at;
+}
 
-    while ((pos = strstr(pos, "\"scope\":"))) {
-        pos += 8;
-        while (*pos && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '"')) pos++;
+static int theme_add_rule(Theme* theme, int scope, int color, int font_style)
+{
+    if (theme->rule_count == theme->rule_cap) {
+        int cap = theme->rule_cap ? theme->rule_cap * 2 : 64;
+        ThemeRule* rules = realloc(theme->rules, cap * sizeof(ThemeRule));
+        if (!rules) return -1;
+        theme->rules = rules;
+        theme->rule_cap = cap;
+    }
+    ThemeRule* rule = &theme->rules[theme->rule_count++];
+    rule->scope = scope;
+    rule->color = color;
+    rule->font_style = font_style;
+    return 0;
+}
 
-        int i = 0;
-        while (*pos && *pos != '"' && i < (int)sizeof(buffer)-1) {
-            buffer[i++] = *pos++;
+// Interns the scopes of a "scope" value; a string may hold several selectors separated by commas.
+static int theme_collect_scopes(Theme* theme, ThemeBuilder* b, const char* text, int** scopes, int* count, int* cap)
+{
+    while (*text) {
+        while (*text == ',' || isspace((unsigned char)*text)) text++;
+        const char* end = text;
+        while (*end && *end != ',') end++;
+        const char* last = end;
+        while (last > text && isspace((unsigned char)last[-1])) last--;
+        if (last > text) {
+            if (*count == *cap) {
+                int grown = *cap ? *cap * 2 : 8;
+                int* list = realloc(*scopes, grown * sizeof(int));
+                if (!list) return -1;
+                *scopes = list;
+                *cap = grown;
+            }
+            int at = theme_intern(theme, b, text, (int)(last - text));
+            if (at < 0) return -1;
+            (*scopes)[(*count)++] = at;
         }
-        buffer[i] = '\0';
-
-        if (i > 0 && state->json_rules_count < MAX_JSON_RULES) {
-            const char *color_pos = pos;
-            while ((color_pos = strstr(color_pos, "\"foreground\":"))) {
-                color_pos += 13;
-                while (*color_pos && (*color_pos == ' ' || *color_pos == '\t' || *color_pos == '\n' || *color_pos == '"')) color_pos++;
-
-                int j = 0;
-                char color_buffer[16] = {0};
-                while (*color_pos && *color_pos != '"' && j < (int)sizeof(color_buffer)-1) {
-                    color_buffer[j++] = *color_pos++;
+        text = end;
+    }
+    return 0;
+}
+
+// Reads one tokenColors entry and emits a rule per scope selector.
+static int theme_parse_entry(Theme* theme, ThemeBuilder* b, JsonReader* r, int** scopes, int* scope_cap)
+{
+    if (r->token != JSON_OBJECT_BEGIN) return json_skip_value(r);
+
+    int scope_count = 0;
+    int color = -1, font_style = -1;
+    char key[32];
+    int first = 1;
+    int rc;
+    while ((rc = json_next_member(r, &first, key, sizeof(key))) > 0) {
+        if (strcmp(key, "scope") == 0 && r->token == JSON_STRING) {
+            if (theme_collect_scopes(theme, b, r->text, scopes, &scope_count, scope_cap) < 0) return -1;
+        } else if (strcmp(key, "scope") == 0 && r->token == JSON_ARRAY_BEGIN) {
+            int first_scope = 1;
+            while ((rc = json_next_element(r, &first_scope)) > 0) {
+                if (r->token != JSON_STRING) {
+                    if (json_skip_value(r) < 0) return -1;
+                    continue;
                 }
-                color_buffer[j] = '\0';
-
-                if (j > 0) {
-                    strncpy(state->json_scopes[state->json_rules_count], buffer, MAX_SCOPE_LENGTH-1);
-                    state->json_scopes[state->json_rules_count][MAX_SCOPE_LENGTH-1] = '\0';
-                    strncpy(state->json_colors[state->json_rules_count], color_buffer, MAX_COLOR_LENGTH-1);
-                    state->json_colors[state->json_rules_count][MAX_COLOR_LENGTH-1] = '\0';
-                    state->json_font_styles[state->json_rules_count][0] = '\0';
-                    state->json_rules_count++;
+                if (theme_collect_scopes(theme, b, r->text, scopes, &scope_count, scope_cap) < 0) return -1;
+            }
+            if (rc < 0) return -1;
+        } else if (strcmp(key, "settings") == 0 && r->token == JSON_OBJECT_BEGIN) {
+            int first_setting = 1;
+            while ((rc = json_next_member(r, &first_setting, key, sizeof(key))) > 0) {
+                if (r->token == JSON_STRING && strcmp(key, "foreground") == 0) {
+                    color = theme_intern(theme, b, r->text, r->text_len);
+                    if (color < 0) return -1;
+                } else if (r->token == JSON_STRING && strcmp(key, "fontStyle") == 0) {
+                    font_style = theme_intern(theme, b, r->text, r->text_len);
+                    if (font_style < 0) return -1;
+                } else if (json_skip_value(r) < 0) {
+                    return -1;
+                }
+            }
+            if (rc < 0) return -1;
+        } else if (json_skip_value(r) < 0) {
+            return -1;
+        }
+    }
+    if (rc < 0) return -1;
+    if (color < 0 && font_style < 0) return 0;
+
+    int none = theme_intern(theme, b, "", 0);
+    if (none < 0) return -1;
+    for (int i = 0; i < scope_count; i++) {
+        if (theme_add_rule(theme, (*scopes)[i], color >= 0 ? color : none,
+                           font_style >= 0 ? font_style : none) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Single pass over the document: only the top-level tokenColors array is compiled. */
+static Theme* theme_parse(const char* json_content)
+{
+    Theme* theme = calloc(1, sizeof(Theme));
+    if (!theme) return NULL;
+    theme->refs = 1;
+
+    ThemeBuilder b = {NULL, 0, 0};
+    JsonReader r = {json_content, JSON_EOF, NULL, 0, 0};
+    int* scopes = NULL;
+    int scope_cap = 0;
+    int ok = json_next(&r) == JSON_OBJECT_BEGIN;
+
+    char key[32];
+    int first = 1;
+    int rc = 0;
+    while (ok && (rc = json_next_member(&r, &first, key, sizeof(key))) > 0) {
+        if (strcmp(key, "tokenColors") == 0 && r.token == JSON_ARRAY_BEGIN) {
+            int first_entry = 1;
+            while ((rc = json_next_element(&r, &first_entry)) > 0) {
+                if (theme_parse_entry(theme, &b, &r, &scopes, &scope_cap) < 0) {
+                    ok = 0;
                     break;
                 }
             }
+            if (rc < 0) ok = 0;
+        } else if (json_skip_value(&r) < 0) {
+            ok = 0;
         }
     }
+    if (rc < 0) ok = 0;
+    free(scopes);
+    free(b.slots);
+    free(r.text);
+
+    if (!ok || theme->rule_count == 0) {
+        theme_release(theme);
+        return NULL;
+    }
+    return theme;
+}
+
+Theme* theme_shared(void)
+{
+    return shared_theme;
+}
+
+Theme* theme_retain(Theme* theme)
+{
+    if (theme) theme->refs++;
+    return theme;
+}
+
+void theme_release(Theme* theme)
+{
+    if (!theme || --theme->refs > 0) return;
+    if (theme == shared_theme) shared_theme = NULL;
+    scope_cache_free(&theme->cache);
+    free(theme->rules);
+    free(theme->pool);
+    free(theme);
+}
+
+int parse_json_token_colors(const char* json_content, EditorState* state) {
+    if (!json_content || !state) {
+        return 0;
+    }
 
-    state->json_loaded = (state->json_rules_count > 0);
-    return state->json_loaded;
-}
\ No newline at end of file
+    Theme* theme = theme_parse(json_content);
+    theme_release(state->theme);
+    state->theme = theme;
+    if (theme) shared_theme = theme;
+    return theme != NULL;
+}
@@ -1,8 +1,21 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include "../core/editor.h"
 #include "../core/plugin.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bracketed paste is read straight from the terminal in chunks of this size
+#define PASTE_READ_CHUNK  (64 * 1024)
+// Whole lines go into the document once this much text is buffered
+#define PASTE_FEED_BYTES  (8 * 1024 * 1024)
+// A paste whose end marker does not arrive within this time is taken as done
+#define PASTE_IDLE_MS     1000
+#define PASTE_PROGRESS_MS 100
 
 void render_screen(EditorState * state);
 
@@ -11,123 +24,10 @@ static void paste_from_string(EditorState * state, const char * clipboard_conten
 
 void delete_current_line(EditorState * state);
 void handle_mouse_event(EditorState * state);
-static char* internal_clipboard = NULL;
-extern char* internal_clipboard;
 
 static int dragging = 0;
 static int selection_started_with_shift = 0;
 
-char* get_system_clipboard()
-{
-    
-    if (internal_clipboard && *internal_clipboard) {
-        return strdup(internal_clipboard);
-    }
-
-    
-    FILE* fp;
-    int is_wayland = getenv("WAYLAND_DISPLAY") != NULL;
-
-    if (is_wayland) 
-    {
-        fp = popen("wl-paste 2>/dev/null", "r");
-        if (fp) {
-            char buffer[1024 * 1024];
-            size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-            pclose(fp);
-            if (len > 0) {
-                buffer[len] = '\0';
-                return strdup(buffer);
-            }
-        }
-    }
-
-    fp = popen("xclip -selection clipboard -o 2>/dev/null", "r");
-    if (fp) {
-        char buffer[1024 * 1024];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-        pclose(fp);
-        if (len > 0) {
-            buffer[len] = '\0';
-            return strdup(buffer);
-        }
-    }
-
-    fp = popen("xclip -selection primary -o 2>/dev/null", "r");
-    if (fp) {
-        char buffer[1024 * 1024];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-        pclose(fp);
-        if (len > 0) {
-            buffer[len] = '\0';
-            return strdup(buffer);
-        }
-    }
-
-    if (!is_wayland) 
-    {
-        fp = popen("wl-paste 2>/dev/null", "r");
-        if (fp) {
-            char buffer[1024 * 1024];
-            size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-            pclose(fp);
-            if (len > 0) {
-                buffer[len] = '\0';
-                return strdup(buffer);
-            }
-        }
-    }
-
-    fp = popen("xsel --clipboard --output 2>/dev/null", "r");
-    if (fp) {
-
-        char buffer[1024 * 1024];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-        pclose(fp);
-        if (len > 0) {
-            buffer[len] = '\0';
-            return strdup(buffer);
-        }
-    }
-
-    fp = popen("xsel --primary --output 2>/dev/null", "r");
-    if (fp) 
-    {
-        char buffer[1024 * 1024];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-        pclose(fp);
-        if (len > 0) {
-            buffer[len] = '\0';
-            return strdup(buffer);
-        }
-    }
-
-    fp = popen("termux-clipboard-get 2>/dev/null", "r");
-    if (fp) 
-    {
-        char buffer[1024 * 1024];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-        pclose(fp);
-        if (len > 0) {
-            buffer[len] = '\0';
-            return strdup(buffer);
-        }
-    }
-
-    fp = popen("pbpaste 2>/dev/null", "r");
-    if (fp) 
-    {
-        char buffer[1024 * 1024];
-        size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
-        pclose(fp);
-        if (len > 0) {
-            buffer[len] = '\0';
-            return strdup(buffer);
-        }
-    }
-
-    return NULL;
-}
 void handle_input(EditorState* state, int ch)
 {
 
@@ -165,13 +65,13 @@ void handle_input(EditorState* state, int ch)
                         // Navigate to previous match
                         if (state->find_match_count > 0) {
                                 state->find_current_match = (state->find_current_match - 1 + state->find_match_count) % state->find_match_count;
-                                int line = state->find_match_lines[state->find_current_match];
-                                int pos = state->find_match_positions[state->find_current_match];
+                                int line = state->find_matches[state->find_current_match].line;
+                                int pos = state->find_matches[state->find_current_match].col;
                                 state->cursor_y = line;
                                 state->cursor_x = pos;
                                 state->select_start_x = pos;
                                 state->select_start_y = line;
-                                state->select_end_x = pos + strlen(state->find_search_term);
+                                state->select_end_x = pos + state->find_matches[state->find_current_match].len;
                                 state->select_end_y = line;
                                 // Adjust scroll
                                 int max_y, max_x;
@@ -206,13 +106,13 @@ void handle_input(EditorState* state, int ch)
                         // Navigate to next match
                         if (state->find_match_count > 0) {
                                 state->find_current_match = (state->find_current_match + 1) % state->find_match_count;
-                                int line = state->find_match_lines[state->find_current_match];
-                                int pos = state->find_match_positions[state->find_current_match];
+                                int line = state->find_matches[state->find_current_match].line;
+                                int pos = state->find_matches[state->find_current_match].col;
                                 state->cursor_y = line;
                                 state->cursor_x = pos;
                                 state->select_start_x = pos;
                                 state->select_start_y = line;
-                                state->select_end_x = pos + strlen(state->find_search_term);
+                                state->select_end_x = pos + state->find_matches[state->find_current_match].len;
                                 state->select_end_y = line;
                                 // Adjust scroll
                                 int max_y, max_x;
@@ -336,14 +236,8 @@ void handle_input(EditorState* state, int ch)
                         state->find_mode = 0;
                         state->find_escape_pressed = 0;
                         // Free the match data
-                        if (state->find_match_lines) {
-                                free(state->find_match_lines);
-                                state->find_match_lines = NULL;
-                        }
-                        if (state->find_match_positions) {
-                                free(state->find_match_positions);
-                                state->find_match_positions = NULL;
-                        }
+                        free(state->find_matches);
+                        state->find_matches = NULL;
                         state->find_match_count = 0;
                         return;
                 } else if (state->find_mode) {
@@ -375,101 +269,41 @@ void handle_input(EditorState* state, int ch)
                                         split_pair = 1;
                                         closing_char = after;
                                         
-                                        int remove_start = state->cursor_x;
-                                        int remove_end = after_pos + 1;
-                                        memmove(&line[remove_start], &line[remove_end], strlen(line) - remove_end + 1);
+                                        doc_delete_text(state, state->cursor_y, state->cursor_x, after_pos + 1 - state->cursor_x);
+                                        line = state -> lines[state -> cursor_y];
+                                }
+                        }
+
+                        int line_len = doc_line_length(state, state->cursor_y);
+                        int base_indent = 0;
+                        if (state->auto_tabbing_enabled) {
+                                while (base_indent < line_len && (line[base_indent] == ' ' || line[base_indent] == '\t')) {
+                                        base_indent++;
                                 }
                         }
 
+                        int y = state->cursor_y;
                         if (split_pair) {
                                 
-                                if (state->line_count + 1 >= MAX_LINES) {
-                                        show_status(state, "Error: Maximum line count reached (1,000,000 lines)");
-                                        break;
-                                }
-                                char * empty_line = (char * ) malloc(MAX_LINE_LENGTH);
-                                if (!empty_line) {
+                                if (doc_insert_line(state, y + 1, line, base_indent) != 0 ||
+                                    doc_insert_text(state, y + 1, base_indent, &closing_char, 1) != 0 ||
+                                    doc_insert_line(state, y + 1, line, base_indent) != 0 ||
+                                    doc_insert_text(state, y + 1, base_indent + state->tab_size, "", 0) != 0) {
                                         show_status(state, "Memory allocation failed");
                                         break;
                                 }
-                                char * closing_line = (char * ) malloc(MAX_LINE_LENGTH);
-                                if (!closing_line) {
-                                        free(empty_line);
-                                        show_status(state, "Memory allocation failed");
-                                        break;
-                                }
-
-                                
-                                int base_indent = 0;
-                                if (state->auto_tabbing_enabled) {
-                                        while (base_indent < strlen(line) && (line[base_indent] == ' ' || line[base_indent] == '\t')) {
-                                                base_indent++;
-                                        }
-                                }
-
-                                
-                                int indent_len = 0;
-                                for (int i = 0; i < base_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-                                        empty_line[indent_len++] = line[i];
-                                }
-                                for (int i = 0; i < state->tab_size && indent_len < MAX_LINE_LENGTH - 1; i++) {
-                                        empty_line[indent_len++] = ' ';
-                                }
-                                empty_line[indent_len] = '\0';
-
-                                
-                                indent_len = 0;
-                                for (int i = 0; i < base_indent && indent_len < MAX_LINE_LENGTH - 1; i++) {
-                                        closing_line[indent_len++] = line[i];
-                                }
-                                closing_line[indent_len++] = closing_char;
-                                closing_line[indent_len] = '\0';
-
-                                
-                                for (int i = state -> line_count + 1; i > state -> cursor_y + 2; i--) {
-                                        state -> lines[i] = state -> lines[i - 2];
-                                }
-                                state -> lines[state -> cursor_y + 1] = empty_line;
-                                state -> lines[state -> cursor_y + 2] = closing_line;
-                                state -> line_count += 2;
                                 state -> cursor_y++;
                                 state -> cursor_x = base_indent + state->tab_size; 
                                 move_cursor(state, 0, 0);
                                 update_dirty_status(state);
                         } else {
                                 
-                                if (state->line_count >= MAX_LINES) {
-                                        show_status(state, "Error: Maximum line count reached (1,000,000 lines)");
-                                        break;
-                                }
-                                char* new_line_str = (char*)malloc(MAX_LINE_LENGTH);
-                                if (!new_line_str) {
+                                if (doc_insert_line(state, y + 1, line, base_indent) != 0) {
                                         show_status(state, "Memory allocation failed");
                                         break;
                                 }
-
-                                
-                                int indent_len = 0;
-                                if (state->auto_tabbing_enabled) {
-                                        char *current_line = state->lines[state->cursor_y];
-                                        while (indent_len < (int)strlen(current_line) && (current_line[indent_len] == ' ' || current_line[indent_len] == '\t')) {
-                                                if (indent_len < MAX_LINE_LENGTH - 1) {
-                                                        new_line_str[indent_len] = current_line[indent_len];
-                                                        indent_len++;
-                                                } else {
-                                                        break;
-                                                }
-                                        }
-                                }
-                                new_line_str[indent_len] = '\0';
-
-                                for (int i = state->line_count; i > state->cursor_y + 1; i--) {
-                                        state->lines[i] = state->lines[i - 1];
-                                }
-                                state->lines[state->cursor_y + 1] = new_line_str;
-                                state->line_count++;
                                 state->cursor_y++;
-                                state->cursor_x = indent_len;
+                                state->cursor_x = base_indent;
                                 move_cursor(state, 0, 0);
                                 update_dirty_status(state);
                         }
@@ -542,14 +376,8 @@ void handle_input(EditorState* state, int ch)
                         state->find_mode = 0;
                         state->find_escape_pressed = 0;
                         // Free match data
-                        if (state->find_match_lines) {
-                                free(state->find_match_lines);
-                                state->find_match_lines = NULL;
-                        }
-                        if (state->find_match_positions) {
-                                free(state->find_match_positions);
-                                state->find_match_positions = NULL;
-                        }
+                        free(state->find_matches);
+                        state->find_matches = NULL;
                         state->find_match_count = 0;
                         state->find_search_term[0] = '\0';
                 } else if (state->find_mode) {
@@ -644,7 +472,7 @@ void handle_ctrl_keys(EditorState* state, int ch)
                 }
                 break;
         case 2:
-                
+                jump_to_matching_bracket(state);
                 break;
         case 3:
                 if (state -> select_mode) {
@@ -705,6 +533,12 @@ void handle_ctrl_keys(EditorState* state, int ch)
         case 14:  
                 load_plugin_interactive(state);
                 break;
+        case 26:
+                undo(state);
+                break;
+        case 25:
+                redo(state);
+                break;
         default:
                 break;
         }
@@ -723,7 +557,7 @@ void cut_text(EditorState* state)
         } else if (strlen(state -> lines[state -> cursor_y]) > 0) {
 
                 copy_to_system_clipboard(state -> lines[state -> cursor_y]);
-                state -> lines[state -> cursor_y][0] = '\0';
+                doc_set_line(state, state -> cursor_y, "", 0);
                 state -> cursor_x = 0;
                 state -> dirty = 1;
         } else {
@@ -740,19 +574,13 @@ void copy_text(EditorState* state)
 void delete_current_line(EditorState* state)
 {
         if (state -> line_count <= 1) {
-                state -> lines[0][0] = '\0';
+                doc_set_line(state, 0, "", 0);
                 state -> cursor_x = 0;
                 state -> dirty = 1;
                 return;
         }
 
-        free(state -> lines[state -> cursor_y]);
-
-        for (int i = state -> cursor_y; i < state -> line_count - 1; i++) {
-                state -> lines[i] = state -> lines[i + 1];
-        }
-
-        state -> line_count--;
+        doc_remove_lines(state, state -> cursor_y, 1);
 
         if (state -> cursor_y >= state -> line_count) {
                 state -> cursor_y = state -> line_count - 1;
@@ -767,143 +595,206 @@ void delete_current_line(EditorState* state)
         state -> dirty = 1;
 }
 
-static void paste_from_string(EditorState* state, const char* clipboard_content)
+/*
+ * A paste arrives as one or more pieces. The text up to the first newline
+ * goes in at the cursor; every later line is inserted below it, a batch of
+ * whole lines at a time.
+ */
+typedef struct PasteStream {
+        int started;  /* the first newline has been seen */
+        int at;       /* where the next line goes */
+} PasteStream;
+
+/*
+ * Adds len bytes of pasted text and returns how many were taken, or -1.
+ * Unless final, a trailing partial line is left for the next piece.
+ */
+static long paste_feed(EditorState* state, PasteStream* paste, const char* text, size_t len, int final)
+{
+        size_t taken = 0;
+        if (!paste->started) {
+                const char* nl = memchr(text, '\n', len);
+                size_t first = nl ? (size_t)(nl - text) : len;
+                if (doc_insert_text(state, state->cursor_y, state->cursor_x, text, (int)first) != 0) return -1;
+                state->cursor_x += first;
+                if (!nl) return (long)len;
+                paste->started = 1;
+                paste->at = state->cursor_y + 1;
+                taken = first + 1;
+        }
+
+        const char* rest = text + taken;
+        size_t n = len - taken;
+        if (!final) {
+                while (n > 0 && rest[n - 1] != '\n') n--;
+                if (n == 0) return (long)taken;
+                n--;
+        }
+        int before = state->line_count;
+        if (doc_insert_lines(state, paste->at, rest, (int)n) != 0) return -1;
+        paste->at += state->line_count - before;
+        return (long)(final ? len : taken + n + 1);
+}
+
+static int paste_begin(EditorState* state)
 {
-        
         if (!state || !state->lines || state->cursor_y >= state->line_count) {
                 show_status(state, "Invalid editor state for paste operation");
-                return;
+                return -1;
         }
+        if (state->cursor_x > doc_line_length(state, state->cursor_y)) {
+                state->cursor_x = doc_line_length(state, state->cursor_y);
+        }
+        return 0;
+}
+
+static void paste_end(EditorState* state)
+{
+        
+        if (state->line_count > 0 && doc_line_length(state, state->line_count - 1) > 0) {
+                doc_insert_line(state, state->line_count, "", 0);
+        }
+
+        state->cursor_x = doc_line_length(state, state->cursor_y);
+
+        state->dirty = 1;
+}
+
+static void paste_from_string(EditorState* state, const char* clipboard_content)
+{
+        if (paste_begin(state) != 0) return;
         if (!clipboard_content || clipboard_content[0] == '\0') {
                 show_status(state, "No content to paste");
                 return;
         }
 
-        
-        if (state->cursor_x > (int)strlen(state->lines[state->cursor_y])) {
-                state->cursor_x = strlen(state->lines[state->cursor_y]);
+        size_t total_len = strlen(clipboard_content);
+        if (total_len > INT_MAX) {
+                show_status(state, "Clipboard content too large to paste");
+                return;
         }
 
-        
-        size_t total_len = strlen(clipboard_content);
-        char *content_copy = (char*)malloc(total_len + 1);
-        if (!content_copy) {
+        PasteStream paste = { 0, 0 };
+        if (paste_feed(state, &paste, clipboard_content, total_len, 1) < 0) {
                 show_status(state, "Memory allocation failed for paste");
                 return;
         }
-        memcpy(content_copy, clipboard_content, total_len + 1);
-
-        int total_chars_pasted = 0;
-        int line_index = 0;
+        paste_end(state);
+}
 
+void paste_text(EditorState* state)
+{
         
-        size_t start = 0;
-        while (1) {
-                
-                size_t i = start;
-                while (i < total_len && content_copy[i] != '\n') i++;
-
-                size_t seg_len = i - start;
+        char *clipboard_content = get_system_clipboard();
+        if (!clipboard_content || clipboard_content[0] == '\0') {
+                if (clipboard_content) free(clipboard_content);
+                show_status(state, "No content to paste");
+                return;
+        }
 
-                if (line_index == 0) {
-                        
-                        char *current_line = state->lines[state->cursor_y];
-                        int current_len = strlen(current_line);
+        undo_begin(state);
+        paste_from_string(state, clipboard_content);
+        undo_end(state);
+        free(clipboard_content);
+        move_cursor(state, 0, 0);
+}
 
-                        if (current_len + (int)seg_len >= MAX_LINE_LENGTH) {
-                                show_status(state, "Content too large for current line");
-                                free(content_copy);
-                                return;
-                        }
+static long paste_now_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
 
-                        
-                        memmove(&current_line[state->cursor_x + seg_len],
-                                &current_line[state->cursor_x],
-                                current_len - state->cursor_x + 1);
-                        if (seg_len > 0) {
-                                memcpy(&current_line[state->cursor_x], &content_copy[start], seg_len);
-                        }
+/*
+ * Reads the body of a bracketed paste straight from the terminal, after
+ * curses has handed over the ESC [ 200 ~ that opens it. curses reads one byte
+ * at a time and has nothing buffered past that point.
+ */
+static void read_bracketed_paste(EditorState* state)
+{
+        static const char end_marker[] = "\033[201~";
+        const size_t marker_len = sizeof(end_marker) - 1;
 
-                        state->cursor_x += seg_len;
-                        total_chars_pasted += (int)seg_len;
-                } else {
-                        
-                        if (state->line_count >= MAX_LINES) {
-                                show_status(state, "Maximum line count reached during paste (1,000,000 lines)");
-                                free(content_copy);
-                                return;
+        size_t cap = 2 * PASTE_READ_CHUNK, len = 0, scanned = 0;
+        char* buf = (char*)malloc(cap);
+        if (!buf) {
+                show_status(state, "Memory allocation failed for paste");
+                return;
+        }
+        int begun = paste_begin(state) == 0;
+        int ok = begun;
+
+        PasteStream paste = { 0, 0 };
+        long total = 0;
+        long last_progress = paste_now_ms();
+        int done = 0;
+        while (!done) {
+                struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+                int ready = poll(&pfd, 1, PASTE_IDLE_MS);
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready <= 0) break;
+
+                if (ok && cap - len < PASTE_READ_CHUNK) {
+                        char* grown = (char*)realloc(buf, cap * 2);
+                        if (grown) {
+                                buf = grown;
+                                cap *= 2;
+                        } else {
+                                ok = 0;
                         }
+                }
+                // After a failure the rest is only read to find the end marker
+                if (!ok && len >= marker_len) {
+                        memmove(buf, buf + len - (marker_len - 1), marker_len - 1);
+                        len = scanned = marker_len - 1;
+                }
 
-                        char *new_line = (char*)malloc(MAX_LINE_LENGTH);
-                        if (!new_line) {
-                                free(content_copy);
-                                return;
-                        }
+                ssize_t got = read(STDIN_FILENO, buf + len, PASTE_READ_CHUNK);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) break;
+                total += got;
+
+                // The marker may straddle two reads
+                size_t from = scanned >= marker_len ? scanned - (marker_len - 1) : 0;
+                size_t old_len = len;
+                len += got;
+                char* end = memmem(buf + from, len - from, end_marker, marker_len);
+                if (end) {
+                        // Keys typed after the paste go back to curses
+                        for (char* p = buf + len - 1; p >= end + marker_len; p--) ungetch((unsigned char)*p);
+                        len = end - buf;
+                        done = 1;
+                }
+                for (size_t i = old_len; i < len; i++) {
+                        if (buf[i] == '\r') buf[i] = '\n';
+                }
+                scanned = len;
 
-                        if (seg_len > 0) {
-                                if (seg_len >= MAX_LINE_LENGTH) {
-                                        free(new_line);
-                                        show_status(state, "Pasted line exceeds maximum length");
-                                        free(content_copy);
-                                        return;
-                                }
-                                memcpy(new_line, &content_copy[start], seg_len);
-                                new_line[seg_len] = '\0';
+                if (ok && len >= PASTE_FEED_BYTES) {
+                        long taken = paste_feed(state, &paste, buf, len, 0);
+                        if (taken < 0) {
+                                ok = 0;
                         } else {
-                                
-                                new_line[0] = '\0';
+                                memmove(buf, buf + taken, len - taken);
+                                len = scanned = len - taken;
                         }
-
-                        
-                        for (int k = state->line_count; k > state->cursor_y + line_index; k--) {
-                                state->lines[k] = state->lines[k - 1];
-                        }
-                        state->lines[state->cursor_y + line_index] = new_line;
-                        state->line_count++;
-
-                        total_chars_pasted += (int)seg_len;
                 }
 
-                line_index++;
-
-                
-                if (i >= total_len) break;
-
-                
-                start = i + 1;
-                if (start > total_len) break;
-        }
-
-        
-        if (state->line_count > 0 && strlen(state->lines[state->line_count - 1]) > 0 && state->line_count < MAX_LINES) {
-                state->lines[state->line_count] = (char*)malloc(MAX_LINE_LENGTH);
-                if (state->lines[state->line_count]) {
-                        state->lines[state->line_count][0] = '\0';
-                        state->line_count++;
+                if (paste_now_ms() - last_progress >= PASTE_PROGRESS_MS) {
+                        mvprintw(getmaxy(stdscr) - 2, 0, "Pasting... %ld KB", total / 1024);
+                        clrtoeol();
+                        refresh();
+                        last_progress = paste_now_ms();
                 }
         }
 
-        state->cursor_x = strlen(state->lines[state->cursor_y]);
-
-        state->dirty = 1;
-
-
-        free(content_copy);
-}
-
-void paste_text(EditorState* state)
-{
-        
-        char *clipboard_content = get_system_clipboard();
-        if (!clipboard_content || clipboard_content[0] == '\0') {
-                if (clipboard_content) free(clipboard_content);
-                show_status(state, "No content to paste");
-                return;
-        }
-
-        paste_from_string(state, clipboard_content);
-        free(clipboard_content);
+        if (ok && paste_feed(state, &paste, buf, len, 1) < 0) ok = 0;
+        free(buf);
+        if (!begun) return;
+        paste_end(state);
         move_cursor(state, 0, 0);
+        if (!ok) show_status(state, "Memory allocation failed for paste");
 }
 
 static int try_handle_bracketed_paste(EditorState* state, int first_ch)
@@ -933,64 +824,7 @@ static int try_handle_bracketed_paste(EditorState* state, int first_ch)
                 return 0;
         }
 
-        size_t cap = 4096, len = 0;
-        char *buf = (char*)malloc(cap);
-        if (!buf) return 1; 
-
-        for (;;) {
-                int ch = getch();
-                if (ch == 27) {
-                        int d1 = getch();
-                        if (d1 == '[') {
-                                int d2 = getch();
-                                int d3 = getch();
-                                int d4 = getch();
-                                if (d2=='2' && d3=='0' && d4=='1') {
-                                        int d5 = getch();
-                                        if (d5 == '~') {
-                                                
-                                                break;
-                                        } else {
-                                                
-                                                if (len + 5 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; }
-                                                buf[len++] = 27; buf[len++] = '['; buf[len++] = '2'; buf[len++] = '0'; buf[len++] = '1';
-                                                
-                                                if (d5 != ERR) ungetch(d5);
-                                                continue;
-                                        }
-                                } else {
-                                        
-                                        if (len + 2 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; }
-                                        buf[len++] = 27; buf[len++] = '[';
-                                        if (d2 != ERR) { if (len + 1 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; } buf[len++] = (char)d2; }
-                                        if (d3 != ERR) { if (len + 1 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; } buf[len++] = (char)d3; }
-                                        if (d4 != ERR) { if (len + 1 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; } buf[len++] = (char)d4; }
-                                        continue;
-                                }
-                        } else {
-                                
-                                if (len + 2 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; }
-                                buf[len++] = 27;
-                                if (d1 != ERR) buf[len++] = (char)d1;
-                                continue;
-                        }
-                } else if (ch == ERR) {
-                        
-                        continue;
-                } else {
-                        
-                        if (ch == '\r') ch = '\n';
-                        if (len + 1 >= cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) return 1; }
-                        buf[len++] = (char)ch;
-                }
-        }
-
-        
-        if (len + 1 >= cap) { cap += 1; buf = (char*)realloc(buf, cap); if (!buf) return 1; }
-        buf[len] = '\0';
-
-        paste_from_string(state, buf);
-        free(buf);
+        read_bracketed_paste(state);
         return 1;
 }
 
@@ -5,23 +5,116 @@
 #define COLOR_SELECTION   29
 #define COLOR_ERROR       31
 
-char * get_system_clipboard();
+// How long a frame waits for the highlight worker before drawing plain text
+#define HIGHLIGHT_WAIT_MS 5
+
+// Columns kept free at the right of the Find and Replace prompts for the option flags
+#define FIND_FLAGS_WIDTH 17
+
+// Search-as-you-type works this long between looks for a key, and redraws every few slices
+#define FIND_SLICE_MS    8
+#define FIND_SHOW_SLICES 12
 
-void highlight_line(EditorState* state, int line_num, int screen_row, int line_num_width, int horizontal_scroll_offset);
 
 void find_all_occurrences(EditorState* state,
         const char* search_term);
 void navigate_matches(EditorState* state,
-        const char* search_term, int* match_lines, int* match_positions, int match_count);
+        const char* search_term, SearchMatch* matches, int match_count);
 void jump_to_match(EditorState* state, int line_num, int position);
 void replace_text_simple(EditorState* state,
         const char* search_term,
                 const char* replace_term);
 
-void render_screen(EditorState* state)
+static int visual_rows(EditorState* state, int line, int avail_width)
+{
+        int line_len = doc_line_length(state, line);
+        return line_len == 0 ? 1 : (line_len + avail_width - 1) / avail_width;
+}
+
+// Index of the first match at or after (line, col) in the sorted match list
+static int match_lower_bound(EditorState* state, int line, int col)
 {
-        erase();
+        int lo = 0, hi = state->find_match_count;
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                const SearchMatch* m = &state->find_matches[mid];
+                if (m->line < line || (m->line == line && m->col < col)) lo = mid + 1;
+                else hi = mid;
+        }
+        return lo;
+}
+
+// 1 selected, 3 the current match, 2 any other match, 0 plain
+static int cell_kind(EditorState* state, const RenderRow* row, int i)
+{
+        if (i >= row->sel_start && i < row->sel_end) return 1;
+
+        // Matches do not overlap, so their ends rise with their starts
+        int lo = row->find_first, hi = row->find_first + row->find_count;
+        while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                const SearchMatch* m = &state->find_matches[mid];
+                if (m->col + m->len <= i) lo = mid + 1;
+                else hi = mid;
+        }
+        if (lo == row->find_first + row->find_count || i < state->find_matches[lo].col) return 0;
+        return lo == row->find_current ? 3 : 2;
+}
+
+static void draw_text_row(EditorState* state, const RenderRow* row, int screen_row, int text_start_col, int avail_width)
+{
+        move(screen_row, 0);
+        clrtoeol();
+        if (row->line < 0) return;
+
+        char *line = state->lines[row->line];
+        int line_len = doc_line_length(state, row->line);
+
+        attron(COLOR_PAIR(28) | A_BOLD);
+        if (row->offset == 0) {
+                mvprintw(screen_row, 0, "%5d ", row->line + 1);
+        } else {
+                mvprintw(screen_row, 0, "  ->  ");
+        }
+        attroff(COLOR_PAIR(28) | A_BOLD);
+
+        if (line_len == 0) {
+                if (row->sel_start >= 0) {
+                        attron(A_REVERSE);
+                        mvaddch(screen_row, text_start_col, ' ');
+                        attroff(A_REVERSE);
+                }
+                return;
+        }
+
+        if (row->highlighted) {
+                const HighlightSpan* spans = NULL;
+                int count = highlight_spans(state, row->line, &spans);
+                syntax_draw_spans(state, row->line, spans, count, screen_row, text_start_col, row->offset, avail_width);
+                return;
+        }
 
+        // Draw runs of characters that share an attribute in one call
+        int end = row->offset + avail_width;
+        if (end > line_len) end = line_len;
+        int i = row->offset;
+        while (i < end) {
+                int kind = cell_kind(state, row, i);
+                int run = i + 1;
+                while (run < end && cell_kind(state, row, run) == kind) run++;
+
+                attr_t attr = kind == 1 ? A_REVERSE :
+                              kind == 2 ? A_UNDERLINE | A_BOLD :
+                              kind == 3 ? COLOR_PAIR(29) | A_BOLD : COLOR_PAIR(COLOR_DEFAULT);
+                attron(attr);
+                mvaddnstr(screen_row, text_start_col + i - row->offset, line + i, run - i);
+                attroff(attr);
+                i = run;
+        }
+}
+
+void render_screen(EditorState* state)
+{
         int max_y, max_x;
         getmaxyx(stdscr, max_y, max_x);
 
@@ -30,6 +123,10 @@ void render_screen(EditorState* state)
                 strcpy(cwd, "[Unable to get path]");
         }
 
+        for (int row = 0; row < 3 && row < max_y; row++) {
+                move(row, 0);
+                clrtoeol();
+        }
         attron(COLOR_PAIR(1) | A_BOLD);
         if (strlen(state -> filename) > 0) {
                 mvprintw(0, 0, "Current File: %s", state -> filename);
@@ -45,179 +142,140 @@ void render_screen(EditorState* state)
         attroff(COLOR_PAIR(1) | A_BOLD);
 
         const int line_num_width = 8;
-        const int start_line = state -> scroll_offset;
-        
-
         const int show_line_numbers = 1;
         const int text_start_col = show_line_numbers ? line_num_width - 2 : 0;
-        const int avail_width = max_x - text_start_col - 1;
+        int avail_width = max_x - text_start_col - 1;
+        if (avail_width < 1) avail_width = 1;
+
+        // Scroll before drawing so the frame already shows the cursor
+        int cursor_visual_row = 3;
+        for (int i = state->scroll_offset; i < state->cursor_y; i++) {
+                cursor_visual_row += visual_rows(state, i, avail_width);
+        }
+        if (doc_line_length(state, state->cursor_y) > 0) {
+                cursor_visual_row += state->cursor_x / avail_width;
+        }
+        while (cursor_visual_row >= max_y - 2 && state->scroll_offset < state->cursor_y) {
+                cursor_visual_row -= visual_rows(state, state->scroll_offset, avail_width);
+                state->scroll_offset++;
+        }
+        int screen_cursor_col = text_start_col + (state->cursor_x % avail_width);
+
+        // Rows are redrawn only when their line, wrap offset, content version
+        // or highlight spans changed, or something shared by all rows did.
+        RenderView view;
+        memset(&view, 0, sizeof(view));
+        view.max_x = max_x;
+        view.max_y = max_y;
+        view.syntax = state->syntax_enabled && state->syntax_display_enabled;
+        view.select_mode = state->select_mode;
+        view.find_mode = state->find_mode;
+        view.file_type = state->file_type;
+        view.theme_id = state->theme_id;
+        view.context_version = state->doc.context_version;
+        view.find_version = state->find_version;
+        if (memcmp(&view, &state->render_view, sizeof(view)) != 0) {
+                state->render_view = view;
+                state->render_invalid = 1;
+        }
+        if (state->render_row_count < max_y) {
+                RenderRow* rows = realloc(state->render_rows, (size_t)max_y * sizeof(RenderRow));
+                if (rows) {
+                        state->render_rows = rows;
+                        state->render_row_count = max_y;
+                }
+                state->render_invalid = 1;
+        }
 
-        char ** lines = state -> lines;
+        // Lex up to the bottom of the screen first; a changed end-of-line state
+        // repaints rows below it even when their own text is unchanged.
+        int highlighting = view.syntax && !state->select_mode && !state->find_mode;
+        if (highlighting && syntax_update_states(state, state->scroll_offset + max_y)) {
+                state->render_invalid = 1;
+        }
+
+        // Ask the worker for spans of visible lines that have none, and give
+        // it a moment so an edited line does not flash uncolored.
+        if (highlighting) {
+                update_syntax_highlighting(state);
+                highlight_sync(state);
+                int last = state->scroll_offset + max_y - 5;
+                if (last > state->line_count) last = state->line_count;
+                int queued = 0;
+                for (int y = state->scroll_offset; y < last; y++) {
+                        if (doc_line_length(state, y) > 0 && highlight_spans(state, y, NULL) < 0) {
+                                highlight_request(state, y);
+                                queued = 1;
+                        }
+                }
+                if (queued) {
+                        highlight_wait(state, HIGHLIGHT_WAIT_MS);
+                        update_syntax_highlighting(state);
+                }
+        }
+
+        int finding = state->find_mode && state->find_matches;
 
-        int screen_row = 3;
         int logical_line = state->scroll_offset;
         int offset_in_line = 0;
-        while (screen_row < max_y - 2 && logical_line < state->line_count) {
-                char *line = state->lines[logical_line];
-                int line_len = strlen(line);
-                
-                if (show_line_numbers) {
-                        attron(COLOR_PAIR(28) | A_BOLD);
-                        if (offset_in_line == 0) {
-                                mvprintw(screen_row, 0, "%5d ", logical_line + 1);
-                        } else {
-                                mvprintw(screen_row, 0, "  ->  ");
+        for (int screen_row = 3; screen_row < max_y - 2; screen_row++) {
+                RenderRow row;
+                memset(&row, 0, sizeof(row));
+                row.line = -1;
+                row.sel_start = row.sel_end = -1;
+                row.find_current = -1;
+
+                if (logical_line < state->line_count) {
+                        int line_len = doc_line_length(state, logical_line);
+                        row.line = logical_line;
+                        row.offset = offset_in_line;
+                        row.text = state->lines[logical_line];
+                        row.version = state->doc.info[logical_line].version;
+                        row.highlighted = highlighting && line_len > 0 &&
+                                          highlight_spans(state, logical_line, NULL) >= 0;
+                        if (state->select_mode &&
+                            logical_line >= state->select_start_y &&
+                            logical_line <= state->select_end_y) {
+                                row.sel_start = logical_line == state->select_start_y ? state->select_start_x : 0;
+                                row.sel_end = logical_line == state->select_end_y ? state->select_end_x : line_len;
                         }
-                        attroff(COLOR_PAIR(28) | A_BOLD);
-                }
-                
-                if (line_len > 0 && offset_in_line < line_len) {
-                        int start = offset_in_line;
-                        int end = start + avail_width;
-                        if (end > line_len) end = line_len;
-                        if (state->syntax_enabled && state->syntax_display_enabled && !state->select_mode && !state->find_mode) {
-                                highlight_line(state, logical_line, screen_row, text_start_col, offset_in_line);
-                        } else {
-                                
-                                int col = text_start_col;
-                                int i = start;
-                                while (i < end) {
-                                        int is_selected = state->select_mode &&
-                                                logical_line >= state->select_start_y &&
-                                                logical_line <= state->select_end_y &&
-                                                i >= (logical_line == state->select_start_y ? state->select_start_x : 0) &&
-                                                i < (logical_line == state->select_end_y ? state->select_end_x : line_len);
-                                        
-                                        // Check if this is the current find match
-                                        int is_find_match = 0;
-                                        if (state->find_mode && state->find_match_positions && state->find_match_lines) {
-                                                int term_len = strlen(state->find_search_term);
-                                                int current_pos = state->find_match_positions[state->find_current_match];
-                                                int current_match_line = state->find_match_lines[state->find_current_match];
-                                                int current_line = logical_line;
-                                                is_find_match = (current_line == current_match_line &&
-                                                                i >= current_pos &&
-                                                                i < current_pos + term_len);
-                                        }
-
-                                        if (is_selected) {
-                                                attron(A_REVERSE);
-                                        } else if (is_find_match) {
-                                                attron(COLOR_PAIR(29) | A_BOLD);  // Yellow for find match
-                                        } else {
-                                                attron(COLOR_PAIR(COLOR_DEFAULT));
-                                        }
-
-                                        mvaddch(screen_row, col++, line[i]);
-                                        if (is_selected) {
-                                                attroff(A_REVERSE);
-                                        } else if (is_find_match) {
-                                                attroff(COLOR_PAIR(29) | A_BOLD);
-                                        }
-                                        attroff(COLOR_PAIR(COLOR_DEFAULT));
-                                        i++;
+                        if (finding) {
+                                row.find_first = match_lower_bound(state, logical_line, 0);
+                                row.find_count = match_lower_bound(state, logical_line + 1, 0) - row.find_first;
+                                if (state->find_current_match >= row.find_first &&
+                                    state->find_current_match < row.find_first + row.find_count) {
+                                        row.find_current = state->find_current_match;
                                 }
                         }
-                        
-                        if (end == line_len) {
+
+                        if (offset_in_line + avail_width < line_len) {
+                                offset_in_line += avail_width;
+                        } else {
                                 logical_line++;
                                 offset_in_line = 0;
-                        } else {
-                                offset_in_line = end;
-                        }
-                } else {
-                        
-                        if (state->select_mode &&
-                            logical_line >= state->select_start_y &&
-                            logical_line <= state->select_end_y) {
-                            int is_selected = 1;
-                            if (is_selected) {
-                                attron(A_REVERSE);
-                            } else {
-                                attron(COLOR_PAIR(COLOR_DEFAULT));
-                            }
-                            mvaddch(screen_row, text_start_col, ' ');
-                            if (is_selected) {
-                                attroff(A_REVERSE);
-                            }
-                            attroff(COLOR_PAIR(COLOR_DEFAULT));
                         }
-                        
-                        logical_line++;
-                        offset_in_line = 0;
                 }
-                screen_row++;
-        }
-
 
-        
-        
-        int cursor_visual_row = 3;
-        int temp_logical = state->scroll_offset;
-        while (temp_logical < state->cursor_y) {
-                char *line = state->lines[temp_logical];
-                int line_len = strlen(line);
-                if (line_len == 0) {
-                        cursor_visual_row += 1; 
-                } else {
-                        int visual_rows = (line_len + avail_width - 1) / avail_width;
-                        cursor_visual_row += visual_rows;
+                if (screen_row < state->render_row_count) {
+                        RenderRow* cached = &state->render_rows[screen_row];
+                        if (!state->render_invalid && memcmp(cached, &row, sizeof(row)) == 0) continue;
+                        *cached = row;
                 }
-                temp_logical++;
+                draw_text_row(state, &row, screen_row, text_start_col, avail_width);
         }
-        
-        char *cursor_line = state->lines[state->cursor_y];
-        int cursor_line_len = strlen(cursor_line);
-        if (cursor_line_len == 0) {
-                cursor_visual_row += 0; 
-        } else {
-                int cursor_visual_in_line = state->cursor_x / avail_width;
-                cursor_visual_row += cursor_visual_in_line;
-        }
-        int screen_cursor_col = text_start_col + (state->cursor_x % avail_width);
+        state->render_invalid = state->render_row_count < max_y;
 
-        
-        if (cursor_visual_row >= max_y - 2) {
-            state->scroll_offset += 1;
-            if (state->scroll_offset > state->cursor_y) state->scroll_offset = state->cursor_y;
-            
-            cursor_visual_row = 3;
-            temp_logical = state->scroll_offset;
-            while (temp_logical < state->cursor_y) {
-                char *line = state->lines[temp_logical];
-                int line_len = strlen(line);
-                if (line_len == 0) {
-                    cursor_visual_row += 1; 
-                } else {
-                    int visual_rows = (line_len + avail_width - 1) / avail_width;
-                    cursor_visual_row += visual_rows;
-                }
-                temp_logical++;
-            }
-            
-            char *cursor_line = state->lines[state->cursor_y];
-            int cursor_line_len = strlen(cursor_line);
-            if (cursor_line_len == 0) {
-                cursor_visual_row += 0; 
-            } else {
-                int cursor_visual_in_line = state->cursor_x / avail_width;
-                cursor_visual_row += cursor_visual_in_line;
-            }
-        }
+        // Shown once the main loop has counted the loaded lines while idle
+        char words[24] = "...";
+        long word_count = doc_word_count(state);
+        if (word_count >= 0) snprintf(words, sizeof(words), "%ld", word_count);
 
-        int words = 0;
-        for (int i = 0; i < state->line_count; i++) {
-            char* line = state->lines[i];
-            int in_word = 0;
-            for (int j = 0; line[j] != '\0'; j++) {
-                if (isspace((unsigned char)line[j])) {
-                    in_word = 0;
-                } else if (!in_word) {
-                    in_word = 1;
-                    words++;
-                }
-            }
+        if (max_y >= 2) {
+                move(max_y - 2, 0);
+                clrtoeol();
         }
+        move(max_y - 1, 0);
+        clrtoeol();
 
         attron(COLOR_PAIR(1) | A_BOLD);
         const char* syntax_status = (state->syntax_enabled ? "ON" : "OFF");
@@ -227,7 +285,7 @@ void render_screen(EditorState* state)
         
         // Build status bar with or without occurences
         if (state->find_mode && state->find_match_count > 0) {
-                mvprintw(max_y - 1, 0, "Line: %d, Col: %d | %s%s | Mode: %s | Occurences: %d/%d | Syntax HL: %s | Auto Tabbing: %s | Sticky Cursor: %s | Autocomplete: %s | Words: %d",
+                mvprintw(max_y - 1, 0, "Line: %d, Col: %d | %s%s | Mode: %s | Occurences: %d/%d | Syntax HL: %s | Auto Tabbing: %s | Sticky Cursor: %s | Autocomplete: %s | Words: %s",
                           state->cursor_y + 1, state->cursor_x + 1,
                           state->filename[0] ? state->filename : "[Untitled]",
                           edited_indicator,
@@ -240,7 +298,7 @@ void render_screen(EditorState* state)
                           autocomplete_status,
                           words);
         } else {
-                mvprintw(max_y - 1, 0, "Line: %d, Col: %d | %s%s | Mode: %s | Syntax HL: %s | Auto Tabbing: %s | Sticky Cursor: %s | Autocomplete: %s | Words: %d",
+                mvprintw(max_y - 1, 0, "Line: %d, Col: %d | %s%s | Mode: %s | Syntax HL: %s | Auto Tabbing: %s | Sticky Cursor: %s | Autocomplete: %s | Words: %s",
                           state->cursor_y + 1, state->cursor_x + 1,
                           state->filename[0] ? state->filename : "[Untitled]",
                           edited_indicator,
@@ -257,6 +315,106 @@ void render_screen(EditorState* state)
         refresh();
 }
 
+/*
+ * Plugin render hooks draw over text rows after render_screen has cached
+ * them. The rows are read back before and after the hooks run, and every
+ * row a hook changed loses its cached state so the next frame repaints it.
+ */
+chtype* render_capture_rows(EditorState* state)
+{
+        int max_y, max_x;
+        getmaxyx(stdscr, max_y, max_x);
+        if (max_y - 2 > state->render_row_count) return NULL;
+        if (max_y - 2 <= 3 || max_x <= 0) return NULL;
+
+        int cur_y, cur_x;
+        getyx(stdscr, cur_y, cur_x);
+        chtype* rows = malloc((size_t)(max_y - 2) * (max_x + 1) * sizeof(chtype));
+        if (rows) {
+                for (int r = 3; r < max_y - 2; r++) {
+                        mvinchnstr(r, 0, rows + (size_t)r * (max_x + 1), max_x);
+                }
+        }
+        move(cur_y, cur_x);
+        return rows;
+}
+
+void render_damage_rows(EditorState* state, chtype* before)
+{
+        int max_y, max_x;
+        getmaxyx(stdscr, max_y, max_x);
+        chtype* row = before ? malloc((size_t)(max_x + 1) * sizeof(chtype)) : NULL;
+        if (!row || max_y - 2 > state->render_row_count) {
+                // Nothing to compare against; repaint every row
+                state->render_invalid = 1;
+                free(row);
+                free(before);
+                return;
+        }
+
+        int cur_y, cur_x;
+        getyx(stdscr, cur_y, cur_x);
+        for (int r = 3; r < max_y - 2; r++) {
+                mvinchnstr(r, 0, row, max_x);
+                if (memcmp(row, before + (size_t)r * (max_x + 1), (size_t)max_x * sizeof(chtype)) != 0) {
+                        // No drawn row has line -2, so the cache never matches it
+                        state->render_rows[r].line = -2;
+                }
+        }
+        move(cur_y, cur_x);
+        free(row);
+        free(before);
+}
+
+// Right-aligned on the prompt row: which search options are on
+static void draw_find_flags(int flags, int row, int max_x)
+{
+        char text[FIND_FLAGS_WIDTH + 1];
+        snprintf(text, sizeof(text), "%s%s%s",
+                 flags & SEARCH_IGNORE_CASE ? " [Aa]" : "",
+                 flags & SEARCH_WHOLE_WORD ? " [word]" : "",
+                 flags & SEARCH_REGEX ? " [.*]" : "");
+        mvprintw(row, max_x - FIND_FLAGS_WIDTH, "%*s", FIND_FLAGS_WIDTH, text);
+}
+
+// Ctrl+T toggles ignoring case, Ctrl+W whole-word matching and Ctrl+R regex mode
+static int toggle_find_flag(EditorState* state, int ch)
+{
+        int flag = ch == 20 ? SEARCH_IGNORE_CASE : ch == 23 ? SEARCH_WHOLE_WORD : ch == 18 ? SEARCH_REGEX : 0;
+        state->find_flags ^= flag;
+        return flag != 0;
+}
+
+static void draw_find_prompt(EditorState* state, const char* prompt, const char* term, int cursor_x)
+{
+        int max_y, max_x;
+        getmaxyx(stdscr, max_y, max_x);
+        attron(COLOR_PAIR(1));
+        mvprintw(max_y - 2, 0, "%s%s", prompt, term);
+        clrtoeol();
+        draw_find_flags(state->find_flags, max_y - 2, max_x);
+        move(max_y - 2, cursor_x);
+        refresh();
+}
+
+// Shows the matches found so far behind the open Find prompt
+static void show_incremental(EditorState* state, IncrementalSearch* inc, int x, int y, int scroll)
+{
+        state->find_mode = inc->matches.count > 0;
+        state->find_matches = inc->matches.items;
+        state->find_match_count = inc->matches.count;
+        state->find_current_match = 0;
+        state->find_version++;
+        if (inc->matches.count > 0) {
+                jump_to_match(state, inc->matches.items[0].line, inc->matches.items[0].col);
+        } else {
+                state->cursor_x = x;
+                state->cursor_y = y;
+                state->scroll_offset = scroll;
+        }
+        render_screen(state);
+}
+
 void find_text(EditorState* state)
 {
          echo();
@@ -271,6 +429,7 @@ void find_text(EditorState* state)
          int prompt_len = strlen(prompt);
          mvprintw(max_y - 2, 0, "%s", prompt);
          clrtoeol();
+         draw_find_flags(state->find_flags, max_y - 2, max_x);
          refresh();
 
          char search_term[256] = {0};
@@ -279,8 +438,48 @@ void find_text(EditorState* state)
          move(max_y - 2, cursor_x);
          refresh();
 
+         // Matches follow the term as it is typed; cancelling puts back what was shown before
+         IncrementalSearch inc;
+         memset(&inc, 0, sizeof(inc));
+         incsearch_update(&inc, search_term, state->find_flags);
+         char searched[256] = "";
+         int searched_flags = state->find_flags;
+         int slices = 0;
+         int saved_mode = state->find_mode;
+         SearchMatch* saved_matches = state->find_matches;
+         int saved_count = state->find_match_count;
+         int saved_current = state->find_current_match;
+         int saved_x = state->cursor_x, saved_y = state->cursor_y, saved_scroll = state->scroll_offset;
+
          while (1) {
-                 int ch = getch();
+                 if (strcmp(search_term, searched) != 0 || state->find_flags != searched_flags) {
+                         strcpy(searched, search_term);
+                         searched_flags = state->find_flags;
+                         incsearch_update(&inc, search_term, state->find_flags);
+                         incsearch_step(&inc, state, FIND_SLICE_MS);
+                         show_incremental(state, &inc, saved_x, saved_y, saved_scroll);
+                         draw_find_prompt(state, prompt, search_term, cursor_x);
+                         slices = 0;
+                 }
+
+                 int ch;
+                 if (!inc.done) {
+                         // Search in slices between keystrokes and show progress now and then
+                         timeout(0);
+                         ch = getch();
+                         timeout(-1);
+                         if (ch == ERR) {
+                                 int done = incsearch_step(&inc, state, FIND_SLICE_MS);
+                                 if (done || ++slices % FIND_SHOW_SLICES == 0) {
+                                         show_incremental(state, &inc, saved_x, saved_y, saved_scroll);
+                                         draw_find_prompt(state, prompt, search_term, cursor_x);
+                                 }
+                                 continue;
+                         }
+                 } else {
+                         ch = getch();
+                 }
+
                  if (ch == '\n' || ch == KEY_ENTER) {
                          break;
                  } else if (ch == 27) {
@@ -327,6 +526,12 @@ void find_text(EditorState* state)
                                  move(max_y - 2, cursor_x);
                                  refresh();
                          }
+                 } else if (toggle_find_flag(state, ch)) {
+                         mvprintw(max_y - 2, 0, "%s%s", prompt, search_term);
+                         clrtoeol();
+                         draw_find_flags(state->find_flags, max_y - 2, max_x);
+                         move(max_y - 2, cursor_x);
+                         refresh();
                  } else if (ch == 22) {  
                          char* clipboard = get_system_clipboard();
                          if (clipboard) {
@@ -340,7 +545,7 @@ void find_text(EditorState* state)
                                  free(clipboard);
                                  refresh();
                          }
-                 } else if (isprint(ch) && input_pos < (int)sizeof(search_term) - 1 && cursor_x < max_x - 1) {
+                 } else if (isprint(ch) && input_pos < (int)sizeof(search_term) - 1 && cursor_x < max_x - FIND_FLAGS_WIDTH - 1) {
                          search_term[input_pos++] = ch;
                          mvprintw(max_y - 2, cursor_x++, "%c", ch);
                          refresh();
@@ -352,98 +557,73 @@ void find_text(EditorState* state)
 
          attroff(COLOR_PAIR(1));
 
+         state->find_mode = saved_mode;
+         state->find_matches = saved_matches;
+         state->find_match_count = saved_count;
+         state->find_current_match = saved_current;
+         state->find_version++;
+         state->cursor_x = saved_x;
+         state->cursor_y = saved_y;
+         state->scroll_offset = saved_scroll;
+
          if (strlen(search_term) == 0) {
+                 incsearch_free(&inc);
                  return;
          }
 
+         // A pass that finished for this very term is the answer; otherwise search it all now
+         if (inc.done && inc.valid && strcmp(inc.term, search_term) == 0 && inc.flags == state->find_flags) {
+                 if (inc.matches.count == 0) {
+                         show_status(state, "The word is not present in this file");
+                 } else {
+                         navigate_matches(state, search_term, inc.matches.items, inc.matches.count);
+                         inc.matches.items = NULL;
+                 }
+                 incsearch_free(&inc);
+                 return;
+         }
+         incsearch_free(&inc);
          find_all_occurrences(state, search_term);
 }
 
+// Live match count while a large document is searched on the worker pool
+static void show_search_progress(EditorState* state, long matches)
+{
+        (void)state;
+        mvprintw(getmaxy(stdscr) - 2, 0, "Searching... %ld matches so far", matches);
+        clrtoeol();
+        refresh();
+}
+
 void find_all_occurrences(EditorState* state,
         const char* search_term)
 {
-
-        const int initial_capacity = 64;
-        int capacity = initial_capacity;
-        int match_count = 0;
-
-        int * match_lines = (int * ) malloc(capacity * sizeof(int));
-        int * match_positions = (int * ) malloc(capacity * sizeof(int));
-
-        if (!match_lines || !match_positions) {
-                show_status(state, "Memory allocation failed");
-                free(match_lines);
-                free(match_positions);
+        SearchPattern pattern;
+        if (search_compile(&pattern, search_term, state->find_flags) != 0) {
+                if (state->find_flags & SEARCH_REGEX) show_status(state, "Invalid regular expression");
                 return;
         }
 
-        const int term_len = strlen(search_term);
-        char ** lines = state -> lines;
-        const int line_count = state -> line_count;
-
-        for (int i = 0; i < line_count; i++) {
-                const char * line = lines[i];
-                const char * pos = line;
-
-                while ((pos = strstr(pos, search_term)) != NULL) {
-
-                        if (match_count >= capacity) {
-                                capacity *= 2;
-                                int * new_lines = (int * ) realloc(match_lines, capacity * sizeof(int));
-                                int * new_positions = (int * ) realloc(match_positions, capacity * sizeof(int));
-
-                                if (!new_lines || !new_positions) {
-                                        show_status(state, "Memory reallocation failed");
-                                        free(match_lines);
-                                        free(match_positions);
-                                        return;
-                                }
-
-                                match_lines = new_lines;
-                                match_positions = new_positions;
-                        }
-
-                        match_lines[match_count] = i;
-                        match_positions[match_count] = pos - line;
-                        match_count++;
-
-                        pos += term_len;
-
-                        if (term_len == 0) break;
-                }
+        MatchList matches = {0};
+        int failed = search_document(state, &pattern, &matches, show_search_progress) != 0;
+        search_pattern_free(&pattern);
+        if (failed) {
+                match_list_free(&matches);
+                show_status(state, "Memory allocation failed");
+                return;
         }
 
-        if (match_count == 0) {
+        if (matches.count == 0) {
+                match_list_free(&matches);
                 show_status(state, "The word is not present in this file");
-                free(match_lines);
-                free(match_positions);
                 return;
         }
 
-        int unique_lines[1024];
-        int unique_count = 0;
-        for(int j=0; j<match_count && unique_count < 1024; j++){
-            int line = match_lines[j];
-            int found = 0;
-            for(int k=0; k<unique_count; k++){
-                if(unique_lines[k] == line){ found=1; break; }
-            }
-            if(!found) unique_lines[unique_count++] = line;
-        }
-        
-        // Only enter find mode if there are matches
-        if (match_count > 0) {
-                navigate_matches(state, search_term, match_lines, match_positions, match_count);
-        } else {
-                // Free match arrays if no matches
-                free(match_lines);
-                free(match_positions);
-                show_status(state, "Occurences: 0");
-        }
+        navigate_matches(state, search_term, matches.items, matches.count);
 }
 
 void navigate_matches(EditorState* state,
-        const char* search_term, int* match_lines, int* match_positions, int match_count)
+        const char* search_term, SearchMatch* matches, int match_count)
 {
         if (match_count == 0) return;
 
@@ -452,13 +632,14 @@ void navigate_matches(EditorState* state,
         state->find_escape_pressed = 0;
         state->find_match_count = match_count;
         state->find_current_match = 0;
-        state->find_match_lines = match_lines;
-        state->find_match_positions = match_positions;
+        free(state->find_matches);
+        state->find_matches = matches;
+        state->find_version++;
         strncpy(state->find_search_term, search_term, sizeof(state->find_search_term) - 1);
         state->find_search_term[sizeof(state->find_search_term) - 1] = '\0';
 
         // Jump to first match
-        jump_to_match(state, match_lines[0], match_positions[0]);
+        jump_to_match(state, matches[0].line, matches[0].col);
 
         // Render screen to show the first match
         render_screen(state);
@@ -497,6 +678,7 @@ void replace_text(EditorState* state)
          int prompt1_len = strlen(prompt1);
          mvprintw(max_y - 2, 0, "%s", prompt1);
          clrtoeol();
+         draw_find_flags(state->find_flags, max_y - 2, max_x);
          refresh();
 
          char search_term[256] = {0};
@@ -553,6 +735,12 @@ void replace_text(EditorState* state)
                                  move(max_y - 2, cursor_x);
                                  refresh();
                          }
+                 } else if (toggle_find_flag(state, ch)) {
+                         mvprintw(max_y - 2, 0, "%s%s", prompt1, search_term);
+                         clrtoeol();
+                         draw_find_flags(state->find_flags, max_y - 2, max_x);
+                         move(max_y - 2, cursor_x);
+                         refresh();
                  } else if (ch == 22) {  
                          char* clipboard = get_system_clipboard();
                          if (clipboard) {
@@ -566,7 +754,7 @@ void replace_text(EditorState* state)
                                  free(clipboard);
                                  refresh();
                          }
-                 } else if (isprint(ch) && input_pos < (int)sizeof(search_term) - 1 && cursor_x < max_x - 1) {
+                 } else if (isprint(ch) && input_pos < (int)sizeof(search_term) - 1 && cursor_x < max_x - FIND_FLAGS_WIDTH - 1) {
                          search_term[input_pos++] = ch;
                          mvprintw(max_y - 2, cursor_x++, "%c", ch);
                          refresh();
@@ -580,13 +768,21 @@ void replace_text(EditorState* state)
          }
 
          
+         SearchPattern pattern;
+         if (search_compile(&pattern, search_term, state->find_flags) != 0) {
+                 noecho();
+                 curs_set(0);
+                 show_status(state, "Invalid regular expression");
+                 return;
+         }
          int exists = 0;
          for (int i = 0; i < state->line_count; i++) {
-                 if (strstr(state->lines[i], search_term)) {
+                 if (search_line(&pattern, state->lines[i], doc_line_length(state, i), 0, NULL) >= 0) {
                          exists = 1;
                          break;
                  }
          }
+         search_pattern_free(&pattern);
 
          if (!exists) {
                  noecho();
@@ -685,42 +881,41 @@ void replace_text(EditorState* state)
          replace_text_simple(state, search_term, replace_term);
 }
 
+static void show_replace_progress(EditorState* state, long matches)
+{
+        (void)state;
+        mvprintw(getmaxy(stdscr) - 2, 0, "Replacing... %ld matches so far", matches);
+        clrtoeol();
+        refresh();
+}
+
 void replace_text_simple(EditorState* state,
         const char* search_term,
                 const char* replace_term)
 {
+        SearchPattern pattern;
+        if (search_compile(&pattern, search_term, state->find_flags) != 0) return;
 
-        int replacements = 0;
-        for (int i = 0; i < state -> line_count; i++) {
-                char * pos = strstr(state -> lines[i], search_term);
-                while (pos) {
-                        int old_len = strlen(state -> lines[i]);
-                        int search_len = strlen(search_term);
-                        int replace_len = strlen(replace_term);
-                        int new_len = old_len - search_len + replace_len;
-
-                        if (new_len < MAX_LINE_LENGTH) {
-                                int offset = pos - state -> lines[i];
-                                memmove( & state -> lines[i][offset + replace_len], &
-                                        state -> lines[i][offset + search_len],
-                                        old_len - offset - search_len + 1);
-                                memcpy( & state -> lines[i][offset], replace_term, replace_len);
-
-                                replacements++;
-                                pos = strstr( & state -> lines[i][offset + replace_len], search_term);
-                        } else {
-                                break;
-                        }
-                }
+        ReplaceStats stats;
+        int failed = search_replace_all(state, &pattern, replace_term, show_replace_progress, &stats) != 0;
+        search_pattern_free(&pattern);
+        if (failed) {
+                show_status(state, "Memory allocation failed");
+                return;
         }
-
-        if (replacements > 0) {
-                state -> dirty = 1;
-                char msg[256];
-                snprintf(msg, sizeof(msg), "Replaced %s with %s", search_term, replace_term);
-                show_status(state, msg);
+        if (stats.replaced > 0) state -> dirty = 1;
+
+        char msg[256];
+        if (stats.skipped > 0 || stats.failed > 0) {
+                snprintf(msg, sizeof(msg), "Replaced %ld occurrences of %s with %s; %ld left on lines too long, %ld failed (out of memory)",
+                         stats.replaced, search_term, replace_term, stats.skipped, stats.failed);
+        } else if (stats.replaced > 0) {
+                snprintf(msg, sizeof(msg), "Replaced %ld occurrences of %s with %s on %ld lines",
+                         stats.replaced, search_term, replace_term, stats.lines);
         } else {
+                return;
         }
+        show_status(state, msg);
 }
 
 
@@ -857,6 +1052,7 @@ void cycle_theme(EditorState* state)
         init_theme_colors(state);
         clear();
         refresh();
+        state->render_invalid = 1;
     }
     save_config(state);
 